@@ -0,0 +1,236 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * compares vmarena against malloc/free on a workload resembling a request
+ * handler: split a query string into parameters, build a small table of
+ * records, format a few header values and use a temporary buffer in a
+ * nested scope. everything is released at the end of each request.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "vmarena.h"
+
+static const char QUERY[] = "id=1234567&site=example.com&ref=http%3A%2F%2Fwww.example.com%2Fpage&w=300&h=250&"
+    "pos=atf&cb=982734123&ua=Mozilla%2F5.0&lang=en-US&tz=-480&sz=300x250&fmt=vast&ver=2&dnt=0&gdpr=1&us=1";
+
+enum
+{
+    MAX_PARAMS = 32,
+    NUM_RECORDS = 24,
+    MAX_ALLOCS = 128
+};
+
+struct param
+{
+    char *name;
+    char *value;
+};
+
+struct record
+{
+    uint64_t id;
+    double score;
+    char *label;
+};
+
+struct arena_handler
+{
+    static int handle(vmarena &arena, uint64_t n)
+    {
+        param *params = arena.alloc<param>(MAX_PARAMS);
+        int num_params = 0;
+        for (const char *p = QUERY; *p && num_params < MAX_PARAMS; ++num_params)
+        {
+            const char *eq = strchrnul(p, '=');
+            const char *amp = strchrnul(eq, '&');
+            params[num_params].name = arena.strndup(p, eq - p);
+            params[num_params].value = *eq ? arena.strndup(eq + 1, amp - eq - 1) : NULL;
+            p = *amp ? amp + 1 : amp;
+        }
+        record *records = arena.alloc<record>(NUM_RECORDS);
+        for (int i = 0; i < NUM_RECORDS; ++i)
+        {
+            records[i].id = n + i;
+            records[i].score = i * 0.5;
+            records[i].label = arena.sprintf("%s-%d", params[i % num_params].name, i);
+        }
+        char *cookie = arena.sprintf("uid=%llu; Max-Age=%u; Domain=\"%s\"", (unsigned long long)n, 86400, params[1].value);
+        int res = strlen(cookie);
+        {
+            vmarena::scope s(arena);
+            char *tmp = (char *)arena.alloc(4096, 1);
+            for (int i = 0; i < NUM_RECORDS; ++i)
+                res += stpcpy(tmp, records[i].label) - tmp;
+        }
+        arena.reset();
+        return res;
+    }
+};
+
+struct malloc_handler
+{
+    static int handle(uint64_t n)
+    {
+        void *allocs[MAX_ALLOCS];
+        int num_allocs = 0;
+        param *params = (param *)malloc(sizeof(param) * MAX_PARAMS);
+        allocs[num_allocs++] = params;
+        int num_params = 0;
+        for (const char *p = QUERY; *p && num_params < MAX_PARAMS; ++num_params)
+        {
+            const char *eq = strchrnul(p, '=');
+            const char *amp = strchrnul(eq, '&');
+            allocs[num_allocs++] = params[num_params].name = strndup(p, eq - p);
+            params[num_params].value = NULL;
+            if (*eq)
+                allocs[num_allocs++] = params[num_params].value = strndup(eq + 1, amp - eq - 1);
+            p = *amp ? amp + 1 : amp;
+        }
+        record *records = (record *)malloc(sizeof(record) * NUM_RECORDS);
+        allocs[num_allocs++] = records;
+        for (int i = 0; i < NUM_RECORDS; ++i)
+        {
+            records[i].id = n + i;
+            records[i].score = i * 0.5;
+            if (0 > asprintf(&records[i].label, "%s-%d", params[i % num_params].name, i))
+                abort();
+            allocs[num_allocs++] = records[i].label;
+        }
+        char *cookie;
+        if (0 > asprintf(&cookie, "uid=%llu; Max-Age=%u; Domain=\"%s\"", (unsigned long long)n, 86400, params[1].value))
+            abort();
+        allocs[num_allocs++] = cookie;
+        int res = strlen(cookie);
+        char *tmp = (char *)malloc(4096);
+        for (int i = 0; i < NUM_RECORDS; ++i)
+            res += stpcpy(tmp, records[i].label) - tmp;
+        free(tmp);
+        for (int i = 0; i < num_allocs; ++i)
+            free(allocs[i]);
+        return res;
+    }
+};
+
+struct bench_args
+{
+    uint64_t num_requests;
+    bool use_arena;
+    double elapsed;
+    int res;
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *run(void *arg)
+{
+    bench_args *args = (bench_args *)arg;
+    vmarena arena;
+    int res = 0;
+    double start = now();
+    if (args->use_arena)
+        for (uint64_t i = 0; i < args->num_requests; ++i)
+            res += arena_handler::handle(arena, i);
+    else
+        for (uint64_t i = 0; i < args->num_requests; ++i)
+            res += malloc_handler::handle(i);
+    args->elapsed = now() - start;
+    args->res = res;
+    return NULL;
+}
+
+static double bench(bool use_arena, int num_threads, uint64_t num_requests)
+{
+    pthread_t threads[num_threads];
+    bench_args args[num_threads];
+    for (int i = 0; i < num_threads; ++i)
+    {
+        args[i].num_requests = num_requests;
+        args[i].use_arena = use_arena;
+        if (0 != pthread_create(&threads[i], NULL, run, &args[i]))
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    double total = 0;
+    for (int i = 0; i < num_threads; ++i)
+    {
+        pthread_join(threads[i], NULL);
+        total += args[i].elapsed;
+    }
+    return total / num_threads / num_requests * 1e9;
+}
+
+static void usage(char *arg0)
+{
+    printf("usage: %s [-n|--requests <# of requests per thread>]\n", arg0);
+    printf("       %*c [-t|--threads <# of threads>]\n", (int)strlen(arg0), ' ');
+    printf("       %*c [--help]\n", (int)strlen(arg0), ' ');
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"requests", 1, 0, 'n'},
+        {"threads", 1, 0, 't'},
+        {"help", 0, 0, 1},
+        {0, 0, 0, 0}
+    };
+
+    uint64_t num_requests = 1000000;
+    int num_threads = 1;
+
+    while (1)
+    {
+        int option_index = 0;
+        int c = getopt_long(argc, argv, "n:t:", long_options, &option_index);
+        if (c == -1)
+            break;
+        switch (c)
+        {
+        case 'n':
+            num_requests = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (0 == num_requests || 0 >= num_threads)
+        usage(argv[0]);
+
+    printf("%d thread(s), %llu requests each\n", num_threads, (unsigned long long)num_requests);
+    printf("malloc:  %8.1f ns/request\n", bench(false, num_threads, num_requests));
+    printf("vmarena: %8.1f ns/request\n", bench(true, num_threads, num_requests));
+    return 0;
+}
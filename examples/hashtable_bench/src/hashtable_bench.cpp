@@ -0,0 +1,294 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * compares lookups in hashtable against the chained table it replaced,
+ * and the hash policies against each other. keys are inserted once, then
+ * looked up in random order, half of them present and half of them missing.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include "hashtable.h"
+#include "compact_hashtable.h"
+
+/*
+ * the previous hashtable: djb2, buckets chained through the entries
+ */
+struct chained_hashtable
+{
+    struct entry_t
+    {
+        uint32_t next;
+        uint32_t key;
+        uint32_t key_len;
+        uint32_t val;
+        uint32_t val_len;
+    };
+
+    void init(uint32_t n)
+    {
+        for (uint32_t m = (((uint32_t)-1) >> 1) + 1; m >= n; mask = m, m >>= 1);
+        buf.init();
+        buf.alloczero(mask * sizeof(uint32_t));
+        --mask;
+    }
+
+    uint32_t bucket(const void *key, uint32_t n)
+    {
+        const unsigned char *p = (const unsigned char *)key;
+        const unsigned char *end = p + n;
+        uint32_t h = 5381;
+        for (; p != end; ++p)
+            h = ((h << 5) + h) ^ *p;
+        return h & mask;
+    }
+
+    void insert32(const void *key, uint32_t key_len, uint32_t val)
+    {
+        uint32_t b = bucket(key, key_len);
+        uint32_t ofs_key = buf.alloc(key_len);
+        uint32_t ofs_entry = buf.alloc(sizeof(entry_t));
+        memcpy(buf.data() + ofs_key, key, key_len);
+        entry_t *e = (entry_t *)(buf.data() + ofs_entry);
+        e->key = ofs_key;
+        e->key_len = key_len;
+        e->val = val;
+        uint32_t *ofs_bucket_ptr = (uint32_t *)buf.data() + b;
+        e->next = *ofs_bucket_ptr;
+        *ofs_bucket_ptr = ofs_entry;
+    }
+
+    uint32_t *lookup32(const void *key, uint32_t key_len)
+    {
+        uint32_t ofs_entry = *((uint32_t *)buf.data() + bucket(key, key_len));
+        while (ofs_entry > 0)
+        {
+            entry_t *e = (entry_t *)(buf.data() + ofs_entry);
+            if (e->key_len == key_len && 0 == memcmp(buf.data() + e->key, key, key_len))
+                return &e->val;
+            ofs_entry = e->next;
+        }
+        return NULL;
+    }
+
+    vmbuf buf;
+    uint32_t mask;
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_key(char *key, uint32_t key_len, uint32_t n)
+{
+    snprintf(key, key_len + 1, "%0*u", (int)key_len, n);
+}
+
+template<typename T>
+static void bench(const char *name, uint32_t num_keys, uint32_t key_len, uint32_t num_lookups, const uint32_t *order)
+{
+    T ht;
+    ht.init(num_keys);
+    char key[key_len + 1];
+    double start = now();
+    for (uint32_t i = 0; i < num_keys; ++i)
+    {
+        make_key(key, key_len, i * 2); // even keys are present, odd ones are missing
+        ht.insert32(key, key_len, i);
+    }
+    double insert_time = now() - start;
+
+    vmbuf keys;
+    keys.init();
+    for (uint32_t i = 0; i < num_lookups; ++i)
+    {
+        make_key(key, key_len, order[i]);
+        keys.memcpy(key, key_len);
+    }
+    uint64_t found = 0;
+    start = now();
+    for (uint32_t i = 0; i < num_lookups; ++i)
+    {
+        uint32_t *v = ht.lookup32(keys.data() + i * key_len, key_len);
+        if (v)
+            found += *v;
+    }
+    double lookup_time = now() - start;
+    printf("%-10s insert: %7.1f ns/key   lookup: %7.1f ns/key   (%llu)\n", name,
+           insert_time / num_keys * 1e9, lookup_time / num_lookups * 1e9, (unsigned long long)found);
+}
+
+/*
+ * start small and let the tables grow. the inserts which start a resize
+ * show how well the rehash is spread (timing every insert would mostly
+ * show scheduler noise)
+ */
+static void bench_growth(uint32_t num_keys, uint32_t key_len)
+{
+    hashtable ht;
+    ht.init();
+    compact_hashtable<uint64_t, uint32_t> cht;
+    cht.init(8);
+    char key[key_len + 1];
+    double total = 0, slowest = 0, cht_total = 0, cht_slowest = 0;
+    for (uint32_t i = 0; i < num_keys; ++i)
+    {
+        make_key(key, key_len, i);
+        uint32_t mask = ht.mask;
+        double start = now();
+        ht.insert32(key, key_len, i);
+        double t = now() - start;
+        total += t;
+        if (mask != ht.mask && t > slowest)
+            slowest = t;
+
+        mask = cht.mask;
+        start = now();
+        cht.insert(i, i);
+        t = now() - start;
+        cht_total += t;
+        if (mask != cht.mask && t > cht_slowest)
+            cht_slowest = t;
+    }
+    printf("growing from empty:\n");
+    printf("%-18s insert: %7.1f ns/key   slowest resize: %8.1f us   (%u slots)\n", "hashtable",
+           total / num_keys * 1e9, slowest * 1e6, ht.mask + 1);
+    printf("%-18s insert: %7.1f ns/key   slowest resize: %8.1f us   (%u buckets)\n", "compact_hashtable",
+           cht_total / num_keys * 1e9, cht_slowest * 1e6, cht.mask + 1);
+}
+
+/*
+ * a cache of num_keys which keeps replacing its oldest key, compacted a
+ * step at a time as it goes (how a long running cache would use it)
+ */
+static void bench_churn(uint32_t num_keys, uint32_t key_len)
+{
+    hashtable ht;
+    ht.init(num_keys);
+    compact_hashtable<uint64_t, uint32_t> cht;
+    cht.init(num_keys);
+    char key[key_len + 1];
+    for (uint32_t i = 0; i < num_keys; ++i)
+    {
+        make_key(key, key_len, i);
+        ht.insert32(key, key_len, i);
+        cht.insert(i, i);
+    }
+    size_t used = ht.get_used_bytes();
+    double slowest = 0, cht_slowest = 0;
+    for (uint32_t i = num_keys; i < num_keys * 3; ++i)
+    {
+        make_key(key, key_len, i - num_keys);
+        ht.remove(key, key_len);
+        cht.remove(i - num_keys);
+        make_key(key, key_len, i);
+        ht.insert32(key, key_len, i);
+        cht.insert(i, i);
+        if (0 == (i & 63))
+        {
+            double start = now();
+            ht.compact();
+            double t = now() - start;
+            if (t > slowest)
+                slowest = t;
+            start = now();
+            cht.compact();
+            t = now() - start;
+            if (t > cht_slowest)
+                cht_slowest = t;
+        }
+    }
+    printf("replacing %u keys twice, compacting every 64:\n", num_keys);
+    printf("%-18s used: %8zu KB (%zu KB full)   dead: %8zu KB   reclaimed: %8llu KB   slowest compact: %8.1f us\n", "hashtable",
+           ht.get_used_bytes() / 1024, used / 1024, ht.get_dead_bytes() / 1024,
+           (unsigned long long)ht.get_reclaimed_bytes() / 1024, slowest * 1e6);
+    printf("%-18s used: %8zu KB   dead: %8zu KB   reclaimed: %8llu entries   slowest compact: %8.1f us\n", "compact_hashtable",
+           cht.entries.wlocpos() / 1024, cht.get_dead_bytes() / 1024,
+           (unsigned long long)cht.get_reclaimed(), cht_slowest * 1e6);
+}
+
+static void usage(char *arg0)
+{
+    printf("usage: %s [-n|--keys <# of keys>]\n", arg0);
+    printf("       %*c [-l|--lookups <# of lookups>]\n", (int)strlen(arg0), ' ');
+    printf("       %*c [-k|--key-length <key length>]\n", (int)strlen(arg0), ' ');
+    printf("       %*c [--help]\n", (int)strlen(arg0), ' ');
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"keys", 1, 0, 'n'},
+        {"lookups", 1, 0, 'l'},
+        {"key-length", 1, 0, 'k'},
+        {"help", 0, 0, 1},
+        {0, 0, 0, 0}
+    };
+
+    uint32_t num_keys = 1000000;
+    uint32_t num_lookups = 4000000;
+    uint32_t key_len = 16;
+
+    while (1)
+    {
+        int option_index = 0;
+        int c = getopt_long(argc, argv, "n:l:k:", long_options, &option_index);
+        if (c == -1)
+            break;
+        switch (c)
+        {
+        case 'n':
+            num_keys = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            num_lookups = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            key_len = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (0 == num_keys || 0 == num_lookups || 10 > key_len || 1024 < key_len)
+        usage(argv[0]);
+
+    vmbuf order;
+    order.init(num_lookups * sizeof(uint32_t));
+    srandom(1);
+    for (uint32_t i = 0; i < num_lookups; ++i)
+        *order.alloc<uint32_t>() = random() % (num_keys * 2);
+
+    printf("%u keys of %u bytes, %u lookups (50%% hits)\n", num_keys, key_len, num_lookups);
+    bench<chained_hashtable>("chained", num_keys, key_len, num_lookups, (const uint32_t *)order.data());
+    bench<hashtable>("hashtable", num_keys, key_len, num_lookups, (const uint32_t *)order.data());
+    bench<hashtable_common<hash_crc32c> >("ht/crc32c", num_keys, key_len, num_lookups, (const uint32_t *)order.data());
+    bench<hashtable_common<hash_djb2> >("ht/djb2", num_keys, key_len, num_lookups, (const uint32_t *)order.data());
+    bench_growth(num_keys, key_len);
+    bench_churn(num_keys, key_len);
+    return 0;
+}
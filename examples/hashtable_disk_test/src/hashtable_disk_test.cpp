@@ -0,0 +1,385 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * hashtable_disk against a model: inserts, updates and removes (the
+ * robin hood backward shift) while growing, checked in the middle of a
+ * resize and after a reload. a forked child _exits part way through a
+ * resize, with and without the log, and the parent's load() has to
+ * finish it (finish_resize, or the log's checkpoint). a crash after the
+ * last move but before the rename, and a file written by plain linear
+ * probing before robin hood (rebuild). the exit code is the number of
+ * failed checks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "hashtable_disk.h"
+#include "logger.h"
+
+enum
+{
+    NUM_KEYS = 40000,
+    NUM_OPS = 200000,
+    NUM_CRASHES = 8, // without the log each reload doubles .dat (it loads at the file size)
+    OLD_CAPACITY = 1024,
+    OLD_KEYS = 500
+};
+
+static int num_failed = 0;
+
+#define CHECK(cond) do { if (!(cond)) { ++num_failed; LOGGER_ERROR("%s: check failed: %s", name, #cond); } } while (0)
+
+struct progress_t // shared with the child
+{
+    uint32_t done; // updates applied
+    uint32_t resizing; // the child stopped while growing
+};
+
+static volatile progress_t *progress;
+static char dir[] = "/tmp/hashtable_disk_test.XXXXXX";
+static char base[sizeof(dir) + 2];
+static uint32_t model[NUM_KEYS]; // 1 + the update which set the key's value, 0 when it isn't there
+
+static int make_key(char *k, uint32_t key)
+{
+    return sprintf(k, "key%u", key);
+}
+
+static int make_val(char *v, uint32_t key, uint32_t i)
+{
+    return sprintf(v, "val%u-%u%s", key, i, 0 == i % 3 ? "-a longer one" : "");
+}
+
+/*
+ * update i, the same one every time. the key space widens with i so the
+ * table keeps growing
+ */
+static void apply(hashtable_disk *h, uint32_t i)
+{
+    uint32_t x = (i + 1) * 2654435761u;
+    uint32_t num_keys = 256 + i / 4 < (uint32_t)NUM_KEYS ? 256 + i / 4 : (uint32_t)NUM_KEYS;
+    uint32_t key = (x >> 8) % num_keys;
+    char k[32], v[64];
+    int kl = make_key(k, key);
+    int vl = make_val(v, key, i);
+    uint32_t op = (x >> 3) % 10;
+    if (op < 5)
+    {
+        model[key] = i + 1;
+        if (h)
+            h->insert_or_update(k, kl, v, vl);
+    } else if (op < 8)
+    {
+        if (0 == model[key])
+            model[key] = i + 1;
+        if (h)
+            h->insert_unique(k, kl, v, vl);
+    } else
+    {
+        model[key] = 0;
+        if (h)
+            h->remove(k, kl);
+    }
+}
+
+static void build_model(uint32_t n)
+{
+    memset(model, 0, sizeof(model));
+    for (uint32_t i = 0; i < n; ++i)
+        apply(NULL, i);
+}
+
+static void check_table(const char *name, hashtable_disk &h)
+{
+    int bad = 0;
+    uint32_t n = 0;
+    char k[32], v[64];
+    for (uint32_t key = 0; key < NUM_KEYS; ++key)
+    {
+        int kl = make_key(k, key);
+        uint32_t ofs = h.lookup(k, kl);
+        if (0 == model[key])
+        {
+            bad += 0 != ofs;
+            continue;
+        }
+        ++n;
+        int vl = make_val(v, key, model[key] - 1);
+        if (0 == ofs || (uint32_t)vl != h.get_val_size(ofs) || 0 != memcmp(v, h.get_val(ofs), vl))
+            ++bad;
+    }
+    if (0 < bad)
+        LOGGER_ERROR("%s: %d keys don't match", name, bad);
+    CHECK(0 == bad);
+    CHECK(n == h.num_keys());
+}
+
+/*
+ * checked every so often, and at least once in the middle of each resize
+ */
+static void test_updates(bool mem)
+{
+    const char *name = mem ? "updates, in memory" : "updates";
+    hashtable_disk h;
+    CHECK(0 == (mem ? h.create_mem() : h.create(base)));
+    memset(model, 0, sizeof(model));
+    uint32_t num_resizes = 0;
+    bool checked_resize = false;
+    for (uint32_t i = 0; i < NUM_OPS; ++i)
+    {
+        apply(&h, i);
+        if (!h.is_resizing())
+            checked_resize = false;
+        else if (!checked_resize && h.resize_pos > h.old_mask / 2)
+        {
+            check_table(name, h);
+            checked_resize = true;
+            ++num_resizes;
+        } else if (0 == (i + 1) % 25000)
+            check_table(name, h);
+    }
+    CHECK(8 <= num_resizes);
+    check_table(name, h);
+    if (mem)
+        return;
+    CHECK(0 == h.close());
+    hashtable_disk h2;
+    CHECK(0 == h2.load(base));
+    check_table(name, h2);
+    for (uint32_t i = NUM_OPS; i < NUM_OPS + 20000; ++i)
+        apply(&h2, i);
+    check_table(name, h2);
+    CHECK(0 == h2.close());
+}
+
+/*
+ * a child updates the table until it is part way through a resize (a
+ * different part each time) and _exits
+ */
+static void test_crash_growing(int mode)
+{
+    const char *name = wal::OFF == mode ? "crash growing" : "crash growing, logged";
+    uint32_t done = 0, num_resizing = 0;
+    for (int crash = 0; crash < NUM_CRASHES; ++crash)
+    {
+        progress->done = done;
+        progress->resizing = 0;
+        pid_t pid = fork();
+        if (0 == pid)
+        {
+            hashtable_disk h;
+            h.set_durability(mode);
+            if (0 > (0 == crash ? h.create(base) : h.load(base)))
+                _exit(EXIT_FAILURE);
+            uint32_t quarter = crash % 4;
+            uint32_t i = done;
+            for (; i < done + NUM_OPS; ++i)
+            {
+                apply(&h, i);
+                progress->done = i + 1;
+                if (h.is_resizing() && h.resize_pos >= (h.old_mask + 1) / 4 * quarter)
+                {
+                    progress->resizing = 1;
+                    break;
+                }
+            }
+            _exit(EXIT_SUCCESS);
+        }
+        int status;
+        CHECK(pid == waitpid(pid, &status, 0) && WIFEXITED(status) && EXIT_SUCCESS == WEXITSTATUS(status));
+        done = progress->done;
+        num_resizing += progress->resizing;
+        build_model(done);
+        hashtable_disk h;
+        h.set_durability(mode);
+        CHECK(0 == h.load(base));
+        if (wal::OFF == mode) // the replay can start growing again
+        {
+            CHECK(!h.is_resizing());
+            CHECK(0 > access(h.get_filename(hashtable_disk::FN_TMP), F_OK));
+        }
+        check_table(name, h);
+        CHECK(0 == h.close());
+    }
+    CHECK(NUM_CRASHES / 2 <= num_resizing);
+}
+
+static int copy_file(const char *from, const char *to)
+{
+    char buf[65536];
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    ssize_t n = 0;
+    while (0 <= in && 0 <= out && 0 < (n = read(in, buf, sizeof(buf))) && n == write(out, buf, n));
+    if (0 <= in)
+        close(in);
+    if (0 <= out)
+        close(out);
+    return 0 <= in && 0 <= out && 0 == n ? 0 : -1;
+}
+
+/*
+ * the last move done and the header updated, the .tmp not renamed yet:
+ * put the .bkt from before the last step back and the new one as the .tmp
+ */
+static void test_crash_before_rename()
+{
+    const char *name = "crash before the rename";
+    hashtable_disk h;
+    CHECK(0 == h.create(base));
+    memset(model, 0, sizeof(model));
+    uint32_t i = 0;
+    for (; !h.is_resizing() || h.mask < 4095; ++i)
+        apply(&h, i);
+    while (h.old_mask - h.resize_pos >= hashtable_disk::RESIZE_STEP)
+        h.resize_step(hashtable_disk::RESIZE_STEP);
+    char bkt[sizeof(base) + 8], tmp[sizeof(base) + 8], old[sizeof(base) + 8];
+    sprintf(bkt, "%s.bkt", base);
+    sprintf(tmp, "%s.tmp", base);
+    sprintf(old, "%s.old", base);
+    CHECK(0 == copy_file(bkt, old));
+    h.resize_step(hashtable_disk::RESIZE_STEP);
+    CHECK(!h.is_resizing());
+    CHECK(0 == rename(bkt, tmp));
+    CHECK(0 == rename(old, bkt));
+    hashtable_disk h2;
+    CHECK(0 == h2.load(base));
+    CHECK(h.mask == h2.mask);
+    CHECK(0 > access(tmp, F_OK));
+    check_table(name, h2);
+    CHECK(0 == h2.close());
+    CHECK(0 == h.close());
+}
+
+/*
+ * .dat and .bkt as written before robin hood (and the hash ids): djb2 and
+ * plain linear probing, which a robin hood lookup's early stop would miss
+ * entries of
+ */
+static void test_pre_robin_hood()
+{
+    const char *name = "pre robin hood";
+    vmbuf dat, bkt;
+    dat.init();
+    bkt.init();
+    hashtable_disk::ht_header_t header;
+    header.capacity = OLD_CAPACITY;
+    header.mask = OLD_CAPACITY - 1;
+    header.size = OLD_KEYS;
+    dat.copy<hashtable_disk::ht_header_t>(header);
+    hashtable_disk::entry_t *entries = (hashtable_disk::entry_t *)bkt.data(bkt.alloczero(OLD_CAPACITY * sizeof(hashtable_disk::entry_t)));
+    memset(model, 0, sizeof(model));
+    char k[32], v[64];
+    for (uint32_t key = 0; key < OLD_KEYS; ++key)
+    {
+        int kl = make_key(k, key);
+        int vl = make_val(v, key, key);
+        hashtable_disk::entry_t e;
+        e.hashcode = hash_policy::hash(hash_policy::DJB2, k, kl);
+        e.rec_ofs = dat.wlocpos();
+        dat.copy<uint32_t>(kl);
+        dat.copy<uint32_t>(vl);
+        dat.memcpy(k, kl);
+        dat.memcpy(v, vl);
+        uint32_t bucket = e.hashcode & (OLD_CAPACITY - 1);
+        while (0 != entries[bucket].rec_ofs)
+            bucket = (bucket + 1) & (OLD_CAPACITY - 1);
+        entries[bucket] = e;
+        model[key] = key + 1;
+    }
+    char fn[sizeof(base) + 8];
+    sprintf(fn, "%s.dat", base);
+    FILE *f = fopen(fn, "w");
+    CHECK(NULL != f && 1 == fwrite(dat.data(), dat.wlocpos(), 1, f) && 0 == fclose(f));
+    sprintf(fn, "%s.bkt", base);
+    f = fopen(fn, "w");
+    CHECK(NULL != f && 1 == fwrite(bkt.data(), bkt.wlocpos(), 1, f) && 0 == fclose(f));
+    dat.free();
+    bkt.free();
+
+    hashtable_disk h;
+    CHECK(0 == h.load(base));
+    CHECK(h.header()->is_robin_hood());
+    CHECK(hash_policy::DJB2 == h.header()->get_hash_id());
+    check_table(name, h);
+    // still updates as a robin hood table, grows, and loads again
+    for (uint32_t key = 0; key < OLD_KEYS; key += 3)
+    {
+        int kl = make_key(k, key);
+        CHECK(0 == h.remove(k, kl));
+        model[key] = 0;
+    }
+    for (uint32_t key = OLD_KEYS; key < 4 * OLD_KEYS; ++key)
+    {
+        int kl = make_key(k, key);
+        int vl = make_val(v, key, key);
+        h.insert(k, kl, v, vl);
+        model[key] = key + 1;
+    }
+    check_table(name, h);
+    CHECK(0 == h.close());
+    hashtable_disk h2;
+    CHECK(0 == h2.load(base));
+    check_table(name, h2);
+    CHECK(0 == h2.close());
+}
+
+static void remove_files()
+{
+    const char *ext[] = { "dat", "bkt", "tmp", "old", "wal", "wal.tmp" };
+    char fn[sizeof(base) + 8];
+    for (size_t i = 0; i < sizeof(ext) / sizeof(ext[0]); ++i)
+    {
+        sprintf(fn, "%s.%s", base, ext[i]);
+        unlink(fn);
+    }
+}
+
+int main()
+{
+    progress = (progress_t *)mmap(NULL, sizeof(progress_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == progress || NULL == mkdtemp(dir))
+    {
+        LOGGER_PERROR_STR("hashtable_disk_test");
+        return EXIT_FAILURE;
+    }
+    sprintf(base, "%s/t", dir);
+    test_updates(true);
+    test_updates(false);
+    remove_files();
+    test_crash_growing(wal::OFF);
+    remove_files();
+    test_crash_growing(wal::ASYNC);
+    remove_files();
+    test_crash_before_rename();
+    remove_files();
+    test_pre_robin_hood();
+    remove_files();
+    rmdir(dir);
+    if (0 < num_failed)
+        LOGGER_ERROR("%d checks failed", num_failed);
+    else
+        LOGGER_INFO_STR("all checks passed");
+    return num_failed;
+}
@@ -39,23 +39,27 @@
 
 #define LISTEN_BACKLOG 32768
 
-static struct epoll_server_event_array events_array;
-
 struct MyServer : http_server
 {
-    //static __thread vmpool_op<server_epoll_event> pool;
     static int init_per_thread()
     {
-        /*
-        static __thread vmpool<MyServer> *myserver_pool = NULL;
-        myserver_pool = new vmpool<MyServer>;
-        pool = myserver_pool->get_op<server_epoll_event>();
-        acceptor.init_per_thread(pool);
-        */
         acceptor.init_per_thread();
         return 0;
     }
 
+    static void shrink_idle(MyServer *s)
+    {
+        s->shrink();
+    }
+
+    static int on_idle()
+    {
+        pool.for_each_local(shrink_idle);
+        http_server::shrink_arena();
+        logger::shrink();
+        return 0;
+    }
+
     void handle_accept()
     {
         //printf("accept: %d\n", fd);
@@ -81,16 +85,19 @@ struct MyServer : http_server
         if (0 > ffd)
             return response(HTTP_STATUS_404, HTTP_CONTENT_TYPE_TEXT_PLAIN);
 
-        /*
-        http_server *h = (http_server *)pool.get();
+        http_server *h = (http_server *)acceptor.pool.get();
+        if (NULL == h)
+        {
+            ::close(ffd);
+            return response(HTTP_STATUS_503, HTTP_CONTENT_TYPE_TEXT_PLAIN);
+        }
         h->fd = ffd;
-        */
-        http_server *h = (http_server *)events_array.get(ffd);
+        h->pool = &acceptor.pool;
         if (0 > h->sendFile(this))
         {
             struct stat st;
             int res = fstat(ffd, &st);
-            //pool.put(h);
+            acceptor.pool.put(h);
             ::close(ffd);
             if (res == 0 && S_ISDIR(st.st_mode) && 0 == generateDirList(file))
             {
@@ -148,10 +155,11 @@ struct MyServer : http_server
     }
     
     static struct acceptor acceptor;
+    static vmpool<MyServer> pool;
 };
-//__thread vmpool_op<server_epoll_event> MyServer::pool;
 
 struct acceptor MyServer::acceptor;
+vmpool<MyServer> MyServer::pool;
 
 int init_signals();
 
@@ -221,12 +229,15 @@ int main(int argc, char *argv[])
         daemon::start(NULL, pidfile, logfile);
 
     epoll::set_per_thread_callback(MyServer::init_per_thread);
+    epoll::set_idle_callback(MyServer::on_idle);
     mime_types::instance()->load();
     if (0 > epoll::init(timeout, timeout))
         abort();
     
-    events_array.init(class_factory<MyServer>::create);
-    if (0 > MyServer::acceptor.init(-1, port, LISTEN_BACKLOG, &events_array))
+    struct rlimit rlim;
+    if (0 > getrlimit(RLIMIT_NOFILE, &rlim) || 0 > MyServer::pool.init(rlim.rlim_cur))
+        abort();
+    if (0 > MyServer::acceptor.init(-1, port, LISTEN_BACKLOG, MyServer::pool.get_op<server_epoll_event>()))
         abort();
     MyServer::acceptor.callback.set(&MyServer::handle_request);
     MyServer::acceptor.accept_callback.set(&MyServer::handle_accept);
@@ -0,0 +1,222 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * lookups one at a time vs lookup_batch in hashtable_file, on a table
+ * meant to be larger than the last level cache, finalized with the probing
+ * buckets and with the perfect hash, and in hashtable_disk (robin hood),
+ * which also reports its slowest insert (resizing is incremental).
+ * keys are looked up in random order, half of them present and half of
+ * them missing, in batches the size of a request's.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "hashtable_file.h"
+#include "hashtable_disk.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_key(char *key, uint32_t key_len, uint32_t n)
+{
+    snprintf(key, key_len + 1, "%0*u", (int)key_len, n);
+}
+
+template<typename T>
+static void bench(const char *name, T &ht, size_t table_size, uint32_t num_lookups, uint32_t batch,
+                  const void *const *keys, const size_t *key_lens)
+{
+    uint32_t *res = new uint32_t[num_lookups];
+    uint32_t *res_batch = new uint32_t[num_lookups];
+
+    for (uint32_t i = 0; i < num_lookups; ++i) // fault the pages in
+        res[i] = ht.lookup(keys[i], key_lens[i]);
+
+    double start = now();
+    for (uint32_t i = 0; i < num_lookups; ++i)
+        res[i] = ht.lookup(keys[i], key_lens[i]);
+    double single_time = now() - start;
+
+    start = now();
+    for (uint32_t i = 0; i < num_lookups; i += batch)
+        ht.lookup_batch(keys + i, key_lens + i, num_lookups - i < batch ? num_lookups - i : batch, res_batch + i);
+    double batch_time = now() - start;
+
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < num_lookups; ++i)
+    {
+        if (res[i] != res_batch[i])
+        {
+            printf("%s: mismatch at %u\n", name, i);
+            exit(EXIT_FAILURE);
+        }
+        if (0 != res[i])
+            ++found;
+    }
+    printf("%-15s %6zu MB   lookup: %7.1f ns/key   lookup_batch: %7.1f ns/key   (%.2fx, %u found)\n", name,
+           table_size >> 20, single_time / num_lookups * 1e9, batch_time / num_lookups * 1e9,
+           single_time / batch_time, found);
+    delete[] res;
+    delete[] res_batch;
+}
+
+static int build(hashtable_file &ht, const char *filename, uint32_t num_keys, uint32_t key_len, bool perfect)
+{
+    char key[key_len + 1];
+    if (0 > ht.create(filename))
+        return -1;
+    for (uint32_t i = 0; i < num_keys; ++i)
+    {
+        make_key(key, key_len, i * 2); // even keys are present, odd ones are missing
+        uint64_t val = i;
+        ht.insert(key, key_len, &val, sizeof(val));
+    }
+    double start = now();
+    if (0 > ht.finalize(perfect) || 0 > ht.close() || 0 > ht.load(filename))
+        return -1;
+    printf("%-15s finalize: %.2f s\n", perfect ? "perfect" : "probing", now() - start);
+    return 0;
+}
+
+static int build(hashtable_disk &ht, const char *basename, uint32_t num_keys, uint32_t key_len)
+{
+    char key[key_len + 1];
+    if (0 > ht.create(basename))
+        return -1;
+    double start = now(), slowest = 0;
+    for (uint32_t i = 0; i < num_keys; ++i)
+    {
+        make_key(key, key_len, i * 2);
+        uint64_t val = i;
+        double t = now();
+        ht.insert(key, key_len, &val, sizeof(val));
+        t = now() - t;
+        if (t > slowest)
+            slowest = t;
+    }
+    printf("%-15s insert: %.2f s, slowest insert: %.3f ms\n", "disk", now() - start, slowest * 1e3);
+    if (0 > ht.finalize() || 0 > ht.close() || 0 > ht.load(basename))
+        return -1;
+    return 0;
+}
+
+static void usage(char *arg0)
+{
+    printf("usage: %s [-n|--keys <# of keys>]\n", arg0);
+    printf("       %*c [-l|--lookups <# of lookups>]\n", (int)strlen(arg0), ' ');
+    printf("       %*c [-b|--batch <keys per batch>]\n", (int)strlen(arg0), ' ');
+    printf("       %*c [-k|--key-length <key length>]\n", (int)strlen(arg0), ' ');
+    printf("       %*c [-f|--file <table file (and base name), removed at the end>]\n", (int)strlen(arg0), ' ');
+    printf("       %*c [--help]\n", (int)strlen(arg0), ' ');
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"keys", 1, 0, 'n'},
+        {"lookups", 1, 0, 'l'},
+        {"batch", 1, 0, 'b'},
+        {"key-length", 1, 0, 'k'},
+        {"file", 1, 0, 'f'},
+        {"help", 0, 0, 1},
+        {0, 0, 0, 0}
+    };
+
+    uint32_t num_keys = 8000000;
+    uint32_t num_lookups = 2000000;
+    uint32_t batch = 128;
+    uint32_t key_len = 16;
+    const char *filename = "/tmp/lookup_batch_bench.ht";
+
+    while (1)
+    {
+        int option_index = 0;
+        int c = getopt_long(argc, argv, "n:l:b:k:f:", long_options, &option_index);
+        if (c == -1)
+            break;
+        switch (c)
+        {
+        case 'n':
+            num_keys = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            num_lookups = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            batch = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            key_len = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            filename = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (0 == num_keys || 0 == num_lookups || 0 == batch || 10 > key_len || 1024 < key_len)
+        usage(argv[0]);
+
+    vmbuf keys;
+    keys.init(num_lookups * (key_len + 1));
+    keys.wseek(num_lookups * (key_len + 1));
+    const void **key_ptrs = new const void *[num_lookups];
+    size_t *key_lens = new size_t[num_lookups];
+    srandom(1);
+    for (uint32_t i = 0; i < num_lookups; ++i)
+    {
+        char *k = keys.data() + i * (key_len + 1);
+        make_key(k, key_len, random() % (num_keys * 2));
+        key_ptrs[i] = k;
+        key_lens[i] = key_len;
+    }
+
+    printf("%u keys of %u bytes, %u lookups in batches of %u (50%% hits)\n", num_keys, key_len, num_lookups, batch);
+    for (int perfect = 0; perfect < 2; ++perfect)
+    {
+        hashtable_file htf;
+        if (0 > build(htf, filename, num_keys, key_len, perfect))
+            exit(EXIT_FAILURE);
+        bench(perfect ? "perfect" : "probing", htf, htf.data.wlocpos(), num_lookups, batch, key_ptrs, key_lens);
+        htf.close();
+        unlink(filename);
+    }
+
+    hashtable_disk htd;
+    if (0 > build(htd, filename, num_keys, key_len))
+        exit(EXIT_FAILURE);
+    bench("disk", htd, htd.mem_usage(), num_lookups, batch, key_ptrs, key_lens);
+    htd.close();
+    unlink(htd.get_filename(hashtable_disk::FN_DAT));
+    unlink(htd.get_filename(hashtable_disk::FN_BKT));
+    delete[] key_ptrs;
+    delete[] key_lens;
+    return 0;
+}
@@ -42,6 +42,7 @@
 #define LISTEN_BACKLOG 32768
 
 SSTR(URI_TEST1, "/test1");
+SSTR(URI_STATS, "/stats");
 struct sockaddr_in remote_server_addr;
 
 static struct epoll_server_event_array events_array;
@@ -67,6 +68,9 @@ struct MyServer : http_server
         {
            return response(HTTP_STATUS_200, HTTP_CONTENT_TYPE_TEXT_PLAIN);
         }
+
+        if (0 == SSTRCMP(URI_STATS, URI))
+            return stats_response();
         
         URI::decode(URI);
         const char *file = (URI[1] == 0 ? "." : URI + 1);
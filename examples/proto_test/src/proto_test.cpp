@@ -0,0 +1,492 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * frame_proto and memcache_proto against a stand-in server forked from
+ * here. the server writes its responses a few bytes at a time so frames
+ * and headers are split across reads, and answers some requests with a
+ * short or malformed response to go through the error paths. the steps
+ * run one after the other on a single epoll thread, the exit code is the
+ * number of failed checks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <map>
+#include <string>
+#include "epoll.h"
+#include "logger.h"
+#include "frame_proto.h"
+#include "memcache_proto.h"
+
+enum
+{
+    BIG_FRAME_SIZE = 1024 * 1024
+};
+
+/*
+ * stand-in server, one process per connection. the protocol is told by
+ * the first byte: memcached requests start with the request magic, frames
+ * with the high byte of their length
+ */
+static int read_all(int fd, void *buf, size_t n)
+{
+    for (char *p = (char *)buf; 0 < n;)
+    {
+        ssize_t res = ::read(fd, p, n);
+        if (0 >= res)
+            return -1;
+        p += res;
+        n -= res;
+    }
+    return 0;
+}
+
+static void write_all(int fd, const void *buf, size_t n)
+{
+    for (const char *p = (const char *)buf; 0 < n;)
+    {
+        ssize_t res = ::write(fd, p, n);
+        if (0 >= res)
+            exit(EXIT_FAILURE);
+        p += res;
+        n -= res;
+    }
+}
+
+// a few bytes per write, each one arrives as its own read on the client
+static void write_split(int fd, const void *buf, size_t n)
+{
+    for (const char *p = (const char *)buf, *end = p + n; p < end;)
+    {
+        size_t len = end - p < 3 ? end - p : 3;
+        write_all(fd, p, len);
+        p += len;
+        usleep(100);
+    }
+}
+
+static void serve_frames(int fd)
+{
+    uint32_t len;
+    std::string req;
+    while (0 == read_all(fd, &len, sizeof(len)))
+    {
+        req.resize(ntohl(len));
+        if (0 > read_all(fd, &req[0], req.size()))
+            return;
+        if (req == "short")
+        {
+            uint32_t l = htonl(100);
+            write_split(fd, &l, sizeof(l));
+            write_split(fd, "0123456789", 10);
+            return; // close in the middle of the frame
+        }
+        if (req == "huge")
+        {
+            uint32_t l = htonl(0x7fffffff);
+            write_all(fd, &l, sizeof(l));
+            continue;
+        }
+        if (req == "big")
+        {
+            std::string res(BIG_FRAME_SIZE, '\0');
+            for (size_t i = 0; i < res.size(); ++i)
+                res[i] = 'a' + i % 26;
+            uint32_t l = htonl(res.size());
+            write_split(fd, &l, sizeof(l));
+            write_all(fd, res.data(), res.size());
+            continue;
+        }
+        // echo
+        write_split(fd, &len, sizeof(len));
+        write_split(fd, req.data(), req.size());
+    }
+}
+
+static void mc_respond(int fd, const memcache_proto::header &req, uint16_t status,
+                       const std::string &extras, const std::string &key, const std::string &value)
+{
+    memcache_proto::header h;
+    memset(&h, 0, sizeof(h));
+    h.magic = memcache_proto::RESPONSE_MAGIC;
+    h.opcode = req.opcode;
+    h.key_length = htons(key.size());
+    h.extras_length = extras.size();
+    h.status = htons(status);
+    h.total_body_length = htonl(extras.size() + key.size() + value.size());
+    h.opaque = req.opaque;
+    std::string res((const char *)&h, sizeof(h));
+    res += extras + key + value;
+    write_split(fd, res.data(), res.size());
+}
+
+static void serve_memcache(int fd)
+{
+    std::map<std::string, std::pair<uint32_t, std::string> > store;
+    memcache_proto::header h;
+    std::string body;
+    while (0 == read_all(fd, &h, sizeof(h)))
+    {
+        body.resize(ntohl(h.total_body_length));
+        if (0 > read_all(fd, &body[0], body.size()))
+            return;
+        std::string extras = body.substr(0, h.extras_length);
+        std::string key = body.substr(h.extras_length, ntohs(h.key_length));
+        std::string value = body.substr(h.extras_length + key.size());
+        if (key == "short")
+        {
+            write_split(fd, &h, sizeof(h) / 2);
+            return; // close in the middle of the header
+        }
+        if (key == "garbage")
+        {
+            std::string res(sizeof(h), 'x');
+            write_all(fd, res.data(), res.size());
+            continue;
+        }
+        switch (h.opcode)
+        {
+        case memcache_proto::OP_SET:
+            {
+                uint32_t flags;
+                memcpy(&flags, extras.data(), sizeof(flags));
+                store[key] = std::make_pair(ntohl(flags), value);
+                mc_respond(fd, h, memcache_proto::STATUS_NO_ERROR, "", "", "");
+            }
+            break;
+        case memcache_proto::OP_GET:
+        case memcache_proto::OP_GETK:
+        case memcache_proto::OP_GETKQ:
+            {
+                std::map<std::string, std::pair<uint32_t, std::string> >::iterator it = store.find(key);
+                if (it == store.end())
+                {
+                    if (memcache_proto::OP_GETKQ != h.opcode)
+                        mc_respond(fd, h, memcache_proto::STATUS_KEY_NOT_FOUND, "", "", "Not found");
+                    break;
+                }
+                uint32_t flags = htonl(it->second.first);
+                mc_respond(fd, h, memcache_proto::STATUS_NO_ERROR, std::string((char *)&flags, sizeof(flags)),
+                           memcache_proto::OP_GET == h.opcode ? "" : key, it->second.second);
+            }
+            break;
+        case memcache_proto::OP_DELETE:
+            mc_respond(fd, h, 0 < store.erase(key) ? memcache_proto::STATUS_NO_ERROR : memcache_proto::STATUS_KEY_NOT_FOUND, "", "", "");
+            break;
+        case memcache_proto::OP_NOOP:
+            mc_respond(fd, h, memcache_proto::STATUS_NO_ERROR, "", "", "");
+            break;
+        default:
+            mc_respond(fd, h, 0x81, "", "", "Unknown command");
+        }
+    }
+}
+
+static void serve(int sfd)
+{
+    signal(SIGCHLD, SIG_IGN);
+    for (;;)
+    {
+        int fd = accept(sfd, NULL, NULL);
+        if (0 > fd)
+            continue;
+        if (0 == fork())
+        {
+            const int option = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+            uint8_t first;
+            if (1 == recv(fd, &first, 1, MSG_PEEK))
+            {
+                if (memcache_proto::REQUEST_MAGIC == first)
+                    serve_memcache(fd);
+                else
+                    serve_frames(fd);
+            }
+            _exit(0);
+        }
+        ::close(fd);
+    }
+}
+
+/*
+ * client side, each step sends its requests and checks the responses in
+ * its callback, then starts the next step
+ */
+static struct in_addr server_addr;
+static uint16_t server_port;
+static int num_failed = 0;
+
+#define CHECK(cond) do { if (!(cond)) { ++num_failed; LOGGER_ERROR("step %d: check failed: %s", step, #cond); } } while (0)
+
+struct tester : basic_epoll_event
+{
+    tester() : step(0) {}
+
+    void next_step();
+    struct basic_epoll_event *on_frames(tcp_client<frame_proto> *client);
+    struct basic_epoll_event *on_memcache(tcp_client<memcache_proto> *client);
+
+    tcp_client<frame_proto> *frame_client()
+    {
+        tcp_client<frame_proto> *client = tcp_client<frame_proto>::create(server_addr, server_port);
+        client->callback.set(this, &tester::on_frames);
+        return client;
+    }
+
+    tcp_client<memcache_proto> *memcache_client()
+    {
+        tcp_client<memcache_proto> *client = tcp_client<memcache_proto>::create(server_addr, server_port);
+        client->callback.set(this, &tester::on_memcache);
+        return client;
+    }
+
+    int step;
+    int last_fd;
+};
+
+static struct tester tester;
+
+static const char *echo_requests[] = { "first", "", "the third frame, somewhat longer than the others" };
+
+void tester::next_step()
+{
+    ++step;
+    LOGGER_INFO("step %d", step);
+    switch (step)
+    {
+    case 1: // several frames in one write, split responses
+        {
+            tcp_client<frame_proto> *client = frame_client();
+            for (size_t i = 0; i < sizeof(echo_requests) / sizeof(echo_requests[0]); ++i)
+                frame_proto::add_request(client, echo_requests[i], strlen(echo_requests[i]));
+            last_fd = client->fd;
+        }
+        break;
+    case 2: // built in place, large response over many reads, on the same connection
+        {
+            tcp_client<frame_proto> *client = frame_client();
+            CHECK(client->fd == last_fd);
+            size_t loc = frame_proto::begin_request(client);
+            client->outbuf.strcpy("big");
+            frame_proto::end_request(client, loc);
+        }
+        break;
+    case 3: // connection closed mid frame
+        frame_proto::add_request(frame_client(), "short", 5);
+        break;
+    case 4: // frame larger than MAX_FRAME_SIZE
+        frame_proto::add_request(frame_client(), "huge", 4);
+        break;
+    case 5: // sets
+        {
+            tcp_client<memcache_proto> *client = memcache_client();
+            memcache_proto::set(client, "k1", 2, "value one", 9, 1);
+            memcache_proto::set(client, "k2", 2, "", 0, 2);
+            memcache_proto::set(client, "k3", 2, "value three", 11, 3);
+        }
+        break;
+    case 6: // multi-get, misses don't respond
+        {
+            tcp_client<memcache_proto> *client = memcache_client();
+            const char *keys[] = { "k1", "missing", "k2", "k3" };
+            const uint16_t key_lens[] = { 2, 7, 2, 2 };
+            CHECK(0 == memcache_proto::get_multi(client, keys, key_lens, 4));
+        }
+        break;
+    case 7: // plain get, miss, delete
+        {
+            tcp_client<memcache_proto> *client = memcache_client();
+            memcache_proto::get(client, "k3", 2);
+            memcache_proto::get(client, "missing", 7);
+            memcache_proto::del(client, "k1", 2);
+            memcache_proto::get(client, "k1", 2);
+        }
+        break;
+    case 8: // connection closed mid header
+        memcache_proto::get(memcache_client(), "short", 5);
+        break;
+    case 9: // bad magic
+        memcache_proto::get(memcache_client(), "garbage", 7);
+        break;
+    default:
+        epoll::stop();
+    }
+}
+
+struct basic_epoll_event *tester::on_frames(tcp_client<frame_proto> *client)
+{
+    frame_proto::frame f;
+    switch (step)
+    {
+    case 1:
+        CHECK(frame_proto::is_complete(client));
+        CHECK(client->persistent);
+        for (size_t i = 0; i < sizeof(echo_requests) / sizeof(echo_requests[0]); ++i)
+        {
+            CHECK(0 == frame_proto::next_frame(client, &f));
+            CHECK(frame_proto::get_frame_size(&f) == strlen(echo_requests[i]));
+            CHECK(0 == memcmp(frame_proto::get_frame(client, &f), echo_requests[i], frame_proto::get_frame_size(&f)));
+        }
+        CHECK(0 > frame_proto::next_frame(client, &f));
+        break;
+    case 2:
+        {
+            CHECK(frame_proto::is_complete(client));
+            CHECK(0 == frame_proto::next_frame(client, &f));
+            CHECK(BIG_FRAME_SIZE == frame_proto::get_frame_size(&f));
+            const char *p = frame_proto::get_frame(client, &f);
+            uint32_t bad = 0;
+            for (uint32_t i = 0; i < BIG_FRAME_SIZE; ++i)
+                bad += p[i] != 'a' + (char)(i % 26);
+            CHECK(0 == bad);
+        }
+        break;
+    case 3:
+    case 4:
+        CHECK(!frame_proto::is_complete(client));
+        CHECK(!client->persistent);
+        break;
+    }
+    client->close();
+    next_step();
+    return NULL;
+}
+
+struct basic_epoll_event *tester::on_memcache(tcp_client<memcache_proto> *client)
+{
+    memcache_proto::response r;
+    uint16_t key_len;
+    uint32_t value_len;
+    char *value;
+    switch (step)
+    {
+    case 5:
+        CHECK(memcache_proto::is_complete(client));
+        for (uint32_t i = 0; i < 3; ++i)
+        {
+            CHECK(0 == memcache_proto::next_response(client, &r));
+            CHECK(memcache_proto::OP_SET == memcache_proto::get_opcode(client, &r));
+            CHECK(memcache_proto::STATUS_NO_ERROR == memcache_proto::get_status(client, &r));
+            CHECK(i == memcache_proto::get_opaque(client, &r));
+        }
+        CHECK(0 > memcache_proto::next_response(client, &r));
+        break;
+    case 6:
+        {
+            CHECK(memcache_proto::is_complete(client));
+            const char *keys[] = { "k1", "k2", "k3" };
+            const char *values[] = { "value one", "", "value three" };
+            const uint32_t opaques[] = { 0, 2, 3 };
+            for (uint32_t i = 0; i < 3; ++i)
+            {
+                CHECK(0 == memcache_proto::next_response(client, &r));
+                CHECK(memcache_proto::OP_GETKQ == memcache_proto::get_opcode(client, &r));
+                CHECK(opaques[i] == memcache_proto::get_opaque(client, &r));
+                CHECK(i + 1 == memcache_proto::get_flags(client, &r));
+                char *key = memcache_proto::get_key(client, &r, &key_len);
+                CHECK(2 == key_len && 0 == memcmp(key, keys[i], 2));
+                value = memcache_proto::get_value(client, &r, &value_len);
+                CHECK(strlen(values[i]) == value_len && 0 == memcmp(value, values[i], value_len));
+            }
+            CHECK(0 == memcache_proto::next_response(client, &r));
+            CHECK(memcache_proto::OP_NOOP == memcache_proto::get_opcode(client, &r));
+            CHECK(4 == memcache_proto::get_opaque(client, &r));
+            CHECK(0 > memcache_proto::next_response(client, &r));
+        }
+        break;
+    case 7:
+        CHECK(memcache_proto::is_complete(client));
+        CHECK(0 == memcache_proto::next_response(client, &r));
+        CHECK(memcache_proto::STATUS_NO_ERROR == memcache_proto::get_status(client, &r));
+        CHECK(3 == memcache_proto::get_flags(client, &r));
+        memcache_proto::get_key(client, &r, &key_len);
+        CHECK(0 == key_len);
+        value = memcache_proto::get_value(client, &r, &value_len);
+        CHECK(11 == value_len && 0 == memcmp(value, "value three", value_len));
+        CHECK(0 == memcache_proto::next_response(client, &r));
+        CHECK(memcache_proto::STATUS_KEY_NOT_FOUND == memcache_proto::get_status(client, &r));
+        CHECK(0 == memcache_proto::next_response(client, &r));
+        CHECK(memcache_proto::OP_DELETE == memcache_proto::get_opcode(client, &r));
+        CHECK(memcache_proto::STATUS_NO_ERROR == memcache_proto::get_status(client, &r));
+        CHECK(0 == memcache_proto::next_response(client, &r));
+        CHECK(memcache_proto::STATUS_KEY_NOT_FOUND == memcache_proto::get_status(client, &r));
+        CHECK(3 == memcache_proto::get_opaque(client, &r));
+        CHECK(0 > memcache_proto::next_response(client, &r));
+        break;
+    case 8:
+    case 9:
+        CHECK(!memcache_proto::is_complete(client));
+        CHECK(!client->persistent);
+        break;
+    }
+    client->close();
+    next_step();
+    return NULL;
+}
+
+static int init_per_thread()
+{
+    tcp_client<frame_proto>::init();
+    tcp_client<memcache_proto>::init();
+    tester.next_step();
+    return 0;
+}
+
+int main()
+{
+    int sfd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (0 > sfd || 0 > bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) || 0 > listen(sfd, 16) ||
+        0 > getsockname(sfd, (struct sockaddr *)&addr, &addr_len))
+    {
+        LOGGER_PERROR_STR("listen");
+        exit(EXIT_FAILURE);
+    }
+    server_addr = addr.sin_addr;
+    server_port = ntohs(addr.sin_port);
+
+    pid_t server = fork();
+    if (0 == server)
+        serve(sfd);
+    ::close(sfd);
+
+    epoll::init(5, 5000);
+    epoll::set_per_thread_callback(init_per_thread);
+    epoll::start(1);
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    if (0 < num_failed)
+        LOGGER_ERROR("%d checks failed", num_failed);
+    else
+        LOGGER_INFO_STR("all checks passed");
+    return num_failed;
+}
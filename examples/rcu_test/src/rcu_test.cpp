@@ -0,0 +1,191 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * rcu_snapshot with reader threads holding versions across publishes. a
+ * version wipes itself when deleted, so a reader which sees it change
+ * before its quiescent point was handed one freed too early. the old
+ * versions have to be freed while the readers run, and all of them once
+ * they are offline, also after an epoll thread which failed to start. the
+ * exit code is the number of failed checks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include "rcu.h"
+#include "epoll.h"
+#include "logger.h"
+
+enum
+{
+    NUM_READERS = 4,
+    NUM_PUBLISHES = 50000,
+    HOLD = 64 // checks of a version before the reader's quiescent point
+};
+
+static int num_failed = 0;
+
+#define CHECK(cond) do { if (!(cond)) { ++num_failed; LOGGER_ERROR("%s: check failed: %s", name, #cond); } } while (0)
+
+static volatile int32_t num_live = 0;
+
+struct version
+{
+    enum
+    {
+        MAGIC = 0x52435531, // RCU1
+        NUM_VALUES = 64
+    };
+
+    version(uint32_t n) : magic(MAGIC), id(n)
+    {
+        for (int i = 0; i < NUM_VALUES; ++i)
+            values[i] = n;
+        __sync_add_and_fetch(&num_live, 1);
+    }
+
+    ~version()
+    {
+        magic = 0;
+        id = 0;
+        for (int i = 0; i < NUM_VALUES; ++i)
+            values[i] = 0;
+        __sync_sub_and_fetch(&num_live, 1);
+    }
+
+    bool is_valid(uint32_t n) const
+    {
+        if (MAGIC != magic || n != id)
+            return false;
+        for (int i = 0; i < NUM_VALUES; ++i)
+            if (n != values[i])
+                return false;
+        return true;
+    }
+
+    volatile uint32_t magic;
+    volatile uint32_t id;
+    volatile uint32_t values[NUM_VALUES];
+};
+
+static rcu_snapshot<version> snapshot;
+static volatile int stop = 0;
+static volatile uint32_t num_bad_reads = 0;
+static volatile uint32_t num_backwards = 0;
+
+static void *reader(void *)
+{
+    rcu::thread_online();
+    uint32_t last = 0;
+    while (!stop)
+    {
+        const version *v = snapshot.get();
+        uint32_t n = v->id;
+        for (int i = 0; i < HOLD; ++i)
+        {
+            if (!v->is_valid(n))
+            {
+                __sync_add_and_fetch(&num_bad_reads, 1);
+                break;
+            }
+        }
+        if (n < last)
+            __sync_add_and_fetch(&num_backwards, 1);
+        last = n;
+        rcu::quiescent();
+    }
+    rcu::thread_offline();
+    return NULL;
+}
+
+static void *idle(void *)
+{
+    rcu::thread_online();
+    rcu::thread_offline();
+    return NULL;
+}
+
+static int fail_per_thread()
+{
+    return -1;
+}
+
+/*
+ * thread_main goes online before the per thread callback, when that
+ * fails it has to go offline again or nothing is ever reclaimed
+ */
+static void test_failed_thread_start()
+{
+    const char *name = "failed thread start";
+    epoll::set_per_thread_callback(fail_per_thread);
+    pthread_t t;
+    CHECK(0 == pthread_create(&t, NULL, epoll::thread_main, NULL));
+    CHECK(0 == pthread_join(t, NULL));
+    epoll::set_per_thread_callback(NULL);
+    rcu_snapshot<version> s;
+    s.publish(new version(1));
+    s.publish(new version(2));
+    s.publish(new version(3));
+    CHECK(0 == rcu::reclaim());
+    CHECK(1 == num_live);
+}
+
+static void test_readers()
+{
+    const char *name = "readers";
+    snapshot.publish(new version(1));
+    pthread_t readers[NUM_READERS];
+    for (int i = 0; i < NUM_READERS; ++i)
+        CHECK(0 == pthread_create(readers + i, NULL, reader, NULL));
+    // a thread which went offline doesn't hold anything back
+    pthread_t idle_thread;
+    CHECK(0 == pthread_create(&idle_thread, NULL, idle, NULL));
+    CHECK(0 == pthread_join(idle_thread, NULL));
+
+    for (uint32_t n = 2; n <= NUM_PUBLISHES; ++n)
+    {
+        snapshot.publish(new version(n));
+        if (0 == n % 64)
+            sched_yield();
+    }
+    // freed while the readers run, not only once they stop
+    int32_t live = num_live;
+    CHECK(live < NUM_PUBLISHES / 2);
+    stop = 1;
+    for (int i = 0; i < NUM_READERS; ++i)
+        CHECK(0 == pthread_join(readers[i], NULL));
+    CHECK(0 == rcu::reclaim());
+    CHECK(1 == num_live);
+    CHECK(0 == num_bad_reads);
+    CHECK(0 == num_backwards);
+    LOGGER_INFO("%s: %u publishes, at most %d versions alive at the end", name, (uint32_t)NUM_PUBLISHES, live);
+}
+
+int main()
+{
+    test_failed_thread_start();
+    test_readers();
+    if (0 < num_failed)
+        LOGGER_ERROR("%d checks failed", num_failed);
+    else
+        LOGGER_INFO_STR("all checks passed");
+    return num_failed;
+}
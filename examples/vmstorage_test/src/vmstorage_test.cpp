@@ -0,0 +1,164 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * vmstorage_reserved growing past its reservation after only part of it
+ * was committed (the range is then split into RW and PROT_NONE mappings),
+ * after free_most, release and a shrink. the committed content has to
+ * survive the move. the exit code is the number of failed checks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "vmbuf.h"
+#include "logger.h"
+
+static int num_failed = 0;
+
+#define CHECK(cond) do { if (!(cond)) { ++num_failed; LOGGER_ERROR("%s: check failed: %s", name, #cond); } } while (0)
+
+static void fill(char *p, size_t n, int seed)
+{
+    for (size_t i = 0; i < n; ++i)
+        p[i] = (char)(i * 7 + seed);
+}
+
+static int verify(const char *p, size_t n, int seed)
+{
+    for (size_t i = 0; i < n; ++i)
+        if (p[i] != (char)(i * 7 + seed))
+            return -1;
+    return 0;
+}
+
+// writes the whole capacity, faults if any page of it isn't RW
+static void touch(vmstorage_reserved &s)
+{
+    for (size_t i = 0; i < s.capacity; i += vmpage::PAGESIZE)
+        s.buf[i] = s.buf[i];
+    s.buf[s.capacity - 1] = 1;
+}
+
+static void test_partial_commit()
+{
+    const char *name = "partial commit";
+    vmstorage_reserved s;
+    CHECK(0 == s.init(256 * 1024, 768 * 1024));
+    CHECK(0 == s.resize_to(512 * 1024));
+    fill(s.buf, s.capacity, 1);
+    CHECK(0 == s.resize_to(4 * 1024 * 1024));
+    CHECK(4 * 1024 * 1024 == s.capacity);
+    CHECK(s.reserved_size() >= s.capacity);
+    CHECK(0 == verify(s.buf, 512 * 1024, 1));
+    touch(s);
+    // and once more from the new reservation
+    CHECK(0 == s.resize_to(s.reserved_size() + 1));
+    CHECK(0 == verify(s.buf, 512 * 1024, 1));
+    touch(s);
+    CHECK(0 == s.free());
+}
+
+static void test_full_commit()
+{
+    const char *name = "full commit";
+    vmstorage_reserved s;
+    CHECK(0 == s.init(128 * 1024, 128 * 1024));
+    fill(s.buf, s.capacity, 2);
+    CHECK(0 == s.resize_to(1024 * 1024));
+    CHECK(0 == verify(s.buf, 128 * 1024, 2));
+    touch(s);
+    CHECK(0 == s.free());
+}
+
+static void test_free_most()
+{
+    const char *name = "free_most";
+    vmstorage_reserved s;
+    CHECK(0 == s.init(64 * 1024, 256 * 1024));
+    CHECK(0 == s.resize_to(192 * 1024));
+    fill(s.buf, s.capacity, 3);
+    CHECK(0 == s.free_most());
+    CHECK(vmpage::PAGESIZE == s.capacity);
+    CHECK(0 == s.resize_to(128 * 1024));
+    CHECK(0 == s.resize_to(2 * 1024 * 1024));
+    CHECK(0 == verify(s.buf, vmpage::PAGESIZE, 3));
+    touch(s);
+    CHECK(0 == s.free());
+}
+
+static void test_release()
+{
+    const char *name = "release";
+    vmstorage_reserved s;
+    CHECK(0 == s.init(256 * 1024, 512 * 1024));
+    fill(s.buf, s.capacity, 4);
+    CHECK(0 == s.release(64 * 1024, 192 * 1024));
+    CHECK(0 == s.resize_to(1024 * 1024));
+    CHECK(0 == verify(s.buf, 64 * 1024, 4));
+    CHECK(0 == verify(s.buf + 192 * 1024, 64 * 1024, 4 + (int)(192 * 1024 * 7)));
+    touch(s);
+    CHECK(0 == s.free());
+}
+
+static void test_shrink()
+{
+    const char *name = "shrink";
+    vmstorage_reserved s;
+    CHECK(0 == s.init(256 * 1024, 512 * 1024));
+    fill(s.buf, s.capacity, 5);
+    CHECK(0 == s.resize_to(64 * 1024));
+    CHECK(0 == s.resize_to(3 * 1024 * 1024));
+    CHECK(0 == verify(s.buf, 64 * 1024, 5));
+    touch(s);
+    CHECK(0 == s.free());
+}
+
+static void test_vmbuf()
+{
+    const char *name = "vmbuf_reserved";
+    vmbuf_reserved buf;
+    CHECK(0 == buf.init(vmpage::PAGESIZE, 64 * 1024));
+    char chunk[1000];
+    for (int i = 0; i < 4096; ++i)
+    {
+        fill(chunk, sizeof(chunk), i);
+        buf.memcpy(chunk, sizeof(chunk));
+    }
+    CHECK(4096 * sizeof(chunk) == buf.wlocpos());
+    int bad = 0;
+    for (int i = 0; i < 4096; ++i)
+        bad += 0 > verify(buf.data(i * sizeof(chunk)), sizeof(chunk), i);
+    CHECK(0 == bad);
+    buf.free();
+}
+
+int main()
+{
+    test_partial_commit();
+    test_full_commit();
+    test_free_most();
+    test_release();
+    test_shrink();
+    test_vmbuf();
+    if (0 < num_failed)
+        LOGGER_ERROR("%d checks failed", num_failed);
+    else
+        LOGGER_INFO_STR("all checks passed");
+    return num_failed;
+}
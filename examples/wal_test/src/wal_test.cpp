@@ -0,0 +1,309 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * crash consistency of hashtable_disk with the write ahead log. a forked
+ * child updates the table under each durability mode and _exits without
+ * close(), the parent loads it (the checkpoint and the replay) and checks
+ * it against a model of the updates which had to survive: all of them
+ * with ASYNC and SYNC, up to the last commit() (or checkpoint) with GROUP.
+ * also a reload after a clean close, a load with the log off, and a
+ * commit which fails half way through its write and is retried. the exit
+ * code is the number of failed checks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "hashtable_disk.h"
+#include "logger.h"
+
+enum
+{
+    NUM_KEYS = 8000,
+    NUM_ROUNDS = 4,
+    OPS_PER_ROUND = 17000,
+    COMMIT_EVERY = 97,
+    CHECKPOINT_BYTES = 256 * 1024
+};
+
+static int num_failed = 0;
+
+#define CHECK(cond) do { if (!(cond)) { ++num_failed; LOGGER_ERROR("%s: check failed: %s", name, #cond); } } while (0)
+
+struct progress_t // shared with the child
+{
+    uint32_t done; // updates applied
+    uint32_t committed; // updates which have to survive
+};
+
+static volatile progress_t *progress;
+static char dir[] = "/tmp/wal_test.XXXXXX";
+static char base[sizeof(dir) + 2];
+static uint32_t model[NUM_KEYS]; // 1 + the update which set the key's value, 0 when it isn't there
+
+static void reset_model()
+{
+    memset(model, 0, sizeof(model));
+}
+
+static int make_val(char *v, uint32_t key, uint32_t i)
+{
+    return sprintf(v, "val%u-%u%s", key, i, 0 == i % 3 ? "-a longer one, appended" : "");
+}
+
+/*
+ * update i, the same one every time. the key space widens with i so the
+ * table keeps growing over the rounds
+ */
+static void apply(hashtable_disk *h, uint32_t i)
+{
+    uint32_t x = (i + 1) * 2654435761u;
+    uint32_t num_keys = 256 + i / 8 < (uint32_t)NUM_KEYS ? 256 + i / 8 : (uint32_t)NUM_KEYS;
+    uint32_t key = (x >> 8) % num_keys;
+    char k[32], v[64];
+    int kl = sprintf(k, "key%u", key);
+    int vl = make_val(v, key, i);
+    uint32_t op = (x >> 3) % 10;
+    if (op < 5)
+    {
+        model[key] = i + 1;
+        if (h)
+            h->insert_or_update(k, kl, v, vl);
+    } else if (op < 8)
+    {
+        if (0 == model[key])
+            model[key] = i + 1;
+        if (h)
+            h->insert_unique(k, kl, v, vl);
+    } else
+    {
+        model[key] = 0;
+        if (h)
+            h->remove(k, kl);
+    }
+}
+
+static void build_model(uint32_t n)
+{
+    reset_model();
+    for (uint32_t i = 0; i < n; ++i)
+        apply(NULL, i);
+}
+
+static void check_table(const char *name, hashtable_disk &h)
+{
+    int bad = 0;
+    uint32_t n = 0;
+    char k[32], v[64];
+    for (uint32_t key = 0; key < NUM_KEYS; ++key)
+    {
+        int kl = sprintf(k, "key%u", key);
+        uint32_t ofs = h.lookup(k, kl);
+        if (0 == model[key])
+        {
+            bad += 0 != ofs;
+            continue;
+        }
+        ++n;
+        int vl = make_val(v, key, model[key] - 1);
+        if (0 == ofs || (uint32_t)vl != h.get_val_size(ofs) || 0 != memcmp(v, h.get_val(ofs), vl))
+            ++bad;
+    }
+    if (0 < bad)
+        LOGGER_ERROR("%s: %d keys don't match", name, bad);
+    CHECK(0 == bad);
+    CHECK(n == h.num_keys());
+}
+
+static void set_durability(hashtable_disk &h, int mode)
+{
+    h.set_durability(mode, CHECKPOINT_BYTES);
+    // GROUP: only commit() and checkpoints write the records
+    h.log.group_bytes = 1 << 30;
+    h.log.group_delay = 3600 * 1000;
+}
+
+/*
+ * updates first..first+n in a child, which then exits without close()
+ * (or with it, clean)
+ */
+static void run_child(const char *name, int mode, uint32_t first, uint32_t n, bool clean)
+{
+    progress->done = progress->committed = first;
+    pid_t pid = fork();
+    if (0 == pid)
+    {
+        hashtable_disk h;
+        set_durability(h, mode);
+        if (0 > (0 == first ? h.create(base) : h.load(base)))
+            _exit(EXIT_FAILURE);
+        for (uint32_t i = first; i < first + n; ++i)
+        {
+            size_t log_size = h.log.size;
+            apply(&h, i);
+            progress->done = i + 1;
+            if (wal::GROUP != mode)
+                progress->committed = i + 1;
+            else if (log_size != h.log.size)
+                progress->committed = i; // checkpointed before update i, the image has the buffered ones
+            if (0 == (i + 1) % COMMIT_EVERY)
+            {
+                if (0 > h.commit())
+                    _exit(EXIT_FAILURE);
+                progress->committed = i + 1;
+            }
+        }
+        if (clean)
+        {
+            if (0 > h.close())
+                _exit(EXIT_FAILURE);
+            progress->committed = progress->done;
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    CHECK(pid == waitpid(pid, &status, 0) && WIFEXITED(status) && EXIT_SUCCESS == WEXITSTATUS(status));
+}
+
+static void test_mode(int mode)
+{
+    const char *names[] = { "off", "async", "group", "sync" };
+    const char *name = names[mode];
+    uint32_t survived = 0;
+    for (int round = 0; round <= NUM_ROUNDS; ++round)
+    {
+        bool clean = NUM_ROUNDS == round;
+        run_child(name, mode, survived, OPS_PER_ROUND, clean);
+        survived = progress->committed;
+        if (wal::GROUP != mode || clean)
+            CHECK(progress->done == survived);
+        build_model(survived);
+        hashtable_disk h;
+        set_durability(h, mode);
+        CHECK(0 == h.load(base));
+        check_table(name, h);
+        CHECK(0 == h.close());
+    }
+    // the log off: replays what's left and drops it
+    run_child(name, mode, survived, OPS_PER_ROUND, false);
+    survived = progress->committed;
+    build_model(survived);
+    hashtable_disk h;
+    CHECK(0 == h.load(base));
+    check_table(name, h);
+    CHECK(0 > access(h.get_filename(hashtable_disk::FN_WAL), F_OK));
+    CHECK(0 == h.close());
+    hashtable_disk h2;
+    CHECK(0 == h2.load(base));
+    check_table(name, h2);
+    CHECK(0 == h2.close());
+}
+
+/*
+ * a commit runs out of file size half way through the group. the next
+ * ones succeed, and what they committed has to survive (the retry writes
+ * over the torn part instead of after it)
+ */
+static void test_failed_commit()
+{
+    const char *name = "failed commit";
+    progress->committed = 0;
+    pid_t pid = fork();
+    if (0 == pid)
+    {
+        signal(SIGXFSZ, SIG_IGN); // EFBIG instead
+        hashtable_disk h;
+        set_durability(h, wal::GROUP);
+        h.checkpoint_bytes = 0;
+        if (0 > h.create(base))
+            _exit(EXIT_FAILURE);
+        uint32_t i = 0;
+        for (; i < 1000; ++i)
+            apply(&h, i);
+        if (0 > h.commit())
+            _exit(EXIT_FAILURE);
+        progress->committed = i;
+        for (; i < 1200; ++i)
+            apply(&h, i);
+        struct rlimit rl, limited;
+        if (0 > getrlimit(RLIMIT_FSIZE, &rl))
+            _exit(EXIT_FAILURE);
+        limited = rl;
+        limited.rlim_cur = h.log.size + h.log.group.wlocpos() / 2;
+        if (0 > setrlimit(RLIMIT_FSIZE, &limited) || 0 == h.commit() || 0 > setrlimit(RLIMIT_FSIZE, &rl))
+            _exit(EXIT_FAILURE);
+        for (; i < 1400; ++i)
+        {
+            apply(&h, i);
+            if (0 == (i + 1) % 100)
+            {
+                if (0 > h.commit())
+                    _exit(EXIT_FAILURE);
+                progress->committed = i + 1;
+            }
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    CHECK(pid == waitpid(pid, &status, 0) && WIFEXITED(status) && EXIT_SUCCESS == WEXITSTATUS(status));
+    CHECK(1400 == progress->committed);
+    build_model(progress->committed);
+    hashtable_disk h;
+    set_durability(h, wal::GROUP);
+    CHECK(0 == h.load(base));
+    check_table(name, h);
+    CHECK(0 == h.close());
+}
+
+static void remove_files()
+{
+    const char *ext[] = { "dat", "bkt", "tmp", "wal", "wal.tmp" };
+    char fn[sizeof(base) + 8];
+    for (size_t i = 0; i < sizeof(ext) / sizeof(ext[0]); ++i)
+    {
+        sprintf(fn, "%s.%s", base, ext[i]);
+        unlink(fn);
+    }
+    rmdir(dir);
+}
+
+int main()
+{
+    progress = (progress_t *)mmap(NULL, sizeof(progress_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == progress || NULL == mkdtemp(dir))
+    {
+        LOGGER_PERROR_STR("wal_test");
+        return EXIT_FAILURE;
+    }
+    sprintf(base, "%s/t", dir);
+    for (int mode = wal::ASYNC; mode <= wal::SYNC; ++mode)
+        test_mode(mode);
+    test_failed_commit();
+    remove_files();
+    if (0 < num_failed)
+        LOGGER_ERROR("%d checks failed", num_failed);
+    else
+        LOGGER_INFO_STR("all checks passed");
+    return num_failed;
+}
@@ -38,10 +38,10 @@
 struct acceptor : basic_epoll_event
 {
     int init(int fd, int port, int listen_backlog, struct epoll_server_event_array *events);
+    int init(int fd, int port, int listen_backlog, vmpool_op<struct server_epoll_event> pool);
            
     struct basic_epoll_event *on_accept();
     
-    //void init_per_thread(vmpool_op<struct server_epoll_event> p);
     void init_per_thread();
     void noop() { }
     basic_epoll_event *callback_error() { abort(); return NULL; }
@@ -49,8 +49,8 @@ struct acceptor : basic_epoll_event
     struct basic_epoll_event_method_0args callback;
     struct basic_epoll_event_void_method_0args accept_callback;
 
-    struct epoll_server_event_array *events;
-    static __thread struct vmpool_op<struct server_epoll_event> pool;
+    struct epoll_server_event_array *events; // NULL when events come from the pool
+    struct vmpool_op<struct server_epoll_event> pool;
 };
 
 #endif // _ACCEPTOR__H_
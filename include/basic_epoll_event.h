@@ -123,10 +123,12 @@ struct basic_epoll_event
 
 struct server_epoll_event : basic_epoll_event
 {
+    server_epoll_event() : pool(NULL) {}
+
     vmbuf inbuf;
     vmbuf header;
     vmbuf payload;
-    // vmpool_op<server_epoll_event> *pool;
+    vmpool_op<server_epoll_event> *pool; // returned to it on close, NULL if not pooled
 
     struct basic_epoll_event_method_0args callback;
 };
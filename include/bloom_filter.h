@@ -0,0 +1,199 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _BLOOM_FILTER__H_
+#define _BLOOM_FILTER__H_
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "vmbuf.h"
+#include "hash_policy.h"
+#include "logger.h"
+
+/*
+ * blocked bloom filter: a key sets NUM_PROBES bits, all in the same cache
+ * line (block), so a check costs one cache miss. with 10 bits per key the
+ * false positive rate is about 1%. built in memory, written to a file and
+ * read back into memory (not mapped) so it stays hot. the filter records
+ * the size and mtime of the file its keys come from (set_source), so a
+ * filter left over from another version of that file can be told apart.
+ * file: header (HEADER_SIZE bytes, num_blocks, num_keys, hash id, source
+ * size and mtime), blocks
+ */
+struct bloom_filter
+{
+    enum
+    {
+        BLOCK_BITS = 512,
+        NUM_PROBES = 7, // 9 bits each, from one 64 bit hash
+        DEFAULT_BITS_PER_KEY = 10,
+        HEADER_SIZE = 64 // blocks stay cache line aligned
+    };
+
+    struct header_t
+    {
+        uint32_t num_blocks;
+        uint32_t num_keys;
+        uint32_t hash_id;
+        uint32_t reserved;
+        uint64_t source_size;
+        uint64_t source_mtime; // nanoseconds
+    };
+
+    bloom_filter() : num_blocks(0), num_keys(0), source_size(0), source_mtime(0) {}
+
+    inline int init(uint32_t expected_keys, uint32_t bits_per_key = DEFAULT_BITS_PER_KEY);
+    inline int write(const char *filename);
+    inline int load(const char *filename);
+    int close() { num_blocks = num_keys = 0; return bits.free(); }
+
+    inline int set_source(const char *filename);
+    inline bool is_source(const char *filename) const;
+    static inline int stat_source(const char *filename, uint64_t *size, uint64_t *mtime);
+
+    inline void add(const void *key, size_t n);
+    inline bool may_contain(const void *key, size_t n) const;
+
+    static inline uint64_t hashcode(const void *key, size_t n);
+    uint64_t *block(uint64_t h) const { return (uint64_t *)(bits.data() + HEADER_SIZE) + ((((h >> 32) * num_blocks) >> 32) * (BLOCK_BITS / 64)); }
+    size_t mem_usage() const { return (size_t)num_blocks * (BLOCK_BITS / 8); }
+    bool is_loaded() const { return num_blocks > 0; }
+
+    vmbuf bits;
+    uint32_t num_blocks;
+    uint32_t num_keys;
+    uint64_t source_size;
+    uint64_t source_mtime;
+};
+
+/*
+ * inline
+ */
+inline int bloom_filter::init(uint32_t expected_keys, uint32_t bits_per_key /* = DEFAULT_BITS_PER_KEY */)
+{
+    num_blocks = ((uint64_t)expected_keys * bits_per_key + BLOCK_BITS - 1) / BLOCK_BITS;
+    if (0 == num_blocks)
+        num_blocks = 1;
+    num_keys = 0;
+    size_t n = HEADER_SIZE + mem_usage();
+    if (0 > bits.init(n))
+        return -1;
+    bits.alloczero(n);
+    return 0;
+}
+
+inline int bloom_filter::write(const char *filename)
+{
+    header_t *header = (header_t *)bits.data();
+    header->num_blocks = num_blocks;
+    header->num_keys = num_keys;
+    header->hash_id = hash_policy::WORD;
+    header->reserved = 0;
+    header->source_size = source_size;
+    header->source_mtime = source_mtime;
+    vmfile f;
+    if (0 > f.create(filename) || 0 > f.memcpy(bits.data(), bits.wlocpos()) || 0 > f.finalize())
+        return -1;
+    return f.free();
+}
+
+inline int bloom_filter::load(const char *filename)
+{
+    vmfile f;
+    if (0 > f.load(filename))
+        return -1;
+    header_t *header = (header_t *)f.data();
+    if (f.wlocpos() < HEADER_SIZE || hash_policy::WORD != header->hash_id ||
+        f.wlocpos() != HEADER_SIZE + (size_t)header->num_blocks * (BLOCK_BITS / 8))
+    {
+        LOGGER_ERROR("%s: invalid bloom filter", filename);
+        f.free();
+        return -1;
+    }
+    if (0 > bits.init(f.wlocpos()))
+        return -1;
+    bits.memcpy(f.data(), f.wlocpos());
+    num_blocks = header->num_blocks;
+    num_keys = header->num_keys;
+    source_size = header->source_size;
+    source_mtime = header->source_mtime;
+    return f.free();
+}
+
+/* static */
+inline int bloom_filter::stat_source(const char *filename, uint64_t *size, uint64_t *mtime)
+{
+    struct stat st;
+    if (0 > stat(filename, &st))
+    {
+        LOGGER_PERROR("stat %s", filename);
+        return -1;
+    }
+    *size = st.st_size;
+    *mtime = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    return 0;
+}
+
+inline int bloom_filter::set_source(const char *filename)
+{
+    return stat_source(filename, &source_size, &source_mtime);
+}
+
+inline bool bloom_filter::is_source(const char *filename) const
+{
+    uint64_t size, mtime;
+    return 0 == stat_source(filename, &size, &mtime) && size == source_size && mtime == source_mtime;
+}
+
+/* static */
+inline uint64_t bloom_filter::hashcode(const void *key, size_t n)
+{
+    // remixed, the tables use the same hash for their buckets
+    uint64_t h = hash_word::hash(key, n);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+inline void bloom_filter::add(const void *key, size_t n)
+{
+    uint64_t h = hashcode(key, n);
+    uint64_t *b = block(h);
+    uint64_t bit_h = h * 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < NUM_PROBES; ++i, bit_h >>= 9)
+        b[(bit_h >> 6) & 7] |= 1ULL << (bit_h & 63);
+    ++num_keys;
+}
+
+inline bool bloom_filter::may_contain(const void *key, size_t n) const
+{
+    uint64_t h = hashcode(key, n);
+    const uint64_t *b = block(h);
+    uint64_t bit_h = h * 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < NUM_PROBES; ++i, bit_h >>= 9)
+    {
+        if (0 == (b[(bit_h >> 6) & 7] & (1ULL << (bit_h & 63))))
+            return false;
+    }
+    return true;
+}
+
+#endif // _BLOOM_FILTER__H_
@@ -21,10 +21,14 @@
 #define _COMPACT_HASHTABLE__H_
 
 #include "vmbuf.h"
+#include "hash_policy.h"
 #include <stdint.h>
 
 
-template<typename K, typename V>
+/*
+ * H is the hash policy (see hash_policy.h)
+ */
+template<typename K, typename V, typename H=hash_word>
 struct compact_hashtable_entry_t
 {
     K k;
@@ -33,45 +37,47 @@ struct compact_hashtable_entry_t
 
     static uint32_t hash_code(const K &key)
     {
-        register const unsigned char *p = (const unsigned char *)&key;
-        register const unsigned char *end = p + sizeof(K);
-        uint32_t h = 5381;
-        for (; p != end; ++p)
-            h = ((h << 5) + h) ^ *p;
-        return h;
+        return H::hash(&key, sizeof(K));
     }
 };
 
 // template specialization for strings
-template<typename V>
-struct compact_hashtable_entry_t<const char *, V>
+template<typename V, typename H>
+struct compact_hashtable_entry_t<const char *, V, H>
 {
     const char *k;
     V v;
     bool equals(const char *s) const { return 0 == strcmp(k, s); }
     static uint32_t hash_code(const char *key)
     {
-        register const unsigned char *p = (const unsigned char *)key;
-        uint32_t h = 5381;
-        for (; *p; ++p)
-            h = ((h << 5) + h) ^ *p;
-        return h;
+        return H::hash(key, strlen(key));
     }
 };
 
 
-template<typename K>
+template<typename K, typename H=hash_word>
 struct compact_hashtable_entry_no_val_t
 {
     K k;
     bool equals(const K &k1) const { return k == k1; }
     static uint32_t hash_code(const K &key)
     {
-        return compact_hashtable_entry_t<K, int>::hash_code(key);
+        return compact_hashtable_entry_t<K, int, H>::hash_code(key);
     }
 };
 
-template<typename K=int, typename V=int, typename HTE=compact_hashtable_entry_t<K, V> >
+/*
+ * grows (doubles the buckets) when there are more entries than buckets.
+ * the chains of the old buckets are moved MIGRATE_STEP buckets at a time
+ * on each of the following inserts, a bucket which is about to get a new
+ * entry is moved first. lookups go to the old bucket until it's moved.
+ * entry indexes don't change.
+ * removed entries go on a free list and are reused by the next inserts.
+ * compact() moves the last entries into the free ones and releases the
+ * end of entries, a few at a time (it changes the index of the entries it
+ * moves).
+ */
+template<typename K=int, typename V=int, typename HTE=compact_hashtable_entry_t<K, V>, typename B=vmbuf>
 struct compact_hashtable
 {
     typedef uint32_t index_t;
@@ -81,6 +87,15 @@ struct compact_hashtable
         index_t next;
         entry_t data;
     };
+
+    enum
+    {
+        MIGRATE_STEP = 8,
+        COMPACT_STEP = 256
+    };
+
+    static const index_t MIGRATED = (index_t)-1; // old bucket which was moved
+    static const index_t FREE = (index_t)1 << 31; // set in next of removed entries, the rest is the next free one
     
     void init(index_t num_buckets)
     {
@@ -92,54 +107,253 @@ struct compact_hashtable
         entries.init(mask * sizeof(internal_entry_t));
         buckets.alloczero(mask * sizeof(index_t));
         --mask;
+        old_buckets.free();
+        old_mask = 0;
+        migrate_pos = 0;
+        free_head = num_free = 0;
+        compact_front = 0;
+        reclaimed = 0;
+    }
+
+    internal_entry_t *entry(index_t index) const
+    {
+        return (internal_entry_t *)entries.data() + index - 1; // index is 1 based, zero is reserved
     }
 
+    static bool is_free(const internal_entry_t *e) { return e->next & FREE; }
+
     index_t bucket(const K &k) const
     {
         return HTE::hash_code(k) & mask;
     }
-        
+
+    bool is_migrating() const { return old_mask > 0; }
+
+    /*
+     * head of the chain the key belongs to, in the old buckets until moved
+     */
+    index_t *bucket_head(const K &k) const
+    {
+        index_t h = HTE::hash_code(k);
+        if (is_migrating())
+        {
+            index_t *old_head = (index_t *)old_buckets.data() + (h & old_mask);
+            if (MIGRATED != *old_head)
+                return old_head;
+        }
+        return (index_t *)buckets.data() + (h & mask);
+    }
+
+    void grow()
+    {
+        if (is_migrating())
+            migrate(old_mask + 1);
+        old_buckets.swap(buckets);
+        old_mask = mask;
+        migrate_pos = 0;
+        mask = (mask << 1) + 1;
+        buckets.init((mask + 1) * sizeof(index_t));
+        buckets.alloczero((mask + 1) * sizeof(index_t));
+    }
+
+    /*
+     * move the chain of an old bucket, it splits into b and b + old size.
+     * both are still empty (entries only go there after the move) so
+     * appending keeps the order of the chain
+     */
+    void migrate_bucket(index_t b)
+    {
+        index_t *old_head = (index_t *)old_buckets.data() + b;
+        index_t index = *old_head;
+        if (MIGRATED == index)
+            return;
+        index_t *tail[2] = { (index_t *)buckets.data() + b, (index_t *)buckets.data() + b + old_mask + 1 };
+        while (index > 0)
+        {
+            internal_entry_t *e = (internal_entry_t *)entries.data() + index - 1;
+            index_t next = e->next;
+            int hi = (HTE::hash_code(e->data.k) & (old_mask + 1)) ? 1 : 0;
+            e->next = 0;
+            *tail[hi] = index;
+            tail[hi] = &e->next;
+            index = next;
+        }
+        *old_head = MIGRATED;
+    }
+
+    void migrate(index_t n)
+    {
+        for (; n > 0 && migrate_pos <= old_mask; --n, ++migrate_pos)
+            migrate_bucket(migrate_pos);
+        if (migrate_pos > old_mask)
+        {
+            old_buckets.free();
+            old_mask = 0;
+        }
+    }
+
+    /*
+     * called before adding an entry for k
+     */
+    void prepare_insert(const K &k)
+    {
+        if (size > mask)
+            grow();
+        if (is_migrating())
+        {
+            migrate_bucket(HTE::hash_code(k) & old_mask);
+            migrate(MIGRATE_STEP);
+        }
+    }
+
+    /*
+     * a removed entry if there is one, otherwise a new one at the end
+     */
+    index_t alloc_entry()
+    {
+        ++size;
+        if (free_head > 0)
+        {
+            index_t index = free_head;
+            free_head = entry(index)->next & ~FREE;
+            --num_free;
+            return index;
+        }
+        entries.template alloc<internal_entry_t>();
+        return entries.wlocpos() / sizeof(internal_entry_t);
+    }
+
+    void free_entry(index_t index)
+    {
+        internal_entry_t *e = entry(index);
+        --size;
+        ++num_free;
+        // compact() fills the ones ahead of it by itself
+        if (is_compacting() && index >= compact_front)
+            e->next = FREE;
+        else
+        {
+            e->next = FREE | free_head;
+            free_head = index;
+        }
+    }
+
     entry_t *insert(const K &k, const V &v)
     {
+        prepare_insert(k);
         index_t b = bucket(k);
-        internal_entry_t *e = entries.alloc<internal_entry_t>();
+        index_t index = alloc_entry();
+        internal_entry_t *e = entry(index);
         e->data.k = k;
         e->data.v = v;
         
         index_t *ofs_bucket_ptr = (index_t *)buckets.data() + b;
         e->next = *ofs_bucket_ptr;
-        *ofs_bucket_ptr = ++size; // 1 based, zero is reserved
+        *ofs_bucket_ptr = index;
         return &e->data;
     }
 
     bool insert(const K &k)
     {
+        prepare_insert(k);
         index_t b = bucket(k);
         index_t *ofs_bucket_ptr = (index_t *)buckets.data() + b;
         register index_t index = *(ofs_bucket_ptr);
         while (index > 0)
         {
-            internal_entry_t *e = (internal_entry_t *)entries.data() + index - 1; // index is 1 based, zero is reserved
+            internal_entry_t *e = entry(index);
             if (e->data.equals(k))
                 return false;
             index = e->next;
         }
         
-        internal_entry_t *e = entries.alloc<internal_entry_t>();
+        index = alloc_entry();
+        internal_entry_t *e = entry(index);
         e->data.k = k;
         
+        ofs_bucket_ptr = (index_t *)buckets.data() + b;
         e->next = *ofs_bucket_ptr;
-        *ofs_bucket_ptr = ++size; // 1 based, zero is reserved
+        *ofs_bucket_ptr = index;
         return true;
     }
 
+    bool remove(const K &k)
+    {
+        if (is_migrating())
+            migrate_bucket(HTE::hash_code(k) & old_mask);
+        index_t *prev = (index_t *)buckets.data() + bucket(k);
+        for (index_t index = *prev; index > 0; index = *prev)
+        {
+            internal_entry_t *e = entry(index);
+            if (e->data.equals(k))
+            {
+                *prev = e->next;
+                free_entry(index);
+                return true;
+            }
+            prev = &e->next;
+        }
+        return false;
+    }
+
+    bool is_compacting() const { return compact_front > 0; }
+
+    /*
+     * move up to n entries from the end into the free ones, returns true
+     * while there is more to do. when done the end of entries is released
+     */
+    bool compact(index_t n = COMPACT_STEP)
+    {
+        if (!is_compacting())
+        {
+            if (0 == num_free)
+                return false;
+            free_head = 0; // the free ones are found as we go
+            compact_front = 1;
+        }
+        for (; n > 0; --n)
+        {
+            index_t last = entries.wlocpos() / sizeof(internal_entry_t);
+            if (last < compact_front)
+                break;
+            internal_entry_t *tail = entry(last);
+            if (is_free(tail))
+            {
+                entries.wtruncate(entries.wlocpos() - sizeof(internal_entry_t));
+                --num_free;
+                ++reclaimed;
+                continue;
+            }
+            if (compact_front == last)
+                break;
+            internal_entry_t *e = entry(compact_front);
+            if (is_free(e))
+            {
+                index_t *prev = bucket_head(tail->data.k);
+                while (*prev != last)
+                    prev = &entry(*prev)->next;
+                *prev = compact_front;
+                *e = *tail;
+                entries.wtruncate(entries.wlocpos() - sizeof(internal_entry_t));
+                --num_free;
+                ++reclaimed;
+            }
+            ++compact_front;
+        }
+        if (n > 0)
+        {
+            entries.shrink();
+            compact_front = 0;
+        }
+        return is_compacting();
+    }
+
     entry_t *lookup(const K &k) const
     {
-        index_t b = bucket(k);
-        register index_t index = *(((index_t *)buckets.data()) + b);
+        register index_t index = *bucket_head(k);
         while (index > 0)
         {
-            internal_entry_t *e = (internal_entry_t *)entries.data() + index - 1; // index is 1 based, zero is reserved
+            internal_entry_t *e = entry(index);
             if (e->data.equals(k))
                 return &e->data;
             index = e->next;
@@ -163,20 +377,33 @@ struct compact_hashtable
         buf->sprintf("%s>\n", name);
         for (internal_entry_t *it = this->begin(), *itend = this->end(); it != itend; ++it)
         {
-            buf->sprintf("   %u\n", it->data.k);
+            if (!is_free(it))
+                buf->sprintf("   %u\n", it->data.k);
         }
     }
 
     index_t get_size() const { return this->size; }
+    index_t get_num_free() const { return this->num_free; }
+    size_t get_dead_bytes() const { return (size_t)this->num_free * sizeof(internal_entry_t); }
+    uint64_t get_reclaimed() const { return this->reclaimed; } // entries released by compact()
     
-    vmbuf buckets;
-    vmbuf entries;
+    B buckets; // vmbuf_huge for very large tables
+    B entries;
     index_t mask;
     index_t size;
+
+    B old_buckets; // being migrated
+    index_t old_mask;
+    index_t migrate_pos;
+
+    index_t free_head;
+    index_t num_free;
+    index_t compact_front; // 0 when not compacting
+    uint64_t reclaimed;
 };
 
-template<typename K=int, typename HTE=compact_hashtable_entry_no_val_t<K> >
-struct compact_hashset : compact_hashtable<K, int, HTE>
+template<typename K=int, typename HTE=compact_hashtable_entry_no_val_t<K>, typename B=vmbuf>
+struct compact_hashset : compact_hashtable<K, int, HTE, B>
 {
 };
 
@@ -35,23 +35,29 @@ struct epoll
     enum
     {
         DEFAULT_SERVER_TIMEOUT = 5, // seconds
-        DEFAULT_CLIENT_TIMEOUT = 1000 // milli-seconds
+        DEFAULT_CLIENT_TIMEOUT = 1000, // milli-seconds
+        DEFAULT_IDLE_DELAY = 1000 // milli-seconds
     };
 
     typedef int (*callback_t)();
 
     static __thread int epollfd;
     static callback_t per_thread_callback;
+    static callback_t idle_callback;
+    static int idle_delay;
     static __thread void *label_run;
     static __thread void *label_done;
 
     static __thread struct basic_epoll_event *server_timeout_chain;
     static __thread struct basic_epoll_event *client_timeout_chain;
+    static __thread struct basic_epoll_event *connect_timeout_chain;
 
     static struct timeval server_timeout;
     static struct timeval client_timeout;
+    static struct timeval connect_timeout;
 
-    static int init(time_t to_server, time_t to_client);
+    // to_connect == 0 means same as to_client
+    static int init(time_t to_server, time_t to_client, time_t to_connect = 0);
     static void *thread_main(void *);
     static void *run(void *);
 
@@ -59,6 +65,8 @@ struct epoll
     static void stop() { label_run = label_done; }
 
     static void set_per_thread_callback(callback_t cb);
+    // called by each thread every msec while it has no events (to shrink buffers, etc.)
+    static void set_idle_callback(callback_t cb, int msec = DEFAULT_IDLE_DELAY);
     static int mask_signals();
 
     static inline int arm_timeout_timer(int fd, struct timeval *tv);
@@ -74,6 +82,24 @@ struct epoll
     static inline void cancel_timeout(struct basic_epoll_event *e);
     static inline void schedule_timeout(struct basic_epoll_event *timeout_chain, struct basic_epoll_event *e);
     static inline void handle_timeouts(struct basic_epoll_event *timeout_chain);
+    static inline void handle_timers(struct basic_epoll_event *timer_chain);
+};
+
+/*
+ * per thread chain of events which are invoked (instead of shutdown)
+ * once the chain's delay has passed since they were scheduled.
+ * since all the events share the same delay the chain stays sorted,
+ * even when the delay is changed.
+ */
+struct epoll_timer_chain : basic_epoll_event
+{
+    int init(time_t msec);
+    void set_delay(time_t msec);
+    void schedule(struct basic_epoll_event *e) { epoll::schedule_timeout(&chain, e); }
+
+    struct basic_epoll_event *on_timer();
+
+    struct basic_epoll_event chain;
 };
 
 /*
@@ -150,6 +176,8 @@ inline void epoll::cancel_timeout(struct basic_epoll_event *e)
         // remove from chain
         e->timeout_chain_prev->timeout_chain_next = e->timeout_chain_next;
         e->timeout_chain_next->timeout_chain_prev = e->timeout_chain_prev;
+        // safe to cancel again
+        timerclear(&e->last_event_ts);
     }
 }
 
@@ -193,6 +221,33 @@ inline void epoll::handle_timeouts(struct basic_epoll_event *timeout_chain)
     }
 }
 
+/* static */
+inline void epoll::handle_timers(struct basic_epoll_event *timer_chain)
+{
+    struct timeval now, ts;
+    gettimeofday(&now, NULL);
+    timersub(&now, &timer_chain->last_event_ts, &ts);
+    for (;;)
+    {
+        struct basic_epoll_event *p = timer_chain->timeout_chain_next;
+        if (p == timer_chain || timercmp(&p->last_event_ts, &ts, >))
+            break;
+        // remove from chain before invoking, the event may reschedule itself
+        timer_chain->timeout_chain_next = p->timeout_chain_next;
+        p->timeout_chain_next->timeout_chain_prev = timer_chain;
+        timerclear(&p->last_event_ts);
+        while (NULL != (p = p->invoke()));
+    }
+    struct basic_epoll_event *p = timer_chain->timeout_chain_next;
+    if (p != timer_chain)
+    {
+        timersub(&p->last_event_ts, &ts, &now);
+        if (!timerisset(&now))
+            now.tv_usec = 1; // zero will disarm the timer
+        arm_timeout_timer(timer_chain->fd, &now);
+    }
+}
+
 
 
 
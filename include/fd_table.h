@@ -0,0 +1,88 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _FD_TABLE__H_
+#define _FD_TABLE__H_
+
+#include <stddef.h>
+
+/*
+ * fd indexed table, entries are allocated in blocks on first use so the
+ * memory follows the live fds instead of RLIMIT_NOFILE. entries are never
+ * freed, the same fd always gets the same entry (with its fd already set).
+ * safe to use from several threads.
+ */
+template<typename T>
+struct fd_table
+{
+    enum
+    {
+        BLOCK_BITS = 10,
+        BLOCK_SIZE = 1 << BLOCK_BITS,
+        BLOCK_MASK = BLOCK_SIZE - 1
+    };
+
+    fd_table() : blocks(NULL), num_blocks(0), num_allocated(0) {}
+
+    void init(size_t max_fds);
+    T *get(int fd);
+    T *alloc_block(size_t n);
+
+    size_t memory_used() const { return num_allocated * BLOCK_SIZE * sizeof(T) + num_blocks * sizeof(T *); }
+
+    T **blocks;
+    size_t num_blocks;
+    unsigned int num_allocated;
+};
+
+template<typename T>
+inline void fd_table<T>::init(size_t max_fds)
+{
+    num_blocks = (max_fds + BLOCK_MASK) >> BLOCK_BITS;
+    blocks = new T*[num_blocks];
+    for (T **b = blocks, **b_end = b + num_blocks; b != b_end; ++b)
+        *b = NULL;
+}
+
+template<typename T>
+inline T *fd_table<T>::get(int fd)
+{
+    T *block = blocks[fd >> BLOCK_BITS];
+    if (NULL == block)
+        block = alloc_block(fd >> BLOCK_BITS);
+    return block + (fd & BLOCK_MASK);
+}
+
+template<typename T>
+inline T *fd_table<T>::alloc_block(size_t n)
+{
+    T *block = new T[BLOCK_SIZE];
+    int fd = n << BLOCK_BITS;
+    for (T *e = block, *e_end = e + BLOCK_SIZE; e != e_end; e->fd = fd, ++e, ++fd);
+    if (!__sync_bool_compare_and_swap(blocks + n, NULL, block))
+    {
+        // another thread got there first
+        delete[] block;
+        return blocks[n];
+    }
+    __sync_add_and_fetch(&num_allocated, 1);
+    return block;
+}
+
+#endif // _FD_TABLE__H_
@@ -0,0 +1,165 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _FRAME_PROTO__H_
+#define _FRAME_PROTO__H_
+
+#include <arpa/inet.h>
+#include <string.h>
+#include "tcp_client.h"
+
+/*
+ * tcp_client protocol for services exchanging frames prefixed by their
+ * length (32 bit, network order). several requests can be written before
+ * yielding, the client is done once a response frame arrived for each of
+ * them. frames are parsed in place and point into inbuf.
+ */
+struct frame_proto
+{
+    enum
+    {
+        HEADER_SIZE = sizeof(uint32_t),
+        MAX_FRAME_SIZE = 64 * 1024 * 1024
+    };
+
+    static int prepare(tcp_client<frame_proto> *client);
+    static int read_content(tcp_client<frame_proto> *client);
+    static void on_error(tcp_client<frame_proto> *client);
+    static void on_connection_close(tcp_client<frame_proto> *client);
+
+    static void add_request(tcp_client<frame_proto> *client, const void *data, uint32_t size);
+    static size_t begin_request(tcp_client<frame_proto> *client);
+    static void end_request(tcp_client<frame_proto> *client, size_t loc);
+
+    static bool is_complete(tcp_client<frame_proto> *client) { return 0 == client->proto.error && client->proto.num_received == client->proto.num_expected; }
+
+    uint32_t num_expected;
+    uint32_t num_received;
+    size_t parse_loc; // end of the last complete frame
+    int error;
+
+    struct frame
+    {
+        uint32_t loc;
+        uint32_t size;
+        frame() : loc(0), size(0) {}
+    };
+
+    static int next_frame(tcp_client<frame_proto> *client, frame *frame);
+    static char *get_frame(tcp_client<frame_proto> *client, frame *frame) { return client->inbuf.data(frame->loc); }
+    static uint32_t get_frame_size(frame *frame) { return frame->size; }
+};
+
+/*static*/
+inline int frame_proto::prepare(tcp_client<frame_proto> *client)
+{
+    client->proto.num_expected = 0;
+    client->proto.num_received = 0;
+    client->proto.parse_loc = 0;
+    client->proto.error = 0;
+    return 0;
+}
+
+/*static*/
+inline void frame_proto::on_error(tcp_client<frame_proto> *client)
+{
+    client->proto.error = 1;
+}
+
+/*static*/
+inline void frame_proto::on_connection_close(tcp_client<frame_proto> *client)
+{
+    if (0 < frame_proto::read_content(client))
+        client->proto.error = 1; // partial response
+}
+
+/*static*/
+inline int frame_proto::read_content(tcp_client<frame_proto> *client)
+{
+    frame_proto &proto = client->proto;
+    for (;;)
+    {
+        if (proto.num_received == proto.num_expected)
+        {
+            if (proto.parse_loc != client->inbuf.wlocpos())
+                client->persistent = 0; // unexpected data, can't reuse the connection
+            return 0; // we are done
+        }
+        size_t avail = client->inbuf.wlocpos() - proto.parse_loc;
+        if (avail < HEADER_SIZE)
+            return 1; // yield
+        uint32_t size;
+        memcpy(&size, client->inbuf.data(proto.parse_loc), sizeof(size));
+        size = ntohl(size);
+        if (size > MAX_FRAME_SIZE)
+        {
+            proto.error = 1;
+            client->persistent = 0;
+            return 0;
+        }
+        if (avail < HEADER_SIZE + size)
+            return 1; // yield
+        proto.parse_loc += HEADER_SIZE + size;
+        ++proto.num_received;
+    }
+}
+
+/*static*/
+inline void frame_proto::add_request(tcp_client<frame_proto> *client, const void *data, uint32_t size)
+{
+    uint32_t len = htonl(size);
+    client->outbuf.memcpy(&len, sizeof(len));
+    client->outbuf.memcpy(data, size);
+    ++client->proto.num_expected;
+}
+
+/*
+ * reserve the length, the frame's content is written to outbuf
+ * directly and the length is set by end_request
+ */
+/*static*/
+inline size_t frame_proto::begin_request(tcp_client<frame_proto> *client)
+{
+    size_t loc = client->outbuf.wlocpos();
+    client->outbuf.wseek(HEADER_SIZE);
+    return loc;
+}
+
+/*static*/
+inline void frame_proto::end_request(tcp_client<frame_proto> *client, size_t loc)
+{
+    uint32_t len = htonl(client->outbuf.wlocpos() - loc - HEADER_SIZE);
+    memcpy(client->outbuf.data(loc), &len, sizeof(len));
+    ++client->proto.num_expected;
+}
+
+/*static*/
+inline int frame_proto::next_frame(tcp_client<frame_proto> *client, frame *frame)
+{
+    uint32_t loc = (0 == frame->loc ? 0 : frame->loc + frame->size);
+    if (loc + HEADER_SIZE > client->proto.parse_loc)
+        return -1;
+    uint32_t size;
+    memcpy(&size, client->inbuf.data(loc), sizeof(size));
+    frame->loc = loc + HEADER_SIZE;
+    frame->size = ntohl(size);
+    return 0;
+}
+
+#endif // _FRAME_PROTO__H_
@@ -0,0 +1,231 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _HASH_POLICY__H_
+#define _HASH_POLICY__H_
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * hash functions shared by the hashtables. each policy has an ID, the
+ * on-disk tables record it in their header so they can be read back with
+ * the function they were written with.
+ */
+
+/*
+ * the original one, byte at a time. only kept to read old files
+ */
+struct hash_djb2
+{
+    enum { ID = 0 };
+    static uint64_t hash(const void *key, size_t n);
+};
+
+/*
+ * word at a time, based on murmur hash 64A
+ */
+struct hash_word
+{
+    enum { ID = 1 };
+    static uint64_t hash(const void *key, size_t n);
+};
+
+/*
+ * crc32c instruction (sse4.2) when the cpu has it, table driven otherwise.
+ * both produce the same values so files are portable
+ */
+struct hash_crc32c
+{
+    enum { ID = 2 };
+    static uint64_t hash(const void *key, size_t n);
+
+    static uint32_t crc32c(uint32_t crc, const void *data, size_t n);
+    static uint32_t crc32c_sw(uint32_t crc, const void *data, size_t n);
+#ifdef __x86_64__
+    static uint32_t crc32c_hw(uint32_t crc, const void *data, size_t n) __attribute__((target("sse4.2")));
+#endif
+    static bool has_hw();
+
+    struct table
+    {
+        table();
+        uint32_t t[256];
+    };
+    static const uint32_t *get_table();
+};
+
+struct hash_policy
+{
+    enum
+    {
+        DJB2 = hash_djb2::ID,
+        WORD = hash_word::ID,
+        CRC32C = hash_crc32c::ID,
+        NUM_HASHES,
+        DEFAULT = WORD
+    };
+
+    static bool is_valid(uint32_t id) { return id < NUM_HASHES; }
+    static uint64_t hash(uint32_t id, const void *key, size_t n);
+    static const char *name(uint32_t id);
+};
+
+/*
+ * inline
+ */
+
+/* static */
+inline uint64_t hash_djb2::hash(const void *key, size_t n)
+{
+    register const unsigned char *p = (const unsigned char *)key;
+    register const unsigned char *end = p + n;
+    uint32_t h = 5381;
+    for (; p != end; ++p)
+        h = ((h << 5) + h) ^ *p;
+    return h;
+}
+
+/* static */
+inline uint64_t hash_word::hash(const void *key, size_t n)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const unsigned char *p = (const unsigned char *)key;
+    uint64_t h = 0x8445d61a4e774912ULL ^ (n * m);
+    for (; n >= sizeof(uint64_t); n -= sizeof(uint64_t), p += sizeof(uint64_t))
+    {
+        uint64_t k;
+        memcpy(&k, p, sizeof(k));
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    if (n > 0)
+    {
+        uint64_t k = 0;
+        memcpy(&k, p, n);
+        h ^= k;
+        h *= m;
+    }
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+    return h;
+}
+
+/* static */
+inline uint64_t hash_crc32c::hash(const void *key, size_t n)
+{
+    // spread the 32 bits over 64, tables take the high bits as well
+    return (uint64_t)crc32c((uint32_t)n, key, n) * 0x9e3779b97f4a7c15ULL;
+}
+
+/* static */
+inline uint32_t hash_crc32c::crc32c(uint32_t crc, const void *data, size_t n)
+{
+#ifdef __x86_64__
+    if (has_hw())
+        return crc32c_hw(crc, data, n);
+#endif
+    return crc32c_sw(crc, data, n);
+}
+
+/* static */
+inline uint32_t hash_crc32c::crc32c_sw(uint32_t crc, const void *data, size_t n)
+{
+    const uint32_t *t = get_table();
+    const unsigned char *p = (const unsigned char *)data;
+    crc = ~crc;
+    for (const unsigned char *end = p + n; p != end; ++p)
+        crc = t[(crc ^ *p) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+#ifdef __x86_64__
+/* static */
+inline uint32_t hash_crc32c::crc32c_hw(uint32_t crc, const void *data, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t c = ~crc;
+    for (; n >= sizeof(uint64_t); n -= sizeof(uint64_t), p += sizeof(uint64_t))
+    {
+        uint64_t k;
+        memcpy(&k, p, sizeof(k));
+        c = __builtin_ia32_crc32di(c, k);
+    }
+    uint32_t c32 = c;
+    for (; n > 0; --n, ++p)
+        c32 = __builtin_ia32_crc32qi(c32, *p);
+    return ~c32;
+}
+#endif
+
+/* static */
+inline bool hash_crc32c::has_hw()
+{
+#ifdef __x86_64__
+    static const bool hw = (__builtin_cpu_init(), __builtin_cpu_supports("sse4.2"));
+    return hw;
+#else
+    return false;
+#endif
+}
+
+inline hash_crc32c::table::table()
+{
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; ++j)
+            crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1))); // reflected castagnoli polynomial
+        t[i] = crc;
+    }
+}
+
+/* static */
+inline const uint32_t *hash_crc32c::get_table()
+{
+    static table crc_table;
+    return crc_table.t;
+}
+
+/* static */
+inline uint64_t hash_policy::hash(uint32_t id, const void *key, size_t n)
+{
+    switch (id)
+    {
+    case WORD:
+        return hash_word::hash(key, n);
+    case CRC32C:
+        return hash_crc32c::hash(key, n);
+    default:
+        return hash_djb2::hash(key, n);
+    }
+}
+
+/* static */
+inline const char *hash_policy::name(uint32_t id)
+{
+    static const char *names[NUM_HASHES] = { "djb2", "word", "crc32c" };
+    return is_valid(id) ? names[id] : "unknown";
+}
+
+#endif // _HASH_POLICY__H_
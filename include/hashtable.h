@@ -21,30 +21,61 @@
 #define _HASHTABLE__H_
 
 #include "vmbuf.h"
+#include "hash_policy.h"
 #include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-struct hashtable
+/*
+ * open addressing table in the style of the swiss table. one control
+ * byte per slot (7 bits of the hash or EMPTY/DELETED) is probed 16 at a
+ * time, the slot itself holds the offset of the entry in buf. each entry
+ * is stored right in front of its key and value, so a hit costs the
+ * control group, the slot and the entry's cache line.
+ * both buffers are offset based and can be moved by mremap.
+ * when the table is full, a bigger one is allocated and the slots of the
+ * old one move over MIGRATE_STEP at a time on each of the following
+ * inserts. lookups check both until it's done. entries don't move, their
+ * offsets stay valid.
+ * in buf each entry is a block: entry_t, key, value, aligned to 8. removed
+ * and replaced entries are marked dead, compact() slides the live ones down
+ * over them a step at a time (this does move entries, offsets returned
+ * before are no longer valid).
+ * H is the hash policy (see hash_policy.h).
+ */
+template<typename H>
+struct hashtable_common
 {
     struct entry_t
     {
-        uint32_t next; // must be first for the following tricks to work
-        uint32_t key;
+        uint32_t key; // 0 when dead
         uint32_t key_len;
-        uint32_t val;
+        uint32_t val; // value of insert32, the others have it after the key
         uint32_t val_len;
     };
 
     enum
     {
-        DEFAULT_NUM_BUCKETS = 64
+        DEFAULT_NUM_BUCKETS = 64,
+        GROUP_SIZE = 16,
+        MIGRATE_STEP = 64,
+        COMPACT_STEP = 16 * 1024
     };
 
+    enum
+    {
+        CTRL_EMPTY = -128,
+        CTRL_DELETED = -2
+    };
+
+    static const uint32_t NOT_FOUND = (uint32_t)-1;
+
     void init(uint32_t n = DEFAULT_NUM_BUCKETS);
-    
-    uint32_t bucket(const void *key, uint32_t n);
-    
+
+    static uint64_t hashcode(const void *key, uint32_t n);
+
     uint32_t insert(const void *key, uint32_t key_len, const void *val, uint32_t val_len);
-    uint32_t insert(uint32_t bucket, const void *key, uint32_t key_len, const void *val, uint32_t val_len);
     void insert(uint32_t key_ofs, const void *val, uint32_t val_len);
     uint32_t insert(const char *key, const char *val);
 
@@ -54,18 +85,69 @@ struct hashtable
 
     void insert32(const void *key, uint32_t key_len, uint32_t val);
     uint32_t *lookup32(const void *key, uint32_t key_len);
-    
+
     void remove(char *key, uint32_t key_len);
-    
+
+    bool compact(size_t max_bytes = COMPACT_STEP);
+    bool is_compacting() const { return compact_read > 0; }
+    size_t get_used_bytes() { return buf.wlocpos(); }
+    size_t get_dead_bytes() const { return dead_bytes; }
+    uint32_t get_num_dead() const { return num_dead; }
+    uint64_t get_reclaimed_bytes() const { return reclaimed_bytes; }
+
     bool is_found(uint32_t ofs_entry);
     char *get_key(uint32_t ofs_entry);
     uint32_t get_key_len(uint32_t ofs_entry);
     char *get_val(uint32_t ofs_entry);
     uint32_t get_val_len(uint32_t ofs_entry);
-    
+
+    /*
+     * internals
+     */
+    static uint32_t match(const int8_t *group, int8_t c);
+    static uint32_t match_empty(const int8_t *group);
+    static uint32_t match_free(const int8_t *group);
+
+    static int8_t *ctrl(vmbuf &t) { return (int8_t *)t.data(); }
+    static uint32_t *slots(vmbuf &t, uint32_t m) { return (uint32_t *)(t.data() + m + 1 + GROUP_SIZE); }
+    static void set_ctrl(vmbuf &t, uint32_t m, uint32_t i, int8_t c);
+    int8_t *ctrl() { return ctrl(table); }
+    uint32_t *slots() { return slots(table, mask); }
+    void set_ctrl(uint32_t i, int8_t c) { set_ctrl(table, mask, i, c); }
+    entry_t *entry(uint32_t ofs_entry) { return (entry_t *)(buf.data() + ofs_entry); }
+    static size_t block_size(const entry_t *e) { return (sizeof(entry_t) + e->key_len + e->val_len + 7) & ~7; }
+    uint32_t alloc_entry(const void *key, uint32_t key_len, const void *val, uint32_t val_len);
+    void kill_entry(uint32_t ofs_entry);
+
+    void init_table(uint32_t capacity);
+    void grow();
+    void migrate(uint32_t n);
+    bool is_migrating() const { return old_capacity > 0; }
+    uint32_t find(vmbuf &t, uint32_t m, uint64_t h, const void *key, uint32_t key_len);
+    uint32_t *find_slot(uint64_t h, const void *key, uint32_t key_len);
+    uint32_t find_free(uint64_t h);
+    void link(uint64_t h, const void *key, uint32_t key_len, uint32_t ofs_entry);
+    void link_new(uint64_t h, uint32_t ofs_entry);
+
     vmbuf buf;
+    vmbuf table;
     uint32_t mask;
     uint32_t size;
+    uint32_t growth_left;
+
+    vmbuf old_table; // being migrated
+    uint32_t old_capacity;
+    uint32_t migrate_pos;
+
+    size_t compact_read; // 0 when not compacting
+    size_t compact_write;
+    size_t dead_bytes;
+    uint32_t num_dead;
+    uint64_t reclaimed_bytes;
+};
+
+struct hashtable : hashtable_common<hash_word>
+{
 };
 
 
@@ -73,194 +155,430 @@ struct hashtable
  * inline functions
  */
 
-inline void hashtable::init(uint32_t n /* = DEFAULT_NUM_BUCKETS */)
+template<typename H>
+inline void hashtable_common<H>::init(uint32_t n /* = DEFAULT_NUM_BUCKETS */)
 {
-    for (uint32_t m = (((uint32_t)-1) >> 1) + 1; m >= n; mask = m, m >>= 1);
+    uint32_t capacity = GROUP_SIZE;
+    for (uint64_t min_capacity = (uint64_t)n * 8 / 7; capacity < min_capacity; capacity <<= 1);
     buf.init();
-    buf.alloc(mask * sizeof(uint32_t)); // will always return 0, no need to store the ofs
-    memset(buf.data(), 0, mask * sizeof(uint32_t));
-    --mask;
+    buf.alloc(sizeof(uint64_t)); // offset 0 is reserved for not found
     size = 0;
-}
-        
-inline uint32_t hashtable::bucket(const void *key, uint32_t n)
-{
-    register const unsigned char *p = (const unsigned char *)key;
-    register const unsigned char *end = p + n;
-    uint32_t h = 5381;
-    for (; p != end; ++p)
-        h = ((h << 5) + h) ^ *p;
-    return h & mask;
+    old_table.free();
+    old_capacity = migrate_pos = 0;
+    compact_read = compact_write = dead_bytes = 0;
+    num_dead = 0;
+    reclaimed_bytes = 0;
+    init_table(capacity);
 }
 
-inline uint32_t hashtable::insert(const void *key, uint32_t key_len, const void *val, uint32_t val_len)
+/* static */
+template<typename H>
+inline uint64_t hashtable_common<H>::hashcode(const void *key, uint32_t n)
 {
-    uint32_t b = bucket(key, key_len);
-    return insert(b, key, key_len, val, val_len);
+    return H::hash(key, n);
 }
 
-inline uint32_t hashtable::insert(uint32_t bucket, const void *key, uint32_t key_len, const void *val, uint32_t val_len)
+template<typename H>
+inline uint32_t hashtable_common<H>::alloc_entry(const void *key, uint32_t key_len, const void *val, uint32_t val_len)
 {
-    uint32_t ofs_key = buf.alloc(key_len);
-    uint32_t ofs_val = buf.alloc(val_len);
-    uint32_t ofs_entry = buf.alloc(sizeof(struct entry_t));
-
-    memcpy(buf.data() + ofs_key, key, key_len);
-    memcpy(buf.data() + ofs_val, val, val_len);
-        
-    struct entry_t *e = (struct entry_t *)(buf.data() + ofs_entry);
-    e->key = ofs_key;
+    uint32_t ofs_entry = buf.alloc((sizeof(entry_t) + key_len + val_len + 7) & ~7);
+    entry_t *e = entry(ofs_entry);
+    e->key = ofs_entry + sizeof(entry_t);
     e->key_len = key_len;
-    e->val = ofs_val;
+    e->val = 0;
     e->val_len = val_len;
+    memcpy(buf.data() + e->key, key, key_len);
+    memcpy(buf.data() + e->key + key_len, val, val_len);
+    return ofs_entry;
+}
 
-    uint32_t *ofs_bucket_ptr = (((uint32_t *)buf.data()) + bucket);
-    e->next = *ofs_bucket_ptr;
-    *ofs_bucket_ptr = ofs_entry;
-    ++size;
+template<typename H>
+inline void hashtable_common<H>::kill_entry(uint32_t ofs_entry)
+{
+    entry_t *e = entry(ofs_entry);
+    dead_bytes += block_size(e);
+    ++num_dead;
+    e->key = 0;
+}
+
+template<typename H>
+inline uint32_t hashtable_common<H>::insert(const void *key, uint32_t key_len, const void *val, uint32_t val_len)
+{
+    uint32_t ofs_entry = alloc_entry(key, key_len, val, val_len);
+    link(hashcode(key, key_len), key, key_len, ofs_entry);
     return ofs_entry;
 }
 
-inline void hashtable::insert(uint32_t key_ofs, const void *val, uint32_t val_len)
+/*
+ * the key was written at the end of buf (at key_ofs, which is aligned as
+ * every block ends aligned), the entry goes in front of it
+ */
+template<typename H>
+inline void hashtable_common<H>::insert(uint32_t key_ofs, const void *val, uint32_t val_len)
 {
     uint32_t key_len = buf.wlocpos() - key_ofs;
-    void *key = buf.data(key_ofs);
-    uint32_t b = bucket(key, key_len);
-    uint32_t ofs_val = buf.alloc(val_len);
-    uint32_t ofs_entry = buf.alloc(sizeof(struct entry_t));
-
-    memcpy(buf.data() + ofs_val, val, val_len);
-        
-    struct entry_t *e = (struct entry_t *)(buf.data() + ofs_entry);
-    e->key = key_ofs;
+    size_t n = ((sizeof(entry_t) + key_len + val_len + 7) & ~7) - key_len;
+    buf.resize_if_less(n);
+    buf.wseek(n);
+    memmove(buf.data(key_ofs + sizeof(entry_t)), buf.data(key_ofs), key_len);
+    entry_t *e = entry(key_ofs);
+    e->key = key_ofs + sizeof(entry_t);
     e->key_len = key_len;
-    e->val = ofs_val;
+    e->val = 0;
     e->val_len = val_len;
-
-    uint32_t *ofs_bucket_ptr = (((uint32_t *)buf.data()) + b);
-    e->next = *ofs_bucket_ptr;
-    *ofs_bucket_ptr = ofs_entry;
-    ++size;
+    memcpy(buf.data() + e->key + key_len, val, val_len);
+    const char *key = buf.data(e->key);
+    link(hashcode(key, key_len), key, key_len, key_ofs);
 }
 
-inline uint32_t hashtable::insert(const char *key, const char *val)
+template<typename H>
+inline uint32_t hashtable_common<H>::insert(const char *key, const char *val)
 {
     return insert(key, strlen(key), val, strlen(val)+1);
 }
 
-inline uint32_t hashtable::lookup(const void *key, uint32_t key_len)
+template<typename H>
+inline uint32_t hashtable_common<H>::lookup(const void *key, uint32_t key_len)
+{
+    uint32_t *slot = find_slot(hashcode(key, key_len), key, key_len);
+    return slot ? *slot : 0;
+}
+
+template<typename H>
+inline bool hashtable_common<H>::lookup_insert(const void *key, uint32_t key_len, void *val, uint32_t val_len)
 {
-    uint32_t b = bucket(key, key_len);
-    uint32_t ofs_entry = *(((uint32_t *)buf.data()) + b);
-    while (ofs_entry > 0)
+    uint64_t h = hashcode(key, key_len);
+    uint32_t *slot = find_slot(h, key, key_len);
+    if (slot)
     {
-        struct entry_t *e = (struct entry_t *)(buf.data() + ofs_entry);
-        if (e->key_len == key_len && 0 == memcmp(buf.data() + e->key, key, key_len))
-            return ofs_entry;
-        ofs_entry = e->next;
+        entry_t *e = entry(*slot);
+        memcpy(val, buf.data() + e->key + e->key_len, e->val_len);
+        return false;
     }
-    return 0;
+    link_new(h, alloc_entry(key, key_len, val, val_len));
+    return true;
+}
+
+template<typename H>
+inline uint32_t hashtable_common<H>::lookup(const char *key)
+{
+    return lookup(key, strlen(key));
+}
+
+
+template<typename H>
+inline void hashtable_common<H>::insert32(const void *key, uint32_t key_len, uint32_t val)
+{
+    uint32_t ofs_entry = alloc_entry(key, key_len, NULL, 0);
+    entry(ofs_entry)->val = val;
+    link(hashcode(key, key_len), key, key_len, ofs_entry);
 }
 
-inline bool hashtable::lookup_insert(const void *key, uint32_t key_len, void *val, uint32_t val_len)
+template<typename H>
+inline uint32_t *hashtable_common<H>::lookup32(const void *key, uint32_t key_len)
 {
-    uint32_t b = bucket(key, key_len);
-    uint32_t ofs_entry = *(((uint32_t *)buf.data()) + b);
-    while (ofs_entry > 0)
+    uint32_t *slot = find_slot(hashcode(key, key_len), key, key_len);
+    return slot ? &entry(*slot)->val : NULL;
+}
+
+template<typename H>
+inline void hashtable_common<H>::remove(char *key, uint32_t key_len)
+{
+    uint64_t h = hashcode(key, key_len);
+    uint32_t i = find(table, mask, h, key, key_len);
+    if (NOT_FOUND == i)
     {
-        struct entry_t *e = (struct entry_t *)(buf.data() + ofs_entry);
-        if (e->key_len == key_len && 0 == memcmp(buf.data() + e->key, key, key_len))
+        if (is_migrating() && NOT_FOUND != (i = find(old_table, old_capacity - 1, h, key, key_len)))
         {
-            memcpy(val, buf.data() + e->val, e->val_len);
-            return false;
+            // the old table is going away, no need to be smart about it
+            kill_entry(slots(old_table, old_capacity - 1)[i]);
+            set_ctrl(old_table, old_capacity - 1, i, CTRL_DELETED);
+            --size;
         }
-        ofs_entry = e->next;
+        return;
     }
-    insert(b, key, key_len, val, val_len);
-    return true;
+    kill_entry(slots()[i]);
+    const int8_t *c = ctrl();
+    uint32_t empty_before = match_empty(c + ((i - GROUP_SIZE) & mask));
+    uint32_t empty_after = match_empty(c + i);
+    // if no group could have been seen full through this slot, no probe
+    // sequence ever went past it and it can go back to empty
+    if (empty_before && empty_after && __builtin_ctz(empty_after) + __builtin_clz(empty_before) - 16 < GROUP_SIZE)
+    {
+        set_ctrl(i, CTRL_EMPTY);
+        ++growth_left;
+    } else
+        set_ctrl(i, CTRL_DELETED);
+    --size;
 }
 
-inline uint32_t hashtable::lookup(const char *key)
+template<typename H>
+inline bool hashtable_common<H>::is_found(uint32_t ofs_entry)
 {
-    return lookup(key, strlen(key));
+    return ofs_entry > 0;
 }
 
+template<typename H>
+inline char *hashtable_common<H>::get_key(uint32_t ofs_entry)
+{
+    return buf.data() + entry(ofs_entry)->key;
+}
 
-inline void hashtable::insert32(const void *key, uint32_t key_len, uint32_t val)
+template<typename H>
+inline uint32_t hashtable_common<H>::get_key_len(uint32_t ofs_entry)
 {
-    uint32_t b = bucket(key, key_len);
-    uint32_t ofs_key = buf.alloc(key_len);
-    uint32_t ofs_entry = buf.alloc(sizeof(struct entry_t));
+    return entry(ofs_entry)->key_len;
+}
 
-    memcpy(buf.data() + ofs_key, key, key_len);
-        
-    struct entry_t *e = (struct entry_t *)(buf.data() + ofs_entry);
-    e->key = ofs_key;
-    e->key_len = key_len;
-    e->val = val;
+template<typename H>
+inline char *hashtable_common<H>::get_val(uint32_t ofs_entry)
+{
+    entry_t *e = entry(ofs_entry);
+    return buf.data() + e->key + e->key_len;
+}
 
-    uint32_t *ofs_bucket_ptr = (((uint32_t *)buf.data()) + b);
-    e->next = *ofs_bucket_ptr;
-    *ofs_bucket_ptr = ofs_entry;
-    ++size;
+template<typename H>
+inline uint32_t hashtable_common<H>::get_val_len(uint32_t ofs_entry)
+{
+    return entry(ofs_entry)->val_len;
+}
+
+/*
+ * bit i of the result is set when group[i] matches
+ */
+template<typename H>
+inline uint32_t hashtable_common<H>::match(const int8_t *group, int8_t c)
+{
+#ifdef __SSE2__
+    __m128i g = _mm_loadu_si128((const __m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+#else
+    uint32_t res = 0;
+    for (int i = 0; i < GROUP_SIZE; ++i)
+        res |= (uint32_t)(group[i] == c) << i;
+    return res;
+#endif
+}
+
+template<typename H>
+inline uint32_t hashtable_common<H>::match_empty(const int8_t *group)
+{
+    return match(group, CTRL_EMPTY);
+}
+
+/*
+ * empty or deleted, both have the high bit set
+ */
+template<typename H>
+inline uint32_t hashtable_common<H>::match_free(const int8_t *group)
+{
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+    uint32_t res = 0;
+    for (int i = 0; i < GROUP_SIZE; ++i)
+        res |= (uint32_t)(group[i] < 0) << i;
+    return res;
+#endif
+}
+
+/*
+ * layout: capacity + GROUP_SIZE control bytes (the first GROUP_SIZE are
+ * mirrored at the end so a group can be loaded from any slot) followed by
+ * capacity slots
+ */
+template<typename H>
+inline void hashtable_common<H>::init_table(uint32_t capacity)
+{
+    size_t n = capacity + GROUP_SIZE + capacity * sizeof(uint32_t);
+    table.init(n);
+    table.reset();
+    table.alloc(n);
+    memset(table.data(), CTRL_EMPTY, capacity + GROUP_SIZE);
+    mask = capacity - 1;
+    growth_left = capacity - (capacity >> 3);
 }
 
-inline uint32_t *hashtable::lookup32(const void *key, uint32_t key_len)
+/*
+ * start moving to a new table, twice as big unless it's mostly tombstones.
+ * the new table has room for everything in the old one plus the inserts
+ * done before the migration is over (capacity / MIGRATE_STEP)
+ */
+template<typename H>
+inline void hashtable_common<H>::grow()
+{
+    if (is_migrating())
+        migrate(old_capacity);
+    uint32_t capacity = mask + 1;
+    old_table.swap(table);
+    old_capacity = capacity;
+    migrate_pos = 0;
+    init_table(size > (capacity - (capacity >> 3)) >> 1 ? capacity << 1 : capacity);
+}
+
+/*
+ * move the next n slots of the old table, drops the tombstones
+ */
+template<typename H>
+inline void hashtable_common<H>::migrate(uint32_t n)
 {
-    uint32_t b = bucket(key, key_len);
-    uint32_t ofs_entry = *(((uint32_t *)buf.data()) + b);
-    while (ofs_entry > 0)
+    if (!is_migrating())
+        return;
+    const int8_t *old_ctrl = ctrl(old_table);
+    const uint32_t *old_slots = slots(old_table, old_capacity - 1);
+    uint32_t *s = slots();
+    for (uint32_t end = old_capacity - migrate_pos > n ? migrate_pos + n : old_capacity; migrate_pos < end; ++migrate_pos)
     {
-        struct entry_t *e = (struct entry_t *)(buf.data() + ofs_entry);
-        if (e->key_len == key_len && 0 == memcmp(buf.data() + e->key, key, key_len))
-            return &e->val;
-        ofs_entry = e->next;
+        if (old_ctrl[migrate_pos] < 0)
+            continue;
+        entry_t *e = entry(old_slots[migrate_pos]);
+        uint64_t h = hashcode(buf.data() + e->key, e->key_len);
+        uint32_t i = find_free(h);
+        if (CTRL_EMPTY == ctrl()[i])
+            --growth_left;
+        set_ctrl(i, h & 0x7F);
+        s[i] = old_slots[migrate_pos];
+        set_ctrl(old_table, old_capacity - 1, migrate_pos, CTRL_DELETED); // moved, lookups must not find it here anymore
     }
-    return NULL;
+    if (migrate_pos == old_capacity)
+    {
+        old_table.free();
+        old_capacity = 0;
+    }
+}
+
+/* static */
+template<typename H>
+inline void hashtable_common<H>::set_ctrl(vmbuf &t, uint32_t m, uint32_t i, int8_t c)
+{
+    int8_t *ctrl_bytes = ctrl(t);
+    ctrl_bytes[i] = c;
+    ctrl_bytes[((i - (GROUP_SIZE - 1)) & m) + (GROUP_SIZE - 1)] = c; // mirror of the first GROUP_SIZE - 1
 }
 
-inline void hashtable::remove(char *key, uint32_t key_len)
+/*
+ * groups are probed quadratically (triangular numbers), which visits every
+ * group when the capacity is a power of 2
+ */
+template<typename H>
+inline uint32_t hashtable_common<H>::find(vmbuf &t, uint32_t m, uint64_t h, const void *key, uint32_t key_len)
 {
-    uint32_t b = bucket(key, key_len);
-    uint32_t ofs_entry_prev = (sizeof(uint32_t) * b);
-    uint32_t ofs_entry = *((uint32_t *)(buf.data() + ofs_entry_prev));
-        
-    while (ofs_entry > 0)
+    const int8_t *c = ctrl(t);
+    const uint32_t *s = slots(t, m);
+    int8_t h2 = h & 0x7F;
+    for (uint32_t pos = (h >> 7) & m, step = 0; ; step += GROUP_SIZE, pos = (pos + step) & m)
     {
-        struct entry_t *e = (struct entry_t *)(buf.data() + ofs_entry);
-        if (e->key_len == key_len && 0 == memcmp(buf.data() + e->key, key, key_len))
+        for (uint32_t bits = match(c + pos, h2); bits; bits &= bits - 1)
         {
-            ((struct entry_t *)(buf.data() + ofs_entry_prev))->next = e->next; // trick, next must be first
-            return;
+            uint32_t i = (pos + __builtin_ctz(bits)) & m;
+            entry_t *e = entry(s[i]);
+            if (e->key_len == key_len && 0 == memcmp(buf.data() + e->key, key, key_len))
+                return i;
         }
-        ofs_entry_prev = ofs_entry;
-        ofs_entry = e->next;
+        if (match_empty(c + pos))
+            return NOT_FOUND;
     }
 }
 
-inline bool hashtable::is_found(uint32_t ofs_entry)
+/*
+ * slot of the key in the table or in the one being migrated
+ */
+template<typename H>
+inline uint32_t *hashtable_common<H>::find_slot(uint64_t h, const void *key, uint32_t key_len)
 {
-    return ofs_entry > 0;
+    uint32_t i = find(table, mask, h, key, key_len);
+    if (NOT_FOUND != i)
+        return slots() + i;
+    if (is_migrating() && NOT_FOUND != (i = find(old_table, old_capacity - 1, h, key, key_len)))
+        return slots(old_table, old_capacity - 1) + i;
+    return NULL;
 }
 
-inline char *hashtable::get_key(uint32_t ofs_entry)
+template<typename H>
+inline uint32_t hashtable_common<H>::find_free(uint64_t h)
 {
-    return buf.data() + ((struct entry_t *)(buf.data() + ofs_entry))->key;
+    const int8_t *c = ctrl();
+    for (uint32_t pos = (h >> 7) & mask, step = 0; ; step += GROUP_SIZE, pos = (pos + step) & mask)
+    {
+        uint32_t m = match_free(c + pos);
+        if (m)
+            return (pos + __builtin_ctz(m)) & mask;
+    }
 }
 
-inline uint32_t hashtable::get_key_len(uint32_t ofs_entry)
+/*
+ * a newer entry with the same key replaces the old one in its slot, the
+ * same way it used to shadow it at the head of the chain
+ */
+template<typename H>
+inline void hashtable_common<H>::link(uint64_t h, const void *key, uint32_t key_len, uint32_t ofs_entry)
 {
-    return ((struct entry_t *)(buf.data() + ofs_entry))->key_len;
+    uint32_t *slot = find_slot(h, key, key_len);
+    if (slot)
+    {
+        kill_entry(*slot);
+        *slot = ofs_entry;
+    } else
+        link_new(h, ofs_entry);
 }
 
-inline char *hashtable::get_val(uint32_t ofs_entry)
+template<typename H>
+inline void hashtable_common<H>::link_new(uint64_t h, uint32_t ofs_entry)
 {
-    return buf.data() + ((struct entry_t *)(buf.data() + ofs_entry))->val;
+    migrate(MIGRATE_STEP);
+    if (0 == growth_left)
+        grow();
+    uint32_t i = find_free(h);
+    if (CTRL_EMPTY == ctrl()[i])
+        --growth_left;
+    set_ctrl(i, h & 0x7F);
+    slots()[i] = ofs_entry;
+    ++size;
 }
 
-inline uint32_t hashtable::get_val_len(uint32_t ofs_entry)
+/*
+ * slide the live entries down over the dead ones, max_bytes of buf at a
+ * time. returns true while there is more to do. when done the pages at
+ * the end of buf are released
+ */
+template<typename H>
+inline bool hashtable_common<H>::compact(size_t max_bytes /* = COMPACT_STEP */)
 {
-    return ((struct entry_t *)(buf.data() + ofs_entry))->val_len;
+    if (!is_compacting())
+    {
+        if (0 == num_dead)
+            return false;
+        compact_read = compact_write = sizeof(uint64_t); // after the reserved offset
+    }
+    size_t end = buf.wlocpos();
+    for (size_t scanned = 0; compact_read < end && scanned < max_bytes; )
+    {
+        entry_t *e = entry(compact_read);
+        size_t n = block_size(e);
+        if (0 == e->key)
+        {
+            dead_bytes -= n;
+            --num_dead;
+            reclaimed_bytes += n;
+        } else if (compact_read != compact_write)
+        {
+            const char *key = buf.data(e->key);
+            uint32_t *slot = find_slot(hashcode(key, e->key_len), key, e->key_len);
+            memmove(buf.data(compact_write), e, n);
+            entry(compact_write)->key = compact_write + sizeof(entry_t);
+            *slot = compact_write;
+            compact_write += n;
+        } else
+            compact_write += n;
+        compact_read += n;
+        scanned += n;
+    }
+    if (compact_read < end)
+        return true;
+    buf.wtruncate(compact_write);
+    buf.shrink();
+    compact_read = compact_write = 0;
+    return false;
 }
 
 #endif // _HASHTABLE__H_
@@ -22,14 +22,53 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "vmbuf.h"
+#include "hash_policy.h"
+#include "wal.h"
+#include "logger.h"
 
+/*
+ * robin hood linear probing. an entry's probe distance is how far it sits
+ * from its home bucket (hashcode & mask), it follows from the stored
+ * hashcode. an insert takes the slot of the first entry which is closer
+ * to its home than the new one is, and carries that entry on, so probe
+ * lengths stay short even at high load. a lookup stops at the first entry
+ * closer to its home than the probe, a remove shifts the following entries
+ * back instead of leaving a hole.
+ * growing is incremental: the bigger table is created next to the old one
+ * (.tmp), each insert or remove moves RESIZE_STEP old buckets to it and
+ * lookups check both tables. when the old one is empty the .tmp replaces
+ * the .bkt. the moved buckets are marked in the .bkt, so after a crash
+ * load() can finish moving the rest. with the log open the checkpoint
+ * covers the table instead, and the pages of the moved buckets are punched
+ * out of the .bkt as it goes (lookups of the old table skip them).
+ * with set_durability() the updates are logged to .wal first (wal.h has
+ * the modes). a checkpoint is the header and the buckets, and .dat is
+ * only appended to between checkpoints, so after a crash load() restores
+ * the checkpoint, cuts .dat where it was and replays the updates after
+ * it. one is taken every checkpoint_bytes of log, when growing is done.
+ * close() syncs the files so the next load needn't replay.
+ */
 struct hashtable_disk
 {
     enum
     {
-        INITIAL_CAPACITY = 256
+        INITIAL_CAPACITY = 256,
+        HASH_ID_MASK = 0x7F, // capacity is never below 256, the low byte of it holds the hash id
+        ROBIN_HOOD = 0x80, // and this flag, files written without it are reordered on load
+        LOOKUP_BATCH = 16, // keys in flight in lookup_batch
+        RESIZE_STEP = 64, // old buckets moved by each insert or remove while growing
+        MOVED = 1, // rec_ofs of an old bucket which was moved or removed while growing, records are after the header
+        DEFAULT_CHECKPOINT_BYTES = 64 << 20 // of log
+    };
+
+    enum
+    {
+        LOG_INSERT,
+        LOG_INSERT_OR_UPDATE,
+        LOG_REMOVE
     };
 
     struct entry_t
@@ -43,36 +82,78 @@ struct hashtable_disk
         uint32_t capacity;
         uint32_t mask;
         uint32_t size;
+
+        uint32_t get_capacity() const { return capacity & ~(HASH_ID_MASK | ROBIN_HOOD); }
+        void set_capacity(uint32_t c) { capacity = c | (capacity & (HASH_ID_MASK | ROBIN_HOOD)); }
+        uint32_t get_hash_id() const { return capacity & HASH_ID_MASK; } // 0 (djb2) in files written before the id was recorded
+        bool is_robin_hood() const { return 0 != (capacity & ROBIN_HOOD); }
     };
 
+    struct log_rec_t // followed by the key and the value
+    {
+        uint32_t op;
+        uint32_t key_len;
+        uint32_t val_len;
+    };
+
+    struct checkpoint_t // followed by the buckets
+    {
+        ht_header_t header;
+        uint32_t dat_end;
+    };
+
+    hashtable_disk() : mask(0), old_mask(0), resize_pos(0), durability(wal::OFF), checkpoint_bytes(DEFAULT_CHECKPOINT_BYTES) {}
+
     inline ht_header_t *header() const;
     inline void init_filenames(const char *basename);
+    bool is_mem() const { return 0 == filename.write_loc; }
+    bool needs_bkt() const { return !is_mem() && !log.is_open(); } // a crash recovers from the .bkt (and .tmp)
 
-    inline int init_create();
-    inline int create(const char *basename);
+    inline int init_create(uint32_t hash_id);
+    inline int create(const char *basename, uint32_t hash_id = hash_policy::DEFAULT);
     inline int create(int dat_fd, int bkt_fd);
-    inline int create_mem();
-    inline int load(const char *filename, int mmap_flags);
+    inline int create_mem(uint32_t hash_id = hash_policy::DEFAULT);
+    inline int load(const char *basename);
+    inline int rebuild();
+    inline int finish_resize();
 
     inline int finalize();
     inline int close();
 
-    inline uint32_t next_bucket(uint32_t bucket) const;
+    // before create() or load(), checkpoint_bytes 0: only by checkpoint()
+    void set_durability(int mode, size_t ckpt_bytes = DEFAULT_CHECKPOINT_BYTES) { durability = mode; checkpoint_bytes = ckpt_bytes; }
+    int commit() { return log.is_open() ? log.commit() : 0; }
+    void set_commit_timer(epoll_timer_chain *chain) { log.set_timer(chain); } // wal::set_timer
+    inline int checkpoint();
+    inline void check_checkpoint();
+    inline int recover();
+    inline int replay();
+    inline int sync();
+    inline void log_update(uint32_t op, const void *key, size_t key_len, const void *val, size_t val_len);
 
-    static inline uint32_t hashcode(const void *key, size_t n);
+    inline uint32_t hashcode(const void *key, size_t n) const;
+    static uint32_t probe_distance(const struct entry_t *e, uint32_t bucket, uint32_t mask) { return (bucket - e->hashcode) & mask; }
 
     inline void resize_grow();
+    inline void resize_step(uint32_t n);
     inline void check_resize();
+    bool is_resizing() const { return 0 != old_mask; }
+
+    static inline void place(struct entry_t *entries, uint32_t mask, struct entry_t e);
+    static inline bool has_rec(const struct entry_t *entries, uint32_t mask, struct entry_t e);
+    inline uint32_t append_rec(const void *key, size_t key_len, const void *val, size_t val_len);
 
     inline uint32_t insert(const void *key, size_t key_len, const void *val, size_t val_len);
     inline uint32_t insert_unique(const void *key, size_t key_len, const void *val, size_t val_len);
     inline uint32_t insert_or_update(const void *key, size_t key_len, const void *val, size_t val_len);
     inline uint32_t insert(const char *key, const char *val);
 
+    inline struct entry_t *lookup_entry(struct entry_t *entries, uint32_t mask, uint32_t hc, const void *key, size_t key_len, uint32_t from = 0) const;
+    inline struct entry_t *lookup_entry(uint32_t hc, const void *key, size_t key_len) const;
     inline uint32_t lookup(const void *key, size_t key_len) const;
     inline const char *lookup(const char *key) const;
-    inline uint32_t locate_new_slot(uint32_t bucket);
-    inline void fix_chain_down(uint32_t bucket);
+    inline uint32_t lookup(uint32_t hc, const void *key, size_t key_len) const;
+    inline void lookup_batch(const void *const *keys, const size_t *key_lens, uint32_t n, uint32_t *rec_ofs) const;
     inline int remove(const void *key, size_t key_len);
 
     inline void *get_key(uint32_t rec_ofs) const;
@@ -81,17 +162,25 @@ struct hashtable_disk
     inline uint32_t get_val_size(uint32_t rec_ofs) const;
 
     uint32_t num_keys() const { return header()->size; }
-    uint32_t mem_usage() { return buckets.wlocpos() + data.wlocpos(); }
+    uint32_t mem_usage() { return buckets.wlocpos() + old_buckets.wlocpos() + data.wlocpos(); }
 
-    vmfile buckets;
+    vmfile buckets; // while growing: the new table, in the .tmp file
+    vmfile old_buckets; // while growing: the .bkt file, being moved to buckets
     vmfile data;
-
-    // |dat loc|bkt loc|tmp loc|data_filename.dat\0|bucket_filename.bkt\0|tmp_filename.tmp\0
+    uint32_t mask; // of buckets, the header describes the .bkt file
+    uint32_t old_mask; // 0 unless growing
+    uint32_t resize_pos; // next old bucket to move
+    int durability;
+    size_t checkpoint_bytes;
+    wal log;
+
+    // |dat loc|bkt loc|tmp loc|wal loc|data_filename.dat\0|bucket_filename.bkt\0|tmp_filename.tmp\0|log_filename.wal\0
     enum
     {
         FN_DAT,
         FN_BKT,
-        FN_TMP
+        FN_TMP,
+        FN_WAL
     };
     const char *get_filename(int i) { return filename.data(*(((uint16_t *)filename.data()) + i)); }
     vmbuf filename;
@@ -105,7 +194,7 @@ inline hashtable_disk::ht_header_t *hashtable_disk::header() const
 inline void hashtable_disk::init_filenames(const char *basename)
 {
     filename.init();
-    filename.wseek(sizeof(uint16_t) * 3);
+    filename.wseek(sizeof(uint16_t) * 4);
 
     uint16_t *filename_ofs = (uint16_t *)filename.data();
 
@@ -123,243 +212,529 @@ inline void hashtable_disk::init_filenames(const char *basename)
     filename.strcpy(basename);
     filename.strcpy(".tmp");
     filename.copy<char>('\0');
+
+    *filename_ofs++ = filename.wlocpos(); // wal location
+    filename.strcpy(basename);
+    filename.strcpy(".wal");
+    filename.copy<char>('\0');
 }
 
-inline int hashtable_disk::init_create()
+inline int hashtable_disk::init_create(uint32_t hash_id)
 {
     struct ht_header_t header;
-    header.capacity = INITIAL_CAPACITY;
-    header.mask = header.capacity - 1;
+    header.capacity = INITIAL_CAPACITY | ROBIN_HOOD | hash_id;
+    header.mask = INITIAL_CAPACITY - 1;
     header.size = 0;
 
     data.copy<ht_header_t>(header);
-    size_t n = header.capacity * sizeof(struct entry_t);
+    size_t n = INITIAL_CAPACITY * sizeof(struct entry_t);
     buckets.resize_if_less(n);
     buckets.wseek(n);
+    mask = header.mask;
+    old_mask = 0;
     return 0;
 }
 
-inline int hashtable_disk::create(const char *basename)
+inline int hashtable_disk::create(const char *basename, uint32_t hash_id /* = hash_policy::DEFAULT */)
 {
     init_filenames(basename);
     if (0 > data.create(get_filename(FN_DAT)) || 0 >  buckets.create(get_filename(FN_BKT)))
         return -1;
-
-    return init_create();
+    if (0 > unlink(get_filename(FN_WAL)) && ENOENT != errno) // would be replayed by load
+        return LOGGER_PERROR_STR(get_filename(FN_WAL)), -1;
+    if (0 > unlink(get_filename(FN_TMP)) && ENOENT != errno) // load would take it for a resize of this table
+        return LOGGER_PERROR_STR(get_filename(FN_TMP)), -1;
+
+    init_create(hash_id);
+    if (wal::OFF == durability)
+        return 0;
+    if (0 > log.init(get_filename(FN_WAL), durability))
+        return -1;
+    return checkpoint();
 }
 
-inline int hashtable_disk::create_mem()
+inline int hashtable_disk::create_mem(uint32_t hash_id /* = hash_policy::DEFAULT */)
 {
     if (0 > data.create_tmp() || 0 > buckets.create_tmp())
         return -1;
 
-    return init_create();
+    return init_create(hash_id);
 }
 
-inline int hashtable_disk::load(const char *basename, int mmap_flags)
+inline int hashtable_disk::load(const char *basename)
 {
     init_filenames(basename);
-    if (0 > data.load(get_filename(FN_DAT), mmap_flags, VMSTORAGE_RW) ||
-        0 > buckets.load(get_filename(FN_BKT), mmap_flags, VMSTORAGE_RW))
+    old_mask = 0;
+    bool logged = 0 == access(get_filename(FN_WAL), F_OK);
+    for (int i = FN_DAT; i <= (logged ? FN_DAT : FN_BKT); ++i) // the log has the buckets
+    {
+        if (0 > access(get_filename(i), R_OK | W_OK)) // init() would create it
+        {
+            LOGGER_PERROR_STR(get_filename(i));
+            return -1;
+        }
+    }
+    if (0 > data.init(get_filename(FN_DAT)) || 0 > buckets.init(get_filename(FN_BKT)) ||
+        (logged && 0 > recover()) ||
+        (!logged && 0 == access(get_filename(FN_TMP), F_OK) && 0 > finish_resize()))
+    {
+        close();
+        return -1;
+    }
+    if (data.wlocpos() < sizeof(ht_header_t) ||
+        buckets.wlocpos() < (size_t)header()->get_capacity() * sizeof(struct entry_t))
+    {
+        LOGGER_ERROR("%s: buckets don't match the header", basename);
+        close();
         return -1;
+    }
+    buckets.wlocset((size_t)header()->get_capacity() * sizeof(struct entry_t)); // not finalized: page aligned
+    if (!hash_policy::is_valid(header()->get_hash_id()))
+    {
+        LOGGER_ERROR("%s: unknown hash function [%u]", get_filename(FN_DAT), header()->get_hash_id());
+        close();
+        return -1;
+    }
+    mask = header()->mask;
+    if (logged && 0 > replay())
+    {
+        close();
+        return -1;
+    }
+    if (!header()->is_robin_hood() && 0 > rebuild())
+    {
+        close();
+        return -1;
+    }
+    if (wal::OFF == durability || log.is_open())
+        return 0;
+    // logged from now on
+    if (0 > log.init(get_filename(FN_WAL), durability))
+        return -1;
+    return checkpoint();
+}
 
+/*
+ * puts the header and the buckets of the log's checkpoint back, and cuts
+ * what was appended to .dat after it (the records replay it)
+ */
+inline int hashtable_disk::recover()
+{
+    if (0 > log.init(get_filename(FN_WAL), durability) || 0 > log.load())
+        return -1;
+    if (log.is_clean())
+        return 0; // synced by close
+    checkpoint_t *ckpt = (checkpoint_t *)log.get_checkpoint();
+    if (log.get_checkpoint_size() < sizeof(checkpoint_t) || data.wlocpos() < ckpt->dat_end)
+    {
+        LOGGER_ERROR("%s: doesn't match the log's checkpoint", get_filename(FN_DAT));
+        return -1;
+    }
+    data.wlocset(ckpt->dat_end);
+    *header() = ckpt->header;
+    buckets.wreset();
+    if (0 > buckets.memcpy(ckpt + 1, log.get_checkpoint_size() - sizeof(checkpoint_t)) || 0 > buckets.finalize())
+        return -1;
+    if (0 > unlink(get_filename(FN_TMP)) && ENOENT != errno) // of a resize, it starts over
+        return LOGGER_PERROR_STR(get_filename(FN_TMP)), -1;
     return 0;
 }
 
-inline int hashtable_disk::finalize()
+/*
+ * a crash while growing (without the log) leaves the .tmp next to the
+ * .bkt. the .bkt has the entries which weren't moved, the moved ones are
+ * marked (one moved right before the crash can be in both, its record
+ * tells). the rest go to the .tmp, which then replaces the .bkt.
+ */
+inline int hashtable_disk::finish_resize()
 {
-    return ((buckets.finalize() + data.finalize()) == 0 ? 0 : -1);
+    if (data.wlocpos() < sizeof(ht_header_t))
+        return 0; // load reports it
+    uint32_t capacity = header()->get_capacity();
+    size_t old_size = (size_t)capacity * sizeof(struct entry_t);
+    vmfile tmp;
+    if (!header()->is_robin_hood())
+    {
+        // older versions grew in one go and left the .bkt as it was until the rename
+        if (0 > unlink(get_filename(FN_TMP)))
+            return LOGGER_PERROR_STR(get_filename(FN_TMP)), -1;
+        return 0;
+    }
+    if (0 > tmp.init(get_filename(FN_TMP)))
+        return -1;
+    if (tmp.wlocpos() >= old_size * 2)
+    {
+        // stopped while moving
+        if (buckets.wlocpos() < old_size)
+        {
+            LOGGER_ERROR("%s: buckets don't match the header", get_filename(FN_BKT));
+            return -1;
+        }
+        uint32_t new_mask = (capacity << 1) - 1;
+        struct entry_t *entries = (struct entry_t *)tmp.data();
+        uint32_t num_moved = 0;
+        for (struct entry_t *e = (struct entry_t *)buckets.data(), *end = e + capacity; e != end; ++e)
+        {
+            if (MOVED < e->rec_ofs && !has_rec(entries, new_mask, *e))
+            {
+                place(entries, new_mask, *e);
+                ++num_moved;
+            }
+        }
+        header()->set_capacity(new_mask + 1);
+        header()->mask = new_mask;
+        LOGGER_INFO("%s: finished growing to %u buckets, moved %u", get_filename(FN_TMP), new_mask + 1, num_moved);
+    } else if (tmp.wlocpos() < old_size)
+    {
+        // not started (created with its full size)
+        tmp.free();
+        if (0 > unlink(get_filename(FN_TMP)))
+            return LOGGER_PERROR_STR(get_filename(FN_TMP)), -1;
+        return 0;
+    }
+    // else stopped before the rename (the header is updated after the last move), the .tmp is the table
+    buckets.swap(tmp);
+    tmp.free();
+    if (0 > rename(get_filename(FN_TMP), get_filename(FN_BKT)))
+        return LOGGER_PERROR_STR(get_filename(FN_TMP)), -1;
+    return 0;
 }
 
-inline int hashtable_disk::close()
+/*
+ * applies the records after recover(), the log isn't open so they aren't
+ * logged again. without durability the log goes once the files are synced
+ */
+inline int hashtable_disk::replay()
 {
-    return ((buckets.free() + data.free()) == 0 ? 0 : -1);
+    bool clean = log.is_clean();
+    uint32_t num_recs = 0;
+    uint32_t n;
+    const char *rec;
+    while (NULL != (rec = log.next(&n)))
+    {
+        ++num_recs;
+        const log_rec_t *lr = (const log_rec_t *)rec;
+        const char *key = (const char *)(lr + 1);
+        if (n < sizeof(log_rec_t) || n - sizeof(log_rec_t) < (size_t)lr->key_len + lr->val_len)
+        {
+            LOGGER_ERROR("%s: invalid record", get_filename(FN_WAL));
+            return -1;
+        }
+        if (clean)
+            continue;
+        switch (lr->op)
+        {
+        case LOG_INSERT:
+            insert(key, lr->key_len, key + lr->key_len, lr->val_len);
+            break;
+        case LOG_INSERT_OR_UPDATE:
+            insert_or_update(key, lr->key_len, key + lr->key_len, lr->val_len);
+            break;
+        case LOG_REMOVE:
+            remove(key, lr->key_len);
+            break;
+        }
+    }
+    if (!clean)
+        LOGGER_INFO("%s: replayed %u updates", get_filename(FN_WAL), num_recs);
+    if (wal::OFF != durability)
+        return log.open();
+    if (0 > sync())
+        return -1;
+    log.close();
+    if (0 > unlink(get_filename(FN_WAL)))
+        return LOGGER_PERROR_STR(get_filename(FN_WAL)), -1;
+    return 0;
 }
 
-inline uint32_t hashtable_disk::next_bucket(uint32_t bucket) const
+/*
+ * the files hold every update (a resize in progress is finished)
+ */
+inline int hashtable_disk::sync()
 {
-    ++bucket;
-    if (bucket == header()->capacity)
-        bucket = 0;
-    return bucket;
+    if (is_resizing())
+        resize_step(old_mask + 1);
+    if (0 > data.storage.sync() || 0 > buckets.storage.sync() || 0 > wal::sync_dir(get_filename(FN_BKT)))
+        return LOGGER_PERROR_STR(get_filename(FN_BKT)), -1;
+    return 0;
 }
 
-/* static */
-inline uint32_t hashtable_disk::hashcode(const void *key, size_t n)
+/*
+ * restarts the log with the header and the buckets, after .dat is synced
+ * up to where it ends now (the checkpoint points there). a resize in
+ * progress is finished first
+ */
+inline int hashtable_disk::checkpoint()
 {
-    register const unsigned char *p = (const unsigned char *)key;
-    register const unsigned char *end = p + n;
-    uint32_t h = 5381;
-    for (; p != end; ++p)
-        h = ((h << 5) + h) ^ *p;
-    return h;
+    if (is_resizing())
+        resize_step(old_mask + 1);
+    if (0 > data.storage.sync())
+        return LOGGER_PERROR_STR(get_filename(FN_DAT)), -1;
+    checkpoint_t ckpt;
+    ckpt.header = *header();
+    ckpt.dat_end = data.wlocpos();
+    struct iovec iov[2];
+    iov[0].iov_base = &ckpt;
+    iov[0].iov_len = sizeof(ckpt);
+    iov[1].iov_base = buckets.data();
+    iov[1].iov_len = (size_t)(mask + 1) * sizeof(struct entry_t);
+    return log.checkpoint(iov, 2);
+}
+
+inline void hashtable_disk::check_checkpoint()
+{
+    // when it fails the old log stays, and grows. not while growing, it would have to finish at once:
+    // the first update after it takes the checkpoint
+    if (0 < checkpoint_bytes && log.is_open() && !is_resizing() && log.log_size() >= checkpoint_bytes)
+        checkpoint();
+}
+
+inline void hashtable_disk::log_update(uint32_t op, const void *key, size_t key_len, const void *val, size_t val_len)
+{
+    if (!log.is_open())
+        return;
+    log_rec_t *rec = (log_rec_t *)log.begin(sizeof(log_rec_t) + key_len + val_len);
+    rec->op = op;
+    rec->key_len = key_len;
+    rec->val_len = val_len;
+    memcpy(rec + 1, key, key_len);
+    if (0 < val_len)
+        memcpy((char *)(rec + 1) + key_len, val, val_len);
+    if (0 > log.end())
+    {
+        LOGGER_ERROR_STR("hashtable_disk: failed to log an update");
+        abort();
+    }
 }
 
-/* static */
 /*
-inline uint32_t hashtable_disk::hashcode(const void *key, size_t n)
+ * files written before robin hood are plain linear probing, which a
+ * lookup's early stop would miss entries of. insert them again in order.
+ */
+inline int hashtable_disk::rebuild()
 {
-    register const unsigned char *p = (const unsigned char *)key;
-    register const unsigned char *end = p + n;
-    register uint32_t h = 0;
-    const uint32_t prime = 0x811C9DC5;
-    for (; p != end; ++p)
-        h = (h ^ *p) * prime;
-    return h;
+    vmbuf tmp;
+    size_t n = buckets.wlocpos();
+    if (0 > tmp.init(n) || 0 > tmp.memcpy(buckets.data(), n))
+        return -1;
+    memset(buckets.data(), 0, n);
+    struct entry_t *entries = (struct entry_t *)buckets.data();
+    for (struct entry_t *e = (struct entry_t *)tmp.data(), *end = e + header()->get_capacity(); e != end; ++e)
+    {
+        if (0 != e->rec_ofs)
+            place(entries, mask, *e);
+    }
+    header()->capacity |= ROBIN_HOOD;
+    return 0;
 }
-*/
 
+inline int hashtable_disk::finalize()
+{
+    if (is_resizing())
+        resize_step(old_mask + 1);
+    if (0 > commit())
+        return -1;
+    return ((buckets.finalize() + data.finalize()) == 0 ? 0 : -1);
+}
+
+inline int hashtable_disk::close()
+{
+    if (is_resizing())
+        resize_step(old_mask + 1); // the .bkt file has to hold all of the entries
+    int res = 0;
+    if (log.is_open() && (0 > sync() || 0 > log.mark_clean()))
+        res = -1;
+    if (0 > log.close())
+        res = -1;
+    return ((buckets.free() + data.free()) == 0 ? res : -1);
+}
+
+inline uint32_t hashtable_disk::hashcode(const void *key, size_t n) const
+{
+    return hash_policy::hash(header()->get_hash_id(), key, n);
+}
+
+/*
+ * starts growing, the entries move over in resize_step
+ */
 inline void hashtable_disk::resize_grow()
 {
-    uint32_t new_capacity = header()->capacity << 1;
-    uint32_t new_mask = new_capacity - 1;
-
-    vmfile new_buckets;
-    new_buckets.create(get_filename(FN_TMP), sizeof(struct entry_t) * new_capacity);
-    new_buckets.wseek(sizeof(struct entry_t) * new_capacity);
-
-    struct entry_t *entries = (struct entry_t *)new_buckets.data();
-    for (entry_t *e = (struct entry_t *)buckets.data(), *end = e + header()->capacity; e != end; ++e) {
-        uint32_t new_bucket = e->hashcode & new_mask;
-        for (;;) {
-            struct entry_t *ne = entries + new_bucket;
-            if (ne->rec_ofs == 0) {
-                *ne = *e;
-                break;
-            }
-            ++new_bucket;
-            if (new_bucket == new_capacity)
-                new_bucket = 0;
+    uint32_t new_capacity = (mask + 1) << 1;
+    size_t n = sizeof(struct entry_t) * new_capacity;
+
+    old_buckets.swap(buckets);
+    if (0 > (is_mem() ? buckets.create_tmp(n) : buckets.create(get_filename(FN_TMP), n)))
+    {
+        LOGGER_ERROR_STR("hashtable_disk::resize_grow() failed to create the new buckets");
+        abort();
+    }
+    buckets.unsafe_wseek(n); // no room after it, finish_resize tells how far it got by the file size
+    old_mask = mask;
+    mask = new_capacity - 1;
+    resize_pos = 0;
+}
+
+/*
+ * moves up to n old buckets, when the last one is moved the new buckets
+ * replace the old ones
+ */
+inline void hashtable_disk::resize_step(uint32_t n)
+{
+    struct entry_t *entries = (struct entry_t *)buckets.data();
+    struct entry_t *old_entries = (struct entry_t *)old_buckets.data();
+    uint32_t end = old_mask - resize_pos < n ? old_mask + 1 : resize_pos + n;
+    off_t punched = ((off_t)resize_pos * sizeof(struct entry_t)) & ~vmpage::PAGEMASK;
+    bool keep = needs_bkt();
+    for (; resize_pos != end; ++resize_pos)
+    {
+        struct entry_t *e = old_entries + resize_pos;
+        if (MOVED < e->rec_ofs)
+        {
+            place(entries, mask, *e);
+            if (keep)
+                e->rec_ofs = MOVED; // after placing it, load tells an entry in both tables by its record
         }
     }
-    buckets.free();
-    buckets = new_buckets;
-    new_buckets.storage.detach();
-    if (0 > rename(get_filename(FN_TMP), get_filename(FN_BKT))) {
-        perror("hashtable_disk::resize_grow() failed to rename tmp -> bkt");
+    // freeing them all with the file would stall this insert (the kernel drops the pages one by one).
+    // when the file system can't punch holes they still go with the file
+    off_t moved = ((off_t)resize_pos * sizeof(struct entry_t)) & ~vmpage::PAGEMASK;
+    if (!keep && moved > punched)
+        old_buckets.storage.punch_hole(punched, moved - punched);
+    if (resize_pos <= old_mask)
+        return;
+
+    old_buckets.free();
+    // the header first, a .tmp as big as the header says is the table (finish_resize)
+    header()->set_capacity(mask + 1);
+    header()->mask = mask;
+    old_mask = 0;
+    if (is_mem())
+        return;
+    // with the log, unlink first: renaming over a file makes ext4 write the new one out (auto_da_alloc)
+    // before it returns. without it the .bkt has to be there until replaced
+    if ((!keep && 0 > unlink(get_filename(FN_BKT))) || 0 > rename(get_filename(FN_TMP), get_filename(FN_BKT)))
+    {
+        perror("hashtable_disk::resize_step() failed to rename tmp -> bkt");
         abort();
     }
-
-    header()->capacity = new_capacity;
-    header()->mask = new_mask;
 }
 
 inline void hashtable_disk::check_resize()
 {
-    uint32_t c = header()->capacity >> 1;
-    if (header()->size > c)
+    if (is_resizing())
+        resize_step(RESIZE_STEP);
+    else if (header()->size > ((mask + 1) >> 1))
         resize_grow();
 }
 
-inline uint32_t hashtable_disk::insert(const void *key, size_t key_len, const void *val, size_t val_len)
+/* static */
+inline void hashtable_disk::place(struct entry_t *entries, uint32_t mask, struct entry_t e)
 {
-    check_resize();
-    uint32_t hc = hashcode(key, key_len);
-    uint32_t bucket = hc & header()->mask;
-    struct entry_t *entries = (struct entry_t *)buckets.data();
-    for (;;)
+    uint32_t bucket = e.hashcode & mask;
+    for (uint32_t dist = 0;; ++dist)
     {
-        struct entry_t *e = entries + bucket;
-        if (0 == e->rec_ofs)
+        struct entry_t *b = entries + bucket;
+        if (0 == b->rec_ofs)
         {
-            e->hashcode = hc;
-            uint32_t ofs = data.wlocpos();
-            e->rec_ofs = ofs;
-            *data.alloc<uint32_t>() = key_len;
-            *data.alloc<uint32_t>() = val_len;
-            data.memcpy(key, key_len);
-            data.memcpy(val, val_len);
-            ++header()->size;
-            return ofs;
-        } else {
-            bucket = next_bucket(bucket);
+            *b = e;
+            return;
         }
+        uint32_t d = probe_distance(b, bucket, mask);
+        if (d < dist)
+        {
+            // richer than the one being placed, it gives up the slot
+            struct entry_t t = *b;
+            *b = e;
+            e = t;
+            dist = d;
+        }
+        bucket = (bucket + 1) & mask;
     }
-    return 0;
+}
+
+/*
+ * whether e (its record) is in entries already
+ */
+/* static */
+inline bool hashtable_disk::has_rec(const struct entry_t *entries, uint32_t mask, struct entry_t e)
+{
+    uint32_t bucket = e.hashcode & mask;
+    for (uint32_t dist = 0;; ++dist)
+    {
+        const struct entry_t *b = entries + bucket;
+        if (0 == b->rec_ofs || probe_distance(b, bucket, mask) < dist)
+            return false;
+        if (e.rec_ofs == b->rec_ofs)
+            return true;
+        bucket = (bucket + 1) & mask;
+    }
+}
+
+inline uint32_t hashtable_disk::append_rec(const void *key, size_t key_len, const void *val, size_t val_len)
+{
+    uint32_t ofs = data.wlocpos();
+    *data.alloc<uint32_t>() = key_len;
+    *data.alloc<uint32_t>() = val_len;
+    data.memcpy(key, key_len);
+    data.memcpy(val, val_len);
+    return ofs;
+}
+
+inline uint32_t hashtable_disk::insert(const void *key, size_t key_len, const void *val, size_t val_len)
+{
+    check_checkpoint();
+    check_resize();
+    log_update(LOG_INSERT, key, key_len, val, val_len);
+    struct entry_t e;
+    e.hashcode = hashcode(key, key_len);
+    e.rec_ofs = append_rec(key, key_len, val, val_len);
+    place((struct entry_t *)buckets.data(), mask, e);
+    ++header()->size;
+    return e.rec_ofs;
 }
 
 inline uint32_t hashtable_disk::insert_unique(const void *key, size_t key_len, const void *val, size_t val_len)
 {
+    check_checkpoint();
     check_resize();
-    uint32_t hc = hashcode(key, key_len);
-    uint32_t bucket = hc & header()->mask;
-    struct entry_t *entries = (struct entry_t *)buckets.data();
-    for (;;)
-    {
-        struct entry_t *e = entries + bucket;
-        if (e->rec_ofs == 0)
-        {
-            e->hashcode = hc;
-            uint32_t ofs = data.wlocpos();
-            e->rec_ofs = ofs;
-            *data.alloc<uint32_t>() = key_len;
-            *data.alloc<uint32_t>() = val_len;
-            data.memcpy(key, key_len);
-            data.memcpy(val, val_len);
-            ++header()->size;
-            return ofs;
-        }
-        if (hc == e->hashcode)
-        {
-            uint32_t ofs = e->rec_ofs;
-            char *rec = data.data(ofs);
-            char *k = rec + (sizeof(uint32_t) * 2);
-            if (*(uint32_t *)rec == key_len && 0 == memcmp(key, k, key_len))
-                return ofs;
-        }
-        bucket = next_bucket(bucket);
-    } 
-    return 0;
+    struct entry_t e;
+    e.hashcode = hashcode(key, key_len);
+    struct entry_t *found = lookup_entry(e.hashcode, key, key_len);
+    if (NULL != found)
+        return found->rec_ofs;
+    log_update(LOG_INSERT, key, key_len, val, val_len); // it's new, same as an insert
+    e.rec_ofs = append_rec(key, key_len, val, val_len);
+    place((struct entry_t *)buckets.data(), mask, e);
+    ++header()->size;
+    return e.rec_ofs;
 }
 
 inline uint32_t hashtable_disk::insert_or_update(const void *key, size_t key_len, const void *val, size_t val_len)
 {
+    check_checkpoint();
     check_resize();
-    uint32_t hc = hashcode(key, key_len);
-    uint32_t bucket = hc & header()->mask;
-    struct entry_t *entries = (struct entry_t *)buckets.data();
-    for (;;)
+    log_update(LOG_INSERT_OR_UPDATE, key, key_len, val, val_len);
+    struct entry_t e;
+    e.hashcode = hashcode(key, key_len);
+    struct entry_t *found = lookup_entry(e.hashcode, key, key_len);
+    if (NULL != found)
     {
-        struct entry_t *e = entries + bucket;
-        if (e->rec_ofs == 0)
+        uint32_t ofs = found->rec_ofs;
+        char *rec = data.data(ofs);
+        uint32_t *vl = (uint32_t *)rec + 1;
+        if (val_len <= *vl && !log.is_open()) // logged: .dat is only appended to between checkpoints
         {
-            e->hashcode = hc;
-            uint32_t ofs = data.wlocpos();
-            e->rec_ofs = ofs;
-            *data.alloc<uint32_t>() = key_len;
-            *data.alloc<uint32_t>() = val_len;
-            data.memcpy(key, key_len);
-            data.memcpy(val, val_len);
-            ++header()->size;
+            memcpy(rec + (sizeof(uint32_t) * 2) + key_len, val, val_len);
+            *vl = val_len;
             return ofs;
         }
-        if (hc == e->hashcode)
-        {
-            uint32_t ofs = e->rec_ofs;
-            char *rec = data.data(ofs);
-            char *k = rec + (sizeof(uint32_t) * 2);
-            if (*(uint32_t *)rec == key_len && 0 == memcmp(key, k, key_len))
-            {
-                uint32_t *vl = (uint32_t *)rec + 1;
-                if (val_len <= *vl)
-                {
-                    memcpy(k + key_len, val, val_len);
-                    *vl = val_len;
-                } else
-                {
-                    ofs = data.wlocpos();
-                    e->rec_ofs = ofs;
-                    *data.alloc<uint32_t>() = key_len;
-                    *data.alloc<uint32_t>() = val_len;
-                    data.memcpy(key, key_len);
-                    data.memcpy(val, val_len);
-                }
-                return ofs;
-            }
-        }
-        bucket = next_bucket(bucket);
-    } 
-    return 0; // should never get here
+        found->rec_ofs = append_rec(key, key_len, val, val_len); // in whichever table it is, nothing moved since the lookup
+        return found->rec_ofs;
+    }
+    e.rec_ofs = append_rec(key, key_len, val, val_len);
+    place((struct entry_t *)buckets.data(), mask, e);
+    ++header()->size;
+    return e.rec_ofs;
 }
 
 
@@ -368,27 +743,54 @@ inline uint32_t hashtable_disk::insert(const char *key, const char *val)
     return insert(key, strlen(key), val, strlen(val)+1);
 }
 
-inline uint32_t hashtable_disk::lookup(const void *key, size_t key_len) const
+/*
+ * stops at an empty bucket, or at an entry closer to its home than the
+ * key would be (robin hood would have placed the key before it).
+ * buckets below from (the old ones already moved) are skipped, the key
+ * can't be there and they may be gone from the file.
+ */
+inline struct hashtable_disk::entry_t *hashtable_disk::lookup_entry(struct entry_t *entries, uint32_t mask, uint32_t hc, const void *key, size_t key_len, uint32_t from /* = 0 */) const
 {
-    uint32_t hc = hashcode(key, key_len);
-    uint32_t bucket = hc & header()->mask;
-    struct entry_t *entries = (struct entry_t *)buckets.data();
-    for (;;)
+    uint32_t bucket = hc & mask;
+    for (uint32_t dist = 0;; ++dist)
     {
+        if (bucket < from)
+        {
+            dist += from - bucket;
+            bucket = from;
+        }
         struct entry_t *e = entries + bucket;
-        if (e->rec_ofs == 0)
-            return 0;
-        if (hc == e->hashcode)
+        if (0 == e->rec_ofs || probe_distance(e, bucket, mask) < dist)
+            return NULL;
+        if (hc == e->hashcode && MOVED != e->rec_ofs)
         {
-            uint32_t ofs = e->rec_ofs;
-            char *rec = data.data(ofs);
+            char *rec = data.data(e->rec_ofs);
             char *k = rec + (sizeof(uint32_t) * 2);
             if (*(uint32_t *)rec == key_len && 0 == memcmp(key, k, key_len))
-                return ofs;
+                return e;
         }
-        bucket = next_bucket(bucket);
-    } 
-    return 0;
+        bucket = (bucket + 1) & mask;
+    }
+    return NULL;
+}
+
+inline struct hashtable_disk::entry_t *hashtable_disk::lookup_entry(uint32_t hc, const void *key, size_t key_len) const
+{
+    struct entry_t *e = lookup_entry((struct entry_t *)buckets.data(), mask, hc, key, key_len);
+    if (NULL == e && is_resizing())
+        e = lookup_entry((struct entry_t *)old_buckets.data(), old_mask, hc, key, key_len, resize_pos);
+    return e;
+}
+
+inline uint32_t hashtable_disk::lookup(const void *key, size_t key_len) const
+{
+    return lookup(hashcode(key, key_len), key, key_len);
+}
+
+inline uint32_t hashtable_disk::lookup(uint32_t hc, const void *key, size_t key_len) const
+{
+    struct entry_t *e = lookup_entry(hc, key, key_len);
+    return NULL == e ? 0 : e->rec_ofs;
 }
 
 inline const char *hashtable_disk::lookup(const char *key) const
@@ -400,69 +802,71 @@ inline const char *hashtable_disk::lookup(const char *key) const
         return (const char *)get_val(res);
 }
 
-inline uint32_t hashtable_disk::locate_new_slot(uint32_t current_bucket)
-{
-    struct entry_t *entries = (struct entry_t *)buckets.data();
-    uint32_t bucket = (entries + current_bucket)->hashcode & header()->mask; // ideal slot
-    for (;;)
-    {
-        if (bucket == current_bucket) // same slot
-            break;
-        struct entry_t *e = entries + bucket;
-        if (e->rec_ofs == 0) // new slot
-            break;
-        bucket = next_bucket(bucket);
-    }
-    return bucket;
-}
-
-inline void hashtable_disk::fix_chain_down(uint32_t bucket)
+/*
+ * looks up n keys, rec_ofs[i] is 0 when keys[i] is not found. the keys go
+ * LOOKUP_BATCH at a time: hash all of them and prefetch their buckets,
+ * then prefetch the records the buckets point to, then compare. the cache
+ * (and TLB) misses of the batch overlap instead of following each other.
+ */
+inline void hashtable_disk::lookup_batch(const void *const *keys, const size_t *key_lens, uint32_t n, uint32_t *rec_ofs) const
 {
     struct entry_t *entries = (struct entry_t *)buckets.data();
-    for (;;)
+    uint32_t hc[LOOKUP_BATCH];
+    for (uint32_t i = 0; i < n; i += LOOKUP_BATCH)
     {
-        struct entry_t *e = entries + bucket;
-        if (e->rec_ofs == 0)
-            break;
-        
-        uint32_t new_bucket = locate_new_slot(bucket);
-        if (new_bucket != bucket)
+        uint32_t num = n - i < (uint32_t)LOOKUP_BATCH ? n - i : (uint32_t)LOOKUP_BATCH;
+        for (uint32_t j = 0; j < num; ++j)
+        {
+            hc[j] = hashcode(keys[i + j], key_lens[i + j]);
+            __builtin_prefetch(entries + (hc[j] & mask));
+        }
+        for (uint32_t j = 0; j < num; ++j)
         {
-            // move bucket to new place
-            *(entries + new_bucket) = *e;
-            e->rec_ofs = 0;
+            struct entry_t *e = entries + (hc[j] & mask);
+            if (MOVED < e->rec_ofs && hc[j] == e->hashcode)
+                __builtin_prefetch(data.data(e->rec_ofs));
         }
-        bucket = next_bucket(bucket);
+        for (uint32_t j = 0; j < num; ++j)
+            rec_ofs[i + j] = lookup(hc[j], keys[i + j], key_lens[i + j]);
     }
 }
 
+/*
+ * backward shift: the entries after the removed one move back a bucket,
+ * up to an empty bucket or one which is home. in the old buckets (while
+ * growing) the entry is only marked, they are read only until freed.
+ */
 inline int hashtable_disk::remove(const void *key, size_t key_len)
 {
+    check_checkpoint();
+    if (is_resizing())
+        resize_step(RESIZE_STEP);
     uint32_t hc = hashcode(key, key_len);
-    uint32_t bucket = hc & header()->mask;
     struct entry_t *entries = (struct entry_t *)buckets.data();
+    struct entry_t *e = lookup_entry(entries, mask, hc, key, key_len);
+    if (NULL == e)
+    {
+        if (!is_resizing() || NULL == (e = lookup_entry((struct entry_t *)old_buckets.data(), old_mask, hc, key, key_len, resize_pos)))
+            return -1; // not found
+        log_update(LOG_REMOVE, key, key_len, NULL, 0);
+        e->rec_ofs = MOVED; // the hashcode stays, lookups of the old buckets still need the distance
+        --header()->size;
+        return 0;
+    }
+    log_update(LOG_REMOVE, key, key_len, NULL, 0);
+    uint32_t bucket = e - entries;
     for (;;)
     {
-        struct entry_t *e = entries + bucket;
-        if (e->rec_ofs == 0)
-            return -1;
-        if (hc == e->hashcode)
-        {
-            uint32_t ofs = e->rec_ofs;
-            char *rec = data.data(ofs);
-            char *k = rec + (sizeof(uint32_t) * 2);
-            if (*(uint32_t *)rec == key_len && 0 == memcmp(key, k, key_len))
-            {
-                e->rec_ofs = 0;
-                bucket = next_bucket(bucket);
-                fix_chain_down(bucket);
-                --header()->size;
-                return 0;
-            }
-        }
-        bucket = next_bucket(bucket);
-    } 
-    return -1; // not found
+        uint32_t next = (bucket + 1) & mask;
+        struct entry_t *ne = entries + next;
+        if (0 == ne->rec_ofs || 0 == probe_distance(ne, next, mask))
+            break;
+        entries[bucket] = *ne;
+        bucket = next;
+    }
+    entries[bucket].rec_ofs = 0;
+    --header()->size;
+    return 0;
 }
 
 inline void *hashtable_disk::get_key(uint32_t rec_ofs) const
@@ -21,32 +21,82 @@
 #define _HASHTABLE_FILE__H_
 
 #include <stdint.h>
+#include <stdlib.h>
 #include "vmbuf.h"
 #include "tempfd.h"
+#include "hash_policy.h"
+#include "logger.h"
 
+/*
+ * finalize(true) replaces the probing buckets with a minimal perfect hash
+ * (hash and displace, as in CHD): the keys are split into buckets of
+ * PERFECT_LAMBDA on average, each bucket has a displacement which sends
+ * its keys to free slots, there are exactly as many slots as keys. a
+ * bucket of one key points to its slot directly. each slot is an entry_t
+ * with the high half of the key's hash as a fingerprint. a lookup reads a
+ * displacement, one slot and, when the fingerprint matches, the record.
+ */
 struct hashtable_file
 {
     enum
     {
-        INITIAL_CAPACITY = 256
+        INITIAL_CAPACITY = 256,
+        HASH_ID_MASK = 0x7F, // capacity is never below 256, the low byte of it holds the hash id
+        PERFECT = 0x80, // and this flag
+        LOOKUP_BATCH = 16, // keys in flight in lookup_batch
+        PERFECT_LAMBDA = 3, // average keys per displacement
+        PERFECT_MAX_BUCKET = 64,
+        PERFECT_MAX_PILOT = 1 << 20
     };
 
+    static const uint32_t PERFECT_DIRECT = 0x80000000; // displacement which is the slot itself
+
     struct entry_t
     {
         uint32_t hashcode;
         uint32_t rec_ofs;
     };
 
-    inline int init_create();
-    inline int create(const char *filename);
-    inline int create(int fd);
-    inline int create_mem();
+    struct perfect_key_t
+    {
+        uint64_t h;
+        uint32_t rec_ofs;
+        uint32_t bucket;
+    };
+
+    struct perfect_bucket_t
+    {
+        uint32_t size;
+        uint32_t b;
+        static int compar(const void *a, const void *b)
+        {
+            const perfect_bucket_t *aa = (const perfect_bucket_t *)a;
+            const perfect_bucket_t *bb = (const perfect_bucket_t *)b;
+            if (aa->size != bb->size)
+                return aa->size > bb->size ? -1 : 1;
+            return aa->b < bb->b ? -1 : (aa->b > bb->b ? 1 : 0);
+        }
+    };
+
+    inline int init_create(uint32_t hash_id);
+    inline int create(const char *filename, uint32_t hash_id = hash_policy::DEFAULT);
+    inline int create(int fd, uint32_t hash_id = hash_policy::DEFAULT);
+    inline int create_mem(uint32_t hash_id = hash_policy::DEFAULT);
     inline int load(const char *filename);
     
-    inline int finalize();
+    inline int finalize(bool perfect = false);
+    inline int build_perfect(vmbuf &out);
     inline int close();
     
-    static inline uint32_t hashcode(const void *key, size_t n);
+    inline uint32_t hashcode(const void *key, size_t n) const;
+
+    static inline uint64_t mix(uint64_t h);
+    inline uint64_t perfect_hashcode(const void *key, size_t n) const { return mix(hash_policy::hash(hash_id, key, n)); }
+    inline uint32_t perfect_bucket(uint64_t h) const { return ((h & 0xFFFFFFFF) * num_disp) >> 32; }
+    static inline uint32_t perfect_slot(uint64_t h, uint32_t disp, uint32_t n);
+    bool is_perfect() const { return num_disp > 0; }
+    const uint32_t *perfect_disp() const { return (const uint32_t *)data.data(ofs_buckets) + 2; }
+    struct entry_t *perfect_entries() const { return (struct entry_t *)(perfect_disp() + num_disp); }
     
     inline void resize_grow();
     inline void check_resize();
@@ -59,6 +109,11 @@ struct hashtable_file
     inline const char *lookup_create(const char *key) const;
     inline uint32_t lookup(const void *key, size_t key_len) const;
     inline const char *lookup(const char *key) const;
+    inline uint32_t lookup(uint32_t hc, const void *key, size_t key_len) const;
+    inline uint32_t lookup_perfect(uint64_t h, const void *key, size_t key_len) const;
+    inline bool is_key(uint32_t rec_ofs, const void *key, size_t key_len) const;
+    inline void lookup_batch(const void *const *keys, const size_t *key_lens, uint32_t n, uint32_t *rec_ofs) const;
+    inline void lookup_batch_perfect(const void *const *keys, const size_t *key_lens, uint32_t n, uint32_t *rec_ofs) const;
     
     inline void *get_key(uint32_t rec_ofs) const;
     inline uint32_t get_key_size(uint32_t rec_ofs) const;
@@ -69,6 +124,8 @@ struct hashtable_file
     uint32_t capacity;
     uint32_t mask;
     uint32_t size;
+    uint32_t hash_id;
+    uint32_t num_disp; // 0 unless perfect
 
     vmbuf buckets;
     vmfile data;
@@ -77,11 +134,13 @@ struct hashtable_file
 /*
  * inline
  */
-inline int hashtable_file::init_create()
+inline int hashtable_file::init_create(uint32_t hash_id)
 {
     capacity = INITIAL_CAPACITY;
     mask = capacity - 1;
     size = 0;
+    this->hash_id = hash_id;
+    num_disp = 0;
     
     data.wseek(sizeof(uint32_t) * 3); // offset,num_elements,size of buckets table
     size_t n = capacity * sizeof(struct entry_t);
@@ -91,28 +150,28 @@ inline int hashtable_file::init_create()
     return 0;
 }
 
-inline int hashtable_file::create(const char *filename)
+inline int hashtable_file::create(const char *filename, uint32_t hash_id /* = hash_policy::DEFAULT */)
 {
     if (0 > data.create(filename))
         return -1;
         
-    return init_create();
+    return init_create(hash_id);
 }
 
-inline int hashtable_file::create(int fd)
+inline int hashtable_file::create(int fd, uint32_t hash_id /* = hash_policy::DEFAULT */)
 {
     if (0 > data.create(fd))
         return -1;
         
-    return init_create();
+    return init_create(hash_id);
 }
 
-inline int hashtable_file::create_mem()
+inline int hashtable_file::create_mem(uint32_t hash_id /* = hash_policy::DEFAULT */)
 {
     if (0 > data.create_tmp())
         return -1;
     
-    return init_create();
+    return init_create(hash_id);
 }
 
 inline int hashtable_file::load(const char *filename)
@@ -122,41 +181,179 @@ inline int hashtable_file::load(const char *filename)
     uint32_t *header = (uint32_t *)data.data();
     ofs_buckets = *header++;
     size = *header++;
-    capacity = *header;
+    capacity = *header & ~(HASH_ID_MASK | PERFECT);
     mask = capacity - 1;
+    hash_id = *header & HASH_ID_MASK; // files written before the id was recorded have 0 (djb2)
+    num_disp = 0;
+    if (!hash_policy::is_valid(hash_id))
+    {
+        LOGGER_ERROR("%s: unknown hash function [%u]", filename, hash_id);
+        data.free();
+        return -1;
+    }
+    if (*header & PERFECT)
+        num_disp = *(uint32_t *)data.data(ofs_buckets);
     return 0;
 }
 
-inline int hashtable_file::finalize()
+/*
+ * perfect: build the minimal perfect hash instead of writing the buckets
+ * (falls back to the buckets if the keys can't be placed)
+ */
+inline int hashtable_file::finalize(bool perfect /* = false */)
 {
-    uint32_t ofs = data.wlocpos();
+    vmbuf mph;
+    if (perfect && 0 > build_perfect(mph))
+    {
+        num_disp = 0;
+        LOGGER_ERROR("failed to build perfect hash for %u keys, keeping the buckets", size);
+        perfect = false;
+    }
+    int res;
+    uint32_t ofs;
+    uint32_t flags = 0;
+    if (perfect)
+    {
+        data.alloc(0); // align the displacements and slots
+        ofs = data.wlocpos();
+        res = data.memcpy(mph.data(), mph.wlocpos());
+        flags = PERFECT;
+        capacity = INITIAL_CAPACITY; // not used, keeps the low byte free
+    } else
+    {
+        ofs = data.wlocpos();
+        res = data.memcpy(buckets.data(), buckets.capacity());
+    }
+    ofs_buckets = ofs;
     uint32_t *header = (uint32_t *)data.data();
     *header++ = ofs;
     *header++ = size;
-    *header = capacity;
-    int res = data.memcpy(buckets.data(), buckets.capacity());
+    *header = capacity | flags | hash_id;
     buckets.free();
     if (0 == res)
         res = data.finalize(); // truncate to final size
     return res;
 }
 
+/*
+ * out gets: number of displacements, reserved, the displacements, the
+ * slots. buckets with more keys go first, while most slots are free
+ */
+inline int hashtable_file::build_perfect(vmbuf &out)
+{
+    uint32_t n = size;
+    num_disp = n / PERFECT_LAMBDA + 1;
+    vmbuf keys, sorted, bkts, starts, taken;
+    keys.init(n * sizeof(perfect_key_t) + 1);
+    sorted.init(n * sizeof(perfect_key_t) + 1);
+    bkts.init(num_disp * sizeof(perfect_bucket_t));
+    starts.init((num_disp + 1) * sizeof(uint32_t));
+    taken.init(n + 1);
+    perfect_bucket_t *bs = (perfect_bucket_t *)bkts.data(bkts.alloczero(num_disp * sizeof(perfect_bucket_t)));
+    for (entry_t *e = (struct entry_t *)buckets.data(), *end = e + capacity; e != end; ++e)
+    {
+        if (0 == e->rec_ofs)
+            continue;
+        perfect_key_t *k = keys.alloc<perfect_key_t>();
+        k->h = perfect_hashcode(get_key(e->rec_ofs), get_key_size(e->rec_ofs));
+        k->rec_ofs = e->rec_ofs;
+        k->bucket = perfect_bucket(k->h);
+        ++bs[k->bucket].size;
+    }
+    // keys by bucket
+    uint32_t *start = (uint32_t *)starts.data(starts.alloczero((num_disp + 1) * sizeof(uint32_t)));
+    for (uint32_t b = 0; b < num_disp; ++b)
+    {
+        bs[b].b = b;
+        start[b + 1] = start[b] + bs[b].size;
+    }
+    perfect_key_t *ks = (perfect_key_t *)sorted.data(sorted.alloc(n * sizeof(perfect_key_t)));
+    for (perfect_key_t *k = (perfect_key_t *)keys.data(), *end = k + n; k != end; ++k)
+        ks[start[k->bucket]++] = *k;
+    keys.free();
+    qsort(bs, num_disp, sizeof(perfect_bucket_t), perfect_bucket_t::compar);
+
+    out.init();
+    *out.alloc<uint32_t>() = num_disp;
+    *out.alloc<uint32_t>() = 0;
+    out.alloczero(num_disp * sizeof(uint32_t) + n * sizeof(entry_t));
+    uint32_t *disp = (uint32_t *)out.data() + 2;
+    entry_t *slots = (entry_t *)(disp + num_disp);
+    uint8_t *is_taken = (uint8_t *)taken.data(taken.alloczero(n + 1));
+    uint32_t free_slot = 0;
+    for (perfect_bucket_t *bt = bs, *bend = bs + num_disp; bt != bend && 0 < bt->size; ++bt)
+    {
+        perfect_key_t *k = ks + start[bt->b] - bt->size; // start was advanced past the bucket
+        if (1 == bt->size)
+        {
+            while (is_taken[free_slot])
+                ++free_slot;
+            disp[bt->b] = PERFECT_DIRECT | free_slot;
+            is_taken[free_slot] = 1;
+            slots[free_slot].hashcode = k->h >> 32;
+            slots[free_slot].rec_ofs = k->rec_ofs;
+            continue;
+        }
+        if (bt->size > PERFECT_MAX_BUCKET)
+            return -1;
+        uint32_t pos[PERFECT_MAX_BUCKET];
+        uint32_t pilot = 0;
+        for (; pilot < PERFECT_MAX_PILOT; ++pilot)
+        {
+            uint32_t i = 0;
+            for (; i < bt->size; ++i)
+            {
+                pos[i] = perfect_slot(k[i].h, pilot, n);
+                if (is_taken[pos[i]])
+                    break;
+                is_taken[pos[i]] = 1; // also catches two keys of the bucket on the same slot
+            }
+            if (i == bt->size)
+                break;
+            while (i > 0)
+                is_taken[pos[--i]] = 0;
+        }
+        if (pilot == PERFECT_MAX_PILOT)
+            return -1;
+        disp[bt->b] = pilot;
+        for (uint32_t i = 0; i < bt->size; ++i)
+        {
+            slots[pos[i]].hashcode = k[i].h >> 32;
+            slots[pos[i]].rec_ofs = k[i].rec_ofs;
+        }
+    }
+    return 0;
+}
+
 inline int hashtable_file::close()
 {
     return ((buckets.free() + data.free()) == 0 ? 0 : -1);
 }
 
+inline uint32_t hashtable_file::hashcode(const void *key, size_t n) const
+{
+    return hash_policy::hash(hash_id, key, n);
+}
+
 /* static */
-inline uint32_t hashtable_file::hashcode(const void *key, size_t n)
+inline uint64_t hashtable_file::mix(uint64_t h)
 {
-    register const unsigned char *p = (const unsigned char *)key;
-    register const unsigned char *end = p + n;
-    uint32_t h = 5381;
-    for (; p != end; ++p)
-        h = ((h << 5) + h) ^ *p;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
     return h;
 }
 
+/* static */
+inline uint32_t hashtable_file::perfect_slot(uint64_t h, uint32_t disp, uint32_t n)
+{
+    if (disp & PERFECT_DIRECT)
+        return disp & ~PERFECT_DIRECT;
+    return ((mix(h ^ (disp * 0x9e3779b97f4a7c15ULL)) >> 32) * n) >> 32;
+}
+
 inline void hashtable_file::resize_grow()
 {
     vmbuf buf;
@@ -303,7 +500,29 @@ inline const char *hashtable_file::lookup_create(const char *key) const
 
 inline uint32_t hashtable_file::lookup(const void *key, size_t key_len) const
 {
-    uint32_t hc = hashcode(key, key_len);
+    if (is_perfect())
+        return lookup_perfect(perfect_hashcode(key, key_len), key, key_len);
+    return lookup(hashcode(key, key_len), key, key_len);
+}
+
+inline uint32_t hashtable_file::lookup_perfect(uint64_t h, const void *key, size_t key_len) const
+{
+    if (0 == size)
+        return 0;
+    struct entry_t *e = perfect_entries() + perfect_slot(h, perfect_disp()[perfect_bucket(h)], size);
+    if ((uint32_t)(h >> 32) == e->hashcode && is_key(e->rec_ofs, key, key_len))
+        return e->rec_ofs;
+    return 0;
+}
+
+inline bool hashtable_file::is_key(uint32_t rec_ofs, const void *key, size_t key_len) const
+{
+    char *rec = data.data(rec_ofs);
+    return *(uint32_t *)rec == key_len && 0 == memcmp(key, rec + (sizeof(uint32_t) * 2), key_len);
+}
+
+inline uint32_t hashtable_file::lookup(uint32_t hc, const void *key, size_t key_len) const
+{
     uint32_t bucket = hc & mask;
     struct entry_t *entries = (struct entry_t *)data.data(ofs_buckets);
     for (;;)
@@ -335,6 +554,37 @@ inline const char *hashtable_file::lookup(const char *key) const
         return (const char *)get_val(res);
 }
 
+/*
+ * looks up n keys, rec_ofs[i] is 0 when keys[i] is not found. the keys go
+ * LOOKUP_BATCH at a time: hash all of them and prefetch their buckets,
+ * then prefetch the records the buckets point to, then compare. the cache
+ * (and TLB) misses of the batch overlap instead of following each other.
+ */
+inline void hashtable_file::lookup_batch(const void *const *keys, const size_t *key_lens, uint32_t n, uint32_t *rec_ofs) const
+{
+    if (is_perfect())
+        return lookup_batch_perfect(keys, key_lens, n, rec_ofs);
+    struct entry_t *entries = (struct entry_t *)data.data(ofs_buckets);
+    uint32_t hc[LOOKUP_BATCH];
+    for (uint32_t i = 0; i < n; i += LOOKUP_BATCH)
+    {
+        uint32_t num = n - i < (uint32_t)LOOKUP_BATCH ? n - i : (uint32_t)LOOKUP_BATCH;
+        for (uint32_t j = 0; j < num; ++j)
+        {
+            hc[j] = hashcode(keys[i + j], key_lens[i + j]);
+            __builtin_prefetch(entries + (hc[j] & mask));
+        }
+        for (uint32_t j = 0; j < num; ++j)
+        {
+            struct entry_t *e = entries + (hc[j] & mask);
+            if (0 != e->rec_ofs && hc[j] == e->hashcode)
+                __builtin_prefetch(data.data(e->rec_ofs));
+        }
+        for (uint32_t j = 0; j < num; ++j)
+            rec_ofs[i + j] = lookup(hc[j], keys[i + j], key_lens[i + j]);
+    }
+}
+
 inline void *hashtable_file::get_key(uint32_t rec_ofs) const
 {
     char *rec = data.data(rec_ofs);
@@ -359,4 +609,42 @@ inline uint32_t hashtable_file::get_val_size(uint32_t rec_ofs) const
     return *((uint32_t *)rec + 1);
 }
 
+/*
+ * same as lookup_batch, one more step: the displacements, then the slots,
+ * then the records
+ */
+inline void hashtable_file::lookup_batch_perfect(const void *const *keys, const size_t *key_lens, uint32_t n, uint32_t *rec_ofs) const
+{
+    if (0 == size)
+    {
+        memset(rec_ofs, 0, n * sizeof(uint32_t));
+        return;
+    }
+    const uint32_t *disp = perfect_disp();
+    struct entry_t *entries = perfect_entries();
+    uint64_t h[LOOKUP_BATCH];
+    struct entry_t *e[LOOKUP_BATCH];
+    for (uint32_t i = 0; i < n; i += LOOKUP_BATCH)
+    {
+        uint32_t num = n - i < (uint32_t)LOOKUP_BATCH ? n - i : (uint32_t)LOOKUP_BATCH;
+        for (uint32_t j = 0; j < num; ++j)
+        {
+            h[j] = perfect_hashcode(keys[i + j], key_lens[i + j]);
+            __builtin_prefetch(disp + perfect_bucket(h[j]));
+        }
+        for (uint32_t j = 0; j < num; ++j)
+        {
+            e[j] = entries + perfect_slot(h[j], disp[perfect_bucket(h[j])], size);
+            __builtin_prefetch(e[j]);
+        }
+        for (uint32_t j = 0; j < num; ++j)
+        {
+            if ((uint32_t)(h[j] >> 32) == e[j]->hashcode)
+                __builtin_prefetch(data.data(e[j]->rec_ofs));
+        }
+        for (uint32_t j = 0; j < num; ++j)
+            rec_ofs[i + j] = (uint32_t)(h[j] >> 32) == e[j]->hashcode && is_key(e[j]->rec_ofs, keys[i + j], key_lens[i + j]) ? e[j]->rec_ofs : 0;
+    }
+}
+
 #endif // _HASHTABLE_FILE__H_
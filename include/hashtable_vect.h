@@ -22,8 +22,12 @@
 
 #include <stdint.h>
 #include "vmbuf.h"
+#include "hash_policy.h"
 
-template<typename T>
+/*
+ * H is the hash policy (see hash_policy.h)
+ */
+template<typename T, typename H=hash_word>
 struct hashtable_vect
 {
     struct Entry
@@ -60,8 +64,8 @@ struct hashtable_vect
     uint32_t size;
 };
 
-template<typename T>
-void hashtable_vect<T>::init(uint32_t n /* = DEFAULT_NUM_BUCKETS */)
+template<typename T, typename H>
+void hashtable_vect<T, H>::init(uint32_t n /* = DEFAULT_NUM_BUCKETS */)
 {
     for (uint32_t m = (((uint32_t)-1) >> 1) + 1; m >= n; mask = m, m >>= 1);
     buf.init();
@@ -73,19 +77,14 @@ void hashtable_vect<T>::init(uint32_t n /* = DEFAULT_NUM_BUCKETS */)
     size = 0;
 }
 
-template<typename T>
-uint32_t hashtable_vect<T>::bucket(const void *key, uint32_t n) const
+template<typename T, typename H>
+uint32_t hashtable_vect<T, H>::bucket(const void *key, uint32_t n) const
 {
-    register const unsigned char *p = (const unsigned char *)key;
-    register const unsigned char *end = p + n;
-    uint32_t h = 5381;
-    for (; p != end; ++p)
-        h = ((h << 5) + h) ^ *p;
-    return h & mask;
+    return H::hash(key, n) & mask;
 }
 
-template<typename T>
-T *hashtable_vect<T>::insert(const void *key, uint32_t key_len, const T &val)
+template<typename T, typename H>
+T *hashtable_vect<T, H>::insert(const void *key, uint32_t key_len, const T &val)
 {
     uint32_t b = bucket(key, key_len);
     uint32_t ofs_key = buf.alloc(key_len);
@@ -107,14 +106,14 @@ T *hashtable_vect<T>::insert(const void *key, uint32_t key_len, const T &val)
     return t;
 }
 
-template<typename T>
-T *hashtable_vect<T>::insert(const char *key, const T &val)
+template<typename T, typename H>
+T *hashtable_vect<T, H>::insert(const char *key, const T &val)
 {
     return insert(key, strlen(key), val);
 }
 
-template<typename T>
-T *hashtable_vect<T>::lookup(const void *key, uint32_t key_len) const
+template<typename T, typename H>
+T *hashtable_vect<T, H>::lookup(const void *key, uint32_t key_len) const
 {
     uint32_t b = bucket(key, key_len);
     uint32_t ofs_entry = *(((uint32_t *)buf.data()) + b);
@@ -128,8 +127,8 @@ T *hashtable_vect<T>::lookup(const void *key, uint32_t key_len) const
     return NULL;
 }
 
-template<typename T>
-T *hashtable_vect<T>::lookup(const char *key) const
+template<typename T, typename H>
+T *hashtable_vect<T, H>::lookup(const char *key) const
 {
     return lookup(key, strlen(key));
 }
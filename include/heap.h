@@ -23,7 +23,7 @@
 #include "vmbuf.h"
 #include <stdint.h>
 
-template<typename K, typename V>
+template<typename K, typename V, typename B = vmbuf>
 class heap
 {
 public:
@@ -44,34 +44,34 @@ public:
     K top_key() { return get_entries()->key; }
     bool empty() { return num_entries == 0; }
 
-    vmbuf buf_entries;
+    B buf_entries; // vmbuf_huge for very large heaps
     uint32_t num_entries;
 };
 
 
-template<typename K, typename V>
-inline void heap<K, V>::init(uint32_t num_items)
+template<typename K, typename V, typename B>
+inline void heap<K, V, B>::init(uint32_t num_items)
 {
     buf_entries.init(sizeof(entry_t) * num_items);
     num_entries = 0;
 }
 
-template<typename K, typename V>
-inline void heap<K, V>::build()
+template<typename K, typename V, typename B>
+inline void heap<K, V, B>::build()
 {
     uint32_t last = num_entries >> 1;
     for (int i = last; i >= 0; --i)
         fix_down(i);
 }
 
-template<typename K, typename V>
-inline typename heap<K, V>::entry_t *heap<K, V>::get_entries()
+template<typename K, typename V, typename B>
+inline typename heap<K, V, B>::entry_t *heap<K, V, B>::get_entries()
 {
     return (entry_t *)buf_entries.data();
 }
 
-template<typename K, typename V>
-inline void heap<K, V>::fix_down(uint32_t parent)
+template<typename K, typename V, typename B>
+inline void heap<K, V, B>::fix_down(uint32_t parent)
 {
     entry_t *entries = get_entries();
     uint32_t child;
@@ -102,8 +102,8 @@ inline void heap<K, V>::fix_down(uint32_t parent)
     }
 }
 
-template<typename K, typename V>
-inline V heap<K, V>::pop()
+template<typename K, typename V, typename B>
+inline V heap<K, V, B>::pop()
 {
     entry_t *entries = get_entries();
     entry_t e = entries[0];
@@ -113,8 +113,8 @@ inline V heap<K, V>::pop()
     return e.val;
 }
 
-template<typename K, typename V>
-inline void heap<K, V>::push(const K & k, const V &v)
+template<typename K, typename V, typename B>
+inline void heap<K, V, B>::push(const K & k, const V &v)
 {
     entry_t *entries = get_entries();
     uint32_t parent, insert_pos;
@@ -135,8 +135,8 @@ inline void heap<K, V>::push(const K & k, const V &v)
     ++num_entries;
 }
 
-template<typename K, typename V>
-inline void heap<K, V>::add(const K & k, const V &v)
+template<typename K, typename V, typename B>
+inline void heap<K, V, B>::add(const K & k, const V &v)
 {
     entry_t *entries = get_entries();
     entries[num_entries++] = (entry_t){ k, v };
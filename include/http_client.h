@@ -25,8 +25,70 @@
 #include "vmbuf.h"
 #include "epoll.h"
 #include "compact_hashtable.h"
+#include "latency_histogram.h"
+#include "fd_table.h"
 #include <netinet/in.h>
 
+struct http_client;
+
+/*
+ * second connection attempt to an alternate address, started when the
+ * primary connect didn't finish within http_client::hedge_delay (or failed).
+ * first successful connection wins, the other one is closed.
+ */
+struct http_client_hedge : basic_epoll_event
+{
+    enum
+    {
+        IDLE,
+        PENDING,
+        CONNECTING,
+        FAILED
+    };
+
+    http_client_hedge() : client(NULL), state(IDLE) { timerclear(&last_event_ts); }
+
+    void schedule(struct http_client *c, struct in_addr *alt_addr);
+    int start();
+    void cancel();
+
+    struct basic_epoll_event *on_timer();
+    struct basic_epoll_event *on_connect();
+
+    struct http_client *client;
+    struct in_addr addr;
+    struct timeval timer_connect;
+    int state;
+};
+
+/*
+ * speculative duplicate of an in-flight request, sent to a replica when no
+ * response arrived within the upstream's p95 response time. the first
+ * response wins, the loser's connection is closed.
+ */
+struct http_client_request_hedge : basic_epoll_event
+{
+    enum
+    {
+        IDLE,
+        PENDING,
+        RUNNING,
+        PRIMARY_FAILED
+    };
+
+    http_client_request_hedge() : client(NULL), peer(NULL), state(IDLE) { timerclear(&last_event_ts); }
+
+    void cancel();
+
+    struct basic_epoll_event *on_timer();
+    struct basic_epoll_event *on_response(struct http_client *c);
+
+    struct http_client *client;
+    struct http_client *peer;
+    struct in_addr addr;
+    uint16_t port;
+    int state;
+};
 
 struct http_client : basic_epoll_event
 {
@@ -41,11 +103,37 @@ struct http_client : basic_epoll_event
         }
     } client_key_t;
     
+    enum
+    {
+        DEFAULT_HEDGE_DELAY = 250, // milli-seconds
+        MIN_HEDGE_SAMPLES = 100 // responses needed before the p95 is trusted
+    };
+
+    enum
+    {
+        CONNECTING,
+        CONNECTED,
+        CONNECT_FAILED
+    };
+
+    struct upstream_stats
+    {
+        latency_histogram connect;
+        latency_histogram response;
+        epoll_timer_chain *request_hedge_chain; // delay follows the response p95
+    };
+
     typedef compact_hashtable<client_key_t, struct http_client *> persistent_clients_ht_t;
-    static struct http_client *s_clients;
+    typedef compact_hashtable<client_key_t, upstream_stats> upstream_stats_ht_t;
+    static fd_table<struct http_client> s_clients;
     static __thread persistent_clients_ht_t *ht_clients;
+    static __thread upstream_stats_ht_t *ht_upstream_stats;
+    static __thread epoll_timer_chain *hedge_chain;
+    static time_t hedge_delay;
     
     static void init();
+    static void set_hedge_delay(time_t msec) { hedge_delay = msec; }
+    static epoll_timer_chain *get_hedge_chain();
 
     static inline void init_ht_clients()
     {
@@ -56,17 +144,30 @@ struct http_client : basic_epoll_event
         }
     }
     
-    static struct http_client *create(struct in_addr *addr, uint16_t port);
-    static struct http_client *new_connection(struct in_addr *addr, uint16_t port);
+    static struct http_client *create(struct in_addr *addr, uint16_t port, struct in_addr *alt_addr = NULL);
+    static struct http_client *new_connection(struct in_addr *addr, uint16_t port, struct in_addr *alt_addr = NULL);
     static int resolve_host_name(const char*host, struct in_addr &addr);
+    static int resolve_host_names(const char*host, struct in_addr *addrs, int max_addrs);
+
+    static upstream_stats *get_upstream_stats(struct in_addr *addr, uint16_t port);
+    static void dump_upstream_stats(vmbuf *buf);
+    static void record_response(upstream_stats *stats, const struct timeval *start);
+    static epoll_timer_chain *get_request_hedge_chain(upstream_stats *stats);
 
     int prepare();
     int connect(struct in_addr *addr, uint16_t port);
     int init_connection(struct in_addr *addr, uint16_t port);
+    int hedge_request(struct in_addr *addr, uint16_t port);
     
+    struct basic_epoll_event *on_connect();
+    struct basic_epoll_event *hedge_connected();
+    struct basic_epoll_event *connect_error();
     struct basic_epoll_event *write_request();
     struct basic_epoll_event *read_response();
     struct basic_epoll_event *handle_disconnect();
+    struct basic_epoll_event *response_done();
+    struct basic_epoll_event *request_hedge_won(struct http_client *winner);
+    struct basic_epoll_event *request_hedge_wait() { return NULL; }
     int read_content();
     int chunk_size();
     int handle_chunks();
@@ -87,6 +188,9 @@ struct http_client : basic_epoll_event
     
     basic_epoll_event_callback_method_1arg<struct http_client *> callback;
     struct timeval timer_connect;
+    int connect_state;
+    struct http_client_hedge hedge;
+    struct http_client_request_hedge request_hedge;
     
     struct chunk
     {
@@ -113,7 +217,8 @@ inline int http_client::connect(struct in_addr *addr, uint16_t port)
 
 inline void http_client::yield()
 {
-    epoll::yield(epoll::client_timeout_chain, this);
+    // until connected the connect timeout applies, after that the response timeout
+    epoll::yield(CONNECTED == connect_state ? epoll::client_timeout_chain : epoll::connect_timeout_chain, this);
 }
 
 #endif // _HTTP_CLIENT__H_
@@ -27,6 +27,7 @@
 #include "epoll.h"
 #include "sstr.h"
 #include "compact_hashtable.h"
+#include "fd_table.h"
 #include <netinet/in.h>
 
 struct http_client_file : basic_epoll_event
@@ -42,12 +43,23 @@ struct http_client_file : basic_epoll_event
             return (addr.s_addr == other.addr.s_addr) && (port == other.port);
         }
     } client_key_t;
+
+    enum
+    {
+        DEFAULT_STREAMING_THRESHOLD = 64 * 1024, // smaller downloads go through the mapped file
+        SPLICE_PIPE_SIZE = 1024 * 1024
+    };
     
     typedef compact_hashtable<client_key_t, struct http_client_file *> persistent_clients_ht_t;
-    static struct http_client_file *s_clients;
+    static fd_table<struct http_client_file> s_clients;
     static __thread persistent_clients_ht_t *ht_clients;
+    static __thread int splice_pipe[2];
+    static size_t streaming_threshold;
     
     static void init();
+    static void set_streaming_threshold(size_t size) { streaming_threshold = size; }
+    static int init_splice_pipe();
+    static void close_splice_pipe();
 
     static inline void init_ht_clients()
     {
@@ -69,6 +81,8 @@ struct http_client_file : basic_epoll_event
     struct basic_epoll_event *write_request();
     struct basic_epoll_event *read_header();
     struct basic_epoll_event *read_content();
+    struct basic_epoll_event *splice_content();
+    int start_streaming();
     struct basic_epoll_event *handle_disconnect();
     struct basic_epoll_event *report_error();
 
@@ -81,6 +95,7 @@ struct http_client_file : basic_epoll_event
     vmfile infile;
     uint32_t eoh; // end of header
     uint32_t content_length;
+    loff_t file_offset; // streaming mode only
     int persistent;
     client_key_t key;
     
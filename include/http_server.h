@@ -22,6 +22,7 @@
 
 #include "basic_epoll_event.h"
 #include "vmbuf.h"
+#include "vmarena.h"
 #include "sstr.h"
 #include "URI.h"
 #include "mime_types.h"
@@ -50,6 +51,16 @@ struct http_server : server_epoll_event
     http_server();
 
     void reset();
+    size_t shrink();
+
+    /*
+     * request scratch memory, one arena per thread shared by its
+     * connections. reset() rewinds it, so allocations are good until the
+     * handler returns or yields
+     */
+    static vmarena &arena() { return NULL != thread_arena ? *thread_arena : *new_arena(); }
+    static vmarena *new_arena();
+    static size_t shrink_arena(); // this thread's arena, when idle
     
     struct basic_epoll_event *close();
     
@@ -73,6 +84,9 @@ struct http_server : server_epoll_event
     struct basic_epoll_event *response(const char *status, const char *content_type, const char *format, ...);
 
     struct basic_epoll_event *setRedirect(const char *status, const char *content_type, const char *format, ...);
+
+    // memory usage of vmbufs by tag and mapping counters, for a /stats page
+    struct basic_epoll_event *stats_response();
     
     const char *http_method();
     
@@ -108,6 +122,7 @@ struct http_server : server_epoll_event
     bool persistent;
 
     static uint32_t max_req_size;
+    static __thread vmarena *thread_arena;
 };
 
 inline void http_server::reset()
@@ -115,17 +130,32 @@ inline void http_server::reset()
     inbuf.init();
     header.init();
     payload.init();
+    if (NULL != thread_arena)
+        thread_arena->reset();
     content_length = 0;
     eoh = 0;
     next = NULL;
     persistent = false;
 }
 
+/*
+ * for closed connections (e.g. kept in a pool), drops the buffers' content
+ * and gives back the memory which wasn't needed recently
+ */
+inline size_t http_server::shrink()
+{
+    inbuf.reset();
+    header.reset();
+    payload.reset();
+    return inbuf.shrink() + header.shrink() + payload.shrink();
+}
+
 inline struct basic_epoll_event *http_server::close()
 {
     method.set(&http_server::onInit);
-    //pool->put(this);
     ::close(fd);
+    if (NULL != pool)
+        pool->put(this);
     return NULL;
 }
 
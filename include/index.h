@@ -24,10 +24,13 @@
 #include "mmap_file.h"
 #include "VarFieldReader.h"
 #include "hashtable_file.h"
+#include "bloom_filter.h"
 #include "vmbuf.h"
 #include "logger.h"
 #include "ds_field.h"
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
 
 /*
  * TODO:
@@ -141,7 +144,18 @@ struct var_index_generator
         return aa->id < bb->id ? -1 : (aa->id > bb->id ? 1 : 0);
     }
 
-    static int generate(const char *filename)
+    enum
+    {
+        NUM_FP_PROBES = 100000 // absent keys checked against the filter
+    };
+
+    /*
+     * filter_bits_per_key > 0 also writes a bloom filter of the keys
+     * (.bloom, see bloom_filter.h) which var_index_container checks first.
+     * perfect finalizes .keys with the minimal perfect hash: smaller and
+     * faster for lookup_batch, slower for single lookups and to build
+     */
+    static int generate(const char *filename, uint32_t filter_bits_per_key = 0, bool perfect = false)
     {
         VarFieldReader vfr;
         if (0 > vfr.init(filename))
@@ -149,6 +163,15 @@ struct var_index_generator
 
         size_t l = strlen(filename) + 20;
 
+        // a filter of a previous generate would not match the new keys
+        char filter_filename[l];
+        sprintf(filter_filename, "%s.bloom", filename);
+        if (0 > unlink(filter_filename) && ENOENT != errno)
+        {
+            LOGGER_PERROR("unlink %s", filter_filename);
+            return -1;
+        }
+
         hashtable_file ht_keys;
         char keys_filename[l];
         sprintf(keys_filename, "%s.keys", filename);
@@ -196,19 +219,53 @@ struct var_index_generator
             *val = (index_end - index_start) + ((uint64_t)index_start << 32);
         }
         
-        ht_keys.finalize();
+        bloom_filter filter;
+        if (0 < filter_bits_per_key && 0 > generate_filter(filter_filename, ht_keys, filter_bits_per_key, filter))
+            return -1;
+        ht_keys.finalize(perfect); // read only from now on
+        // written last, stamped with the final .keys
+        if (filter.is_loaded() && (0 > filter.set_source(keys_filename) || 0 > filter.write(filter_filename)))
+            return -1;
         mfw_index.close();
         vfr.close();
         return 0;
     }
+
+    static int generate_filter(const char *filter_filename, hashtable_file &ht_keys, uint32_t bits_per_key, bloom_filter &filter)
+    {
+        if (0 > filter.init(ht_keys.size, bits_per_key))
+            return -1;
+        struct hashtable_file::entry_t *e = (struct hashtable_file::entry_t *)ht_keys.buckets.data();
+        for (struct hashtable_file::entry_t *end = e + ht_keys.capacity; e != end; ++e)
+        {
+            if (0 != e->rec_ofs)
+                filter.add(ht_keys.get_key(e->rec_ofs), ht_keys.get_key_size(e->rec_ofs));
+        }
+        // false positives, over keys which are not in the table
+        uint32_t num_absent = 0, num_fp = 0;
+        char key[32];
+        for (uint32_t i = 0; i < NUM_FP_PROBES; ++i)
+        {
+            int n = sprintf(key, "\001fp-probe-%u", i);
+            if (0 != ht_keys.lookup_create(key, n))
+                continue;
+            ++num_absent;
+            if (filter.may_contain(key, n))
+                ++num_fp;
+        }
+        logger::log("%s: %u keys, %zu bytes (%.1f bits per key), false positives: %.2f%% (%u of %u absent keys)",
+                    filter_filename, filter.num_keys, filter.mem_usage(), filter.mem_usage() * 8.0 / (filter.num_keys ? filter.num_keys : 1),
+                    num_absent ? num_fp * 100.0 / num_absent : 0.0, num_fp, num_absent);
+        return 0;
+    }
     
-    static int generate(const char *dir, const char *name)
+    static int generate(const char *dir, const char *name, uint32_t filter_bits_per_key = 0, bool perfect = false)
     {
         char buf[strlen(dir) + strlen(name) + 2];
         sprintf(buf, "%s/%s", dir, name);
         logger::log("indexing %s", buf);
         var_index_generator index;
-        int res = index.generate(buf);
+        int res = index.generate(buf, filter_bits_per_key, perfect);
         logger::log("indexing %s - DONE", buf);
         return res;
     }
@@ -291,6 +348,19 @@ public:
         sprintf(index_filename, "%s.index", filename);
         if (0 > ht_keys.load(keys_filename) || 0 > mf_index.init(index_filename))
             return -1;
+        char filter_filename[l];
+        sprintf(filter_filename, "%s.bloom", filename);
+        if (0 == access(filter_filename, F_OK))
+        {
+            if (0 > filter.load(filter_filename))
+                return -1;
+            if (filter.num_keys != ht_keys.size || !filter.is_source(keys_filename))
+            {
+                // not generated with this .keys, it would reject keys which are there
+                LOGGER_ERROR("%s: doesn't match %s, ignored", filter_filename, keys_filename);
+                filter.close();
+            }
+        }
         return 0;
     }
 
@@ -298,12 +368,51 @@ public:
 
     int lookup(const void *key, size_t key_len, uint64_t *rec)
     {
+        if (filter.is_loaded() && !filter.may_contain(key, key_len))
+            return -1;
         uint32_t ofs = ht_keys.lookup(key, key_len);
         if (0 == ofs)
             return -1;
         *rec = *(uint64_t *)ht_keys.get_val(ofs);
         return 0;
     }
+
+    /*
+     * recs[i] of keys which are not found is 0 (an empty index), returns
+     * the number found. only the keys which pass the filter go to the table
+     */
+    uint32_t lookup_batch(const void *const *keys, const size_t *key_lens, uint32_t n, uint64_t *recs)
+    {
+        const void *batch_keys[hashtable_file::LOOKUP_BATCH];
+        size_t batch_key_lens[hashtable_file::LOOKUP_BATCH];
+        uint64_t *batch_recs[hashtable_file::LOOKUP_BATCH];
+        uint32_t ofs[hashtable_file::LOOKUP_BATCH];
+        uint32_t found = 0;
+        for (uint32_t i = 0; i < n; i += hashtable_file::LOOKUP_BATCH)
+        {
+            uint32_t num = n - i < (uint32_t)hashtable_file::LOOKUP_BATCH ? n - i : (uint32_t)hashtable_file::LOOKUP_BATCH;
+            uint32_t num_batch = 0;
+            for (uint32_t j = i; j < i + num; ++j)
+            {
+                recs[j] = 0;
+                if (filter.is_loaded() && !filter.may_contain(keys[j], key_lens[j]))
+                    continue;
+                batch_keys[num_batch] = keys[j];
+                batch_key_lens[num_batch] = key_lens[j];
+                batch_recs[num_batch++] = recs + j;
+            }
+            ht_keys.lookup_batch(batch_keys, batch_key_lens, num_batch, ofs);
+            for (uint32_t j = 0; j < num_batch; ++j)
+            {
+                if (0 != ofs[j])
+                {
+                    *batch_recs[j] = *(uint64_t *)ht_keys.get_val(ofs[j]);
+                    ++found;
+                }
+            }
+        }
+        return found;
+    }
     
     uint32_t *get_index(uint64_t rec)
     {
@@ -317,6 +426,7 @@ public:
     
     hashtable_file ht_keys;
     mmap_file mf_index;
+    bloom_filter filter; // when generated with one
 };
 
 
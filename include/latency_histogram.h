@@ -0,0 +1,105 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _LATENCY_HISTOGRAM__H_
+#define _LATENCY_HISTOGRAM__H_
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include "ilog2.h"
+#include "vmbuf.h"
+
+/*
+ * log2 bucketed histogram of latencies in micro-seconds, bucket i
+ * holds the samples in the range [2^i, 2^(i+1)). POD, so it can be
+ * stored by value in the vmbuf based containers.
+ */
+struct latency_histogram
+{
+    enum
+    {
+        NUM_BUCKETS = 32
+    };
+
+    void reset() { memset(this, 0, sizeof(*this)); }
+
+    inline void add(uint32_t usec);
+    inline void add(const struct timeval *start);
+
+    inline uint32_t percentile(uint32_t pct) const;
+    uint32_t average() const { return count ? sum / count : 0; }
+
+    inline void dump(vmbuf *buf) const;
+
+    uint32_t buckets[NUM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+};
+
+/*
+ * inline
+ */
+inline void latency_histogram::add(uint32_t usec)
+{
+    ++buckets[usec ? ilog2(usec) : 0];
+    ++count;
+    sum += usec;
+}
+
+inline void latency_histogram::add(const struct timeval *start)
+{
+    struct timeval now, elapsed;
+    gettimeofday(&now, NULL);
+    timersub(&now, start, &elapsed);
+    if (elapsed.tv_sec < 0) // clock went backwards
+        return;
+    uint64_t usec = elapsed.tv_sec * 1000000ULL + elapsed.tv_usec;
+    add(usec > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)usec);
+}
+
+inline uint32_t latency_histogram::percentile(uint32_t pct) const
+{
+    if (0 == count)
+        return 0;
+    uint64_t target = (count * pct + 99) / 100; // rank of the sample, 1 based
+    if (0 == target)
+        target = 1;
+    uint64_t cum = 0;
+    for (uint32_t i = 0; i < NUM_BUCKETS; ++i)
+    {
+        if (cum + buckets[i] >= target)
+        {
+            // interpolate within the bucket
+            uint64_t lower = i ? (1ULL << i) : 0;
+            uint64_t upper = 1ULL << (i + 1);
+            return lower + (upper - lower) * (target - cum) / buckets[i];
+        }
+        cum += buckets[i];
+    }
+    return 0xFFFFFFFF;
+}
+
+inline void latency_histogram::dump(vmbuf *buf) const
+{
+    buf->sprintf("count=%llu avg=%u p50=%u p95=%u p99=%u",
+                 (unsigned long long)count, average(), percentile(50), percentile(95), percentile(99));
+}
+
+#endif // _LATENCY_HISTOGRAM__H_
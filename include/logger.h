@@ -33,6 +33,7 @@ struct logger
     static void perror_at(const char *filename, unsigned int linenum, const char *format, ...);
     static void vlog(int fd, const char *format, const char *msg_class, va_list ap);
     static void vlog_at(int fd, const char *filename, unsigned int linenum, const char *format, const char *msg_class, va_list ap);
+    static void shrink(); // this thread's log buffer
 };
 
 #define LOGGER_WHERE __FILE__, __LINE__
@@ -0,0 +1,279 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _MEMCACHE_PROTO__H_
+#define _MEMCACHE_PROTO__H_
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <string.h>
+#include "tcp_client.h"
+
+/*
+ * tcp_client protocol for the memcached binary protocol. requests are
+ * numbered through the opaque field, the client is done once the
+ * response to the last request arrived, so the last request of a batch
+ * must not be a quiet one (get_multi ends its batch with a NOOP).
+ * responses are parsed in place and point into inbuf.
+ */
+struct memcache_proto
+{
+    enum
+    {
+        REQUEST_MAGIC = 0x80,
+        RESPONSE_MAGIC = 0x81,
+        MAX_BODY_SIZE = 64 * 1024 * 1024
+    };
+
+    enum
+    {
+        OP_GET = 0x00,
+        OP_SET = 0x01,
+        OP_ADD = 0x02,
+        OP_REPLACE = 0x03,
+        OP_DELETE = 0x04,
+        OP_INCREMENT = 0x05,
+        OP_DECREMENT = 0x06,
+        OP_QUIT = 0x07,
+        OP_FLUSH = 0x08,
+        OP_GETQ = 0x09,
+        OP_NOOP = 0x0a,
+        OP_VERSION = 0x0b,
+        OP_GETK = 0x0c,
+        OP_GETKQ = 0x0d
+    };
+
+    enum
+    {
+        STATUS_NO_ERROR = 0x0000,
+        STATUS_KEY_NOT_FOUND = 0x0001,
+        STATUS_KEY_EXISTS = 0x0002,
+        STATUS_VALUE_TOO_LARGE = 0x0003,
+        STATUS_INVALID_ARGUMENTS = 0x0004,
+        STATUS_ITEM_NOT_STORED = 0x0005
+    };
+
+    struct header
+    {
+        uint8_t magic;
+        uint8_t opcode;
+        uint16_t key_length;
+        uint8_t extras_length;
+        uint8_t data_type;
+        uint16_t status; // vbucket id in requests
+        uint32_t total_body_length;
+        uint32_t opaque;
+        uint64_t cas;
+    } __attribute__((packed));
+
+    static int prepare(tcp_client<memcache_proto> *client);
+    static int read_content(tcp_client<memcache_proto> *client);
+    static void on_error(tcp_client<memcache_proto> *client);
+    static void on_connection_close(tcp_client<memcache_proto> *client);
+
+    static uint32_t add_request(tcp_client<memcache_proto> *client, uint8_t opcode,
+                                const void *key, uint16_t key_len,
+                                const void *extras, uint8_t extras_len,
+                                const void *value, uint32_t value_len,
+                                uint64_t cas = 0);
+    static uint32_t get(tcp_client<memcache_proto> *client, const void *key, uint16_t key_len);
+    static uint32_t get_multi(tcp_client<memcache_proto> *client, const char * const *keys, const uint16_t *key_lens, int num_keys);
+    static uint32_t set(tcp_client<memcache_proto> *client, const void *key, uint16_t key_len,
+                        const void *value, uint32_t value_len, uint32_t flags = 0, uint32_t expiration = 0);
+    static uint32_t del(tcp_client<memcache_proto> *client, const void *key, uint16_t key_len);
+
+    static bool is_complete(tcp_client<memcache_proto> *client) { return 0 == client->proto.error && client->proto.done; }
+
+    uint32_t num_requests; // also the next opaque
+    size_t parse_loc; // end of the last complete response
+    int done;
+    int error;
+
+    struct response
+    {
+        uint32_t loc;
+        uint32_t size;
+        response() : loc(0), size(0) {}
+    };
+
+    static int next_response(tcp_client<memcache_proto> *client, response *response);
+    static header *get_header(tcp_client<memcache_proto> *client, response *response) { return (header *)client->inbuf.data(response->loc); }
+    static uint8_t get_opcode(tcp_client<memcache_proto> *client, response *response) { return get_header(client, response)->opcode; }
+    static uint16_t get_status(tcp_client<memcache_proto> *client, response *response) { return ntohs(get_header(client, response)->status); }
+    static uint32_t get_opaque(tcp_client<memcache_proto> *client, response *response) { return ntohl(get_header(client, response)->opaque); }
+    static uint64_t get_cas(tcp_client<memcache_proto> *client, response *response) { return be64toh(get_header(client, response)->cas); }
+    static uint32_t get_flags(tcp_client<memcache_proto> *client, response *response);
+    static char *get_key(tcp_client<memcache_proto> *client, response *response, uint16_t *key_len);
+    static char *get_value(tcp_client<memcache_proto> *client, response *response, uint32_t *value_len);
+};
+
+/*static*/
+inline int memcache_proto::prepare(tcp_client<memcache_proto> *client)
+{
+    client->proto.num_requests = 0;
+    client->proto.parse_loc = 0;
+    client->proto.done = 0;
+    client->proto.error = 0;
+    return 0;
+}
+
+/*static*/
+inline void memcache_proto::on_error(tcp_client<memcache_proto> *client)
+{
+    client->proto.error = 1;
+}
+
+/*static*/
+inline void memcache_proto::on_connection_close(tcp_client<memcache_proto> *client)
+{
+    if (0 < memcache_proto::read_content(client))
+        client->proto.error = 1; // partial response
+}
+
+/*static*/
+inline int memcache_proto::read_content(tcp_client<memcache_proto> *client)
+{
+    memcache_proto &proto = client->proto;
+    while (!proto.done)
+    {
+        size_t avail = client->inbuf.wlocpos() - proto.parse_loc;
+        if (avail < sizeof(header))
+            return 1; // yield
+        header *h = (header *)client->inbuf.data(proto.parse_loc);
+        uint32_t body_len = ntohl(h->total_body_length);
+        if (RESPONSE_MAGIC != h->magic || body_len > MAX_BODY_SIZE)
+        {
+            proto.error = 1;
+            client->persistent = 0;
+            return 0;
+        }
+        if (avail < sizeof(header) + body_len)
+            return 1; // yield
+        proto.parse_loc += sizeof(header) + body_len;
+        if (ntohl(h->opaque) + 1 == proto.num_requests)
+            proto.done = 1; // responses come in order, this is the last one
+    }
+    if (proto.parse_loc != client->inbuf.wlocpos())
+        client->persistent = 0; // unexpected data, can't reuse the connection
+    return 0; // we are done
+}
+
+/*static*/
+inline uint32_t memcache_proto::add_request(tcp_client<memcache_proto> *client, uint8_t opcode,
+                                            const void *key, uint16_t key_len,
+                                            const void *extras, uint8_t extras_len,
+                                            const void *value, uint32_t value_len,
+                                            uint64_t cas /* = 0 */)
+{
+    uint32_t opaque = client->proto.num_requests++;
+    header h;
+    h.magic = REQUEST_MAGIC;
+    h.opcode = opcode;
+    h.key_length = htons(key_len);
+    h.extras_length = extras_len;
+    h.data_type = 0;
+    h.status = 0;
+    h.total_body_length = htonl(extras_len + key_len + value_len);
+    h.opaque = htonl(opaque);
+    h.cas = htobe64(cas);
+    client->outbuf.memcpy(&h, sizeof(h));
+    if (0 < extras_len)
+        client->outbuf.memcpy(extras, extras_len);
+    if (0 < key_len)
+        client->outbuf.memcpy(key, key_len);
+    if (0 < value_len)
+        client->outbuf.memcpy(value, value_len);
+    return opaque;
+}
+
+/*static*/
+inline uint32_t memcache_proto::get(tcp_client<memcache_proto> *client, const void *key, uint16_t key_len)
+{
+    return add_request(client, OP_GET, key, key_len, NULL, 0, NULL, 0);
+}
+
+/*
+ * one GETKQ per key (misses don't respond) followed by a NOOP, all in the
+ * same write. the i-th key's response has opaque (returned value + i)
+ */
+/*static*/
+inline uint32_t memcache_proto::get_multi(tcp_client<memcache_proto> *client, const char * const *keys, const uint16_t *key_lens, int num_keys)
+{
+    uint32_t first = client->proto.num_requests;
+    for (int i = 0; i < num_keys; ++i)
+        add_request(client, OP_GETKQ, keys[i], key_lens[i], NULL, 0, NULL, 0);
+    add_request(client, OP_NOOP, NULL, 0, NULL, 0, NULL, 0);
+    return first;
+}
+
+/*static*/
+inline uint32_t memcache_proto::set(tcp_client<memcache_proto> *client, const void *key, uint16_t key_len,
+                                    const void *value, uint32_t value_len, uint32_t flags /* = 0 */, uint32_t expiration /* = 0 */)
+{
+    uint32_t extras[2] = { htonl(flags), htonl(expiration) };
+    return add_request(client, OP_SET, key, key_len, extras, sizeof(extras), value, value_len);
+}
+
+/*static*/
+inline uint32_t memcache_proto::del(tcp_client<memcache_proto> *client, const void *key, uint16_t key_len)
+{
+    return add_request(client, OP_DELETE, key, key_len, NULL, 0, NULL, 0);
+}
+
+/*static*/
+inline int memcache_proto::next_response(tcp_client<memcache_proto> *client, response *response)
+{
+    uint32_t loc = response->loc + response->size;
+    if (loc + sizeof(header) > client->proto.parse_loc)
+        return -1;
+    header *h = (header *)client->inbuf.data(loc);
+    response->loc = loc;
+    response->size = sizeof(header) + ntohl(h->total_body_length);
+    return 0;
+}
+
+/*static*/
+inline uint32_t memcache_proto::get_flags(tcp_client<memcache_proto> *client, response *response)
+{
+    header *h = get_header(client, response);
+    if (h->extras_length < sizeof(uint32_t))
+        return 0;
+    uint32_t flags;
+    memcpy(&flags, (char *)(h + 1), sizeof(flags));
+    return ntohl(flags);
+}
+
+/*static*/
+inline char *memcache_proto::get_key(tcp_client<memcache_proto> *client, response *response, uint16_t *key_len)
+{
+    header *h = get_header(client, response);
+    *key_len = ntohs(h->key_length);
+    return (char *)(h + 1) + h->extras_length;
+}
+
+/*static*/
+inline char *memcache_proto::get_value(tcp_client<memcache_proto> *client, response *response, uint32_t *value_len)
+{
+    header *h = get_header(client, response);
+    uint16_t key_len = ntohs(h->key_length);
+    *value_len = ntohl(h->total_body_length) - h->extras_length - key_len;
+    return (char *)(h + 1) + h->extras_length + key_len;
+}
+
+#endif // _MEMCACHE_PROTO__H_
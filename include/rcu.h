@@ -0,0 +1,222 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _RCU__H_
+#define _RCU__H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "likely.h"
+
+/*
+ * quiescent state based reclamation. every reader thread has a counter,
+ * 0 while it's offline (holds no references), otherwise the epoch it saw
+ * at its last quiescent point. an object retired at epoch E is freed once
+ * all the online threads have reached E. the epoll loop goes offline
+ * around epoll_wait, so anything read while handling an event must not be
+ * kept past the handler. other reader threads call thread_online(),
+ * quiescent() and thread_offline() themselves.
+ * readers pay no locks or atomics, only thread_online() has a fence.
+ */
+struct rcu
+{
+    typedef void (*free_t)(void *);
+
+    struct per_thread
+    {
+        volatile uint64_t counter;
+        per_thread *next;
+        char padding[64 - sizeof(uint64_t) - sizeof(per_thread *)]; // a cache line each
+    };
+
+    struct retired
+    {
+        void *p;
+        free_t fn;
+        uint64_t epoch;
+        retired *next;
+    };
+
+    static inline per_thread *local();
+    static per_thread *new_per_thread();
+
+    static inline void thread_online();
+    static inline void thread_offline();
+    static inline void quiescent();
+
+    // free p with fn once no reader can see it (it was unlinked already)
+    static inline void retire(void *p, free_t fn);
+    // frees what's safe, returns the number still waiting
+    static inline uint32_t reclaim(bool wait_for_lock = true);
+    static uint32_t get_num_pending() { return *num_pending(); }
+
+    static inline uint64_t min_online_epoch();
+
+    static per_thread **threads() { static per_thread *head = NULL; return &head; }
+    static volatile uint64_t *epoch() { static volatile uint64_t e = 1; return &e; }
+    static volatile uint32_t *num_pending() { static volatile uint32_t n = 0; return &n; }
+    static pthread_mutex_t *lock() { static pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER; return &m; }
+    static retired **pending_head() { static retired *head = NULL; return &head; }
+    static retired **pending_tail() { static retired *tail = NULL; return &tail; }
+};
+
+/*
+ * pointer to the current version of a read-mostly structure (usually a
+ * hashtable which is rebuilt from time to time). readers call get() and
+ * use it as is, they must not modify it. the writer builds a new version
+ * and publishes it, the old one is deleted once all readers are done.
+ */
+template<typename T>
+struct rcu_snapshot
+{
+    rcu_snapshot() : current(NULL) {}
+    ~rcu_snapshot() { delete current; } // no readers left by now
+
+    T *get() const { return current; }
+    void publish(T *t);
+
+    static void destroy(void *p) { delete (T *)p; }
+
+    T * volatile current;
+};
+
+/*
+ * inline functions
+ */
+
+/* static */
+inline rcu::per_thread *rcu::local()
+{
+    static __thread per_thread *p = NULL;
+    if (unlikely(NULL == p))
+        p = new_per_thread();
+    return p;
+}
+
+/* static */
+inline rcu::per_thread *rcu::new_per_thread()
+{
+    void *mem;
+    if (0 != posix_memalign(&mem, 64, sizeof(per_thread)))
+        abort();
+    per_thread *p = (per_thread *)mem;
+    p->counter = 0;
+    // never removed, threads which are done stay offline
+    do
+    {
+        p->next = *threads();
+    } while (!__sync_bool_compare_and_swap(threads(), p->next, p));
+    return p;
+}
+
+/* static */
+inline void rcu::thread_online()
+{
+    per_thread *p = local();
+    p->counter = *epoch();
+    __sync_synchronize(); // visible before anything is read, or a reclaimer may miss us
+}
+
+/* static */
+inline void rcu::thread_offline()
+{
+    per_thread *p = local();
+    __sync_synchronize(); // done reading before going offline
+    p->counter = 0;
+    if (unlikely(0 < *num_pending()))
+        reclaim(false);
+}
+
+/* static */
+inline void rcu::quiescent()
+{
+    per_thread *p = local();
+    __asm__ __volatile__("" ::: "memory"); // x86 doesn't reorder stores after loads
+    p->counter = *epoch();
+}
+
+/* static */
+inline void rcu::retire(void *p, free_t fn)
+{
+    retired *r = new retired;
+    r->p = p;
+    r->fn = fn;
+    r->next = NULL;
+    pthread_mutex_lock(lock());
+    r->epoch = __sync_add_and_fetch(epoch(), 1);
+    if (NULL == *pending_head())
+        *pending_head() = r;
+    else
+        (*pending_tail())->next = r;
+    *pending_tail() = r;
+    __sync_add_and_fetch(num_pending(), 1);
+    pthread_mutex_unlock(lock());
+    reclaim();
+}
+
+/* static */
+inline uint64_t rcu::min_online_epoch()
+{
+    uint64_t min_epoch = *epoch();
+    for (per_thread *p = *threads(); NULL != p; p = p->next)
+    {
+        uint64_t c = p->counter;
+        if (0 < c && c < min_epoch)
+            min_epoch = c;
+    }
+    return min_epoch;
+}
+
+/* static */
+inline uint32_t rcu::reclaim(bool wait_for_lock /* = true */)
+{
+    if (wait_for_lock)
+        pthread_mutex_lock(lock());
+    else if (0 != pthread_mutex_trylock(lock()))
+        return *num_pending();
+    retired *r = *pending_head();
+    if (NULL != r)
+    {
+        uint64_t min_epoch = min_online_epoch();
+        // in epoch order
+        while (NULL != r && r->epoch <= min_epoch)
+        {
+            retired *next = r->next;
+            r->fn(r->p);
+            delete r;
+            __sync_sub_and_fetch(num_pending(), 1);
+            r = next;
+        }
+        *pending_head() = r;
+    }
+    pthread_mutex_unlock(lock());
+    return *num_pending();
+}
+
+template<typename T>
+inline void rcu_snapshot<T>::publish(T *t)
+{
+    __sync_synchronize(); // t is complete before readers can see it
+    T *old = __sync_lock_test_and_set(&current, t);
+    if (NULL != old)
+        rcu::retire(old, destroy);
+}
+
+#endif // _RCU__H_
@@ -21,10 +21,15 @@
 #define _RING_BUF__H_
 
 #include <unistd.h>
+#include <stdint.h>
+#include <string.h>
 
 struct ringbuf
 {
     enum { PAGEMASK = 4095, PAGESIZE };
+    // what reserve_record() does when the record doesn't fit
+    enum { REJECT_WHEN_FULL, OVERWRITE_OLDEST };
+
     ringbuf() : capacity(0), avail(0), buf(NULL) {}
     ~ringbuf() { free(); }
 
@@ -32,7 +37,7 @@ struct ringbuf
     int initfd(int fd, size_t size);
     int free();
 
-    void reset() { header->read_loc = header->write_loc = 0; }
+    void reset() { header->read_loc = header->write_loc = 0; avail = capacity; }
 
     char *wloc() { return buf + header->write_loc; }
     char *rloc() { return buf + header->read_loc; }
@@ -96,6 +101,44 @@ struct ringbuf
     bool empty() { return header->read_loc == header->write_loc; }
     bool full() { return avail == 0; }
 
+    /*
+     * variable length records, each prefixed with its length and padded to
+     * RECORD_ALIGN. don't mix with the fixed size read/write above.
+     */
+    enum { RECORD_ALIGN = sizeof(uint32_t) };
+
+    static size_t record_size(uint32_t n) { return (sizeof(uint32_t) + n + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1); }
+
+    inline char *reserve_record(uint32_t n, int policy = REJECT_WHEN_FULL);
+    void commit_record() { wseek(record_size(*(uint32_t *)wloc())); }
+    void commit_record(uint32_t n) { *(uint32_t *)wloc() = n; commit_record(); } // n <= reserved size
+
+    inline char *peek_record(uint32_t *size);
+    void skip_record() { rseek(record_size(*(uint32_t *)rloc())); }
+
+    /*
+     * iterates over the records in place, pop_records() consumes what was
+     * iterated. the records stay valid until then (or until overwritten).
+     */
+    struct record_iterator
+    {
+        char *next(uint32_t *size)
+        {
+            if (loc == end)
+                return NULL;
+            *size = *(uint32_t *)loc;
+            char *rec = loc + sizeof(uint32_t);
+            loc += record_size(*size);
+            return rec;
+        }
+
+        char *loc;
+        char *end;
+    };
+
+    record_iterator records() { record_iterator it = { rloc(), wloc() }; return it; }
+    void pop_records(const record_iterator &it) { rseek(it.loc - rloc()); }
+
     char *get_persistent_user_data() { return header->user_defined; }
 
     size_t capacity;
@@ -112,4 +155,220 @@ struct ringbuf
 
 };
 
+inline char *ringbuf::reserve_record(uint32_t n, int policy)
+{
+    size_t size = record_size(n);
+    if (size > capacity)
+        return NULL;
+    if (size > avail)
+    {
+        if (REJECT_WHEN_FULL == policy)
+            return NULL;
+        while (size > avail)
+            skip_record(); // drop the oldest
+    }
+    *(uint32_t *)wloc() = n;
+    return wloc() + sizeof(uint32_t);
+}
+
+inline char *ringbuf::peek_record(uint32_t *size)
+{
+    if (empty())
+        return NULL;
+    *size = *(uint32_t *)rloc();
+    return rloc() + sizeof(uint32_t);
+}
+
+/*
+ * lock free variants of ringbuf, sharing its mirrored mapping. the
+ * positions are 64 bit counters which never wrap (offset = pos & mask,
+ * capacity is rounded up to a power of 2), kept on separate cache lines
+ * in the header page after the ringbuf header. they are published with
+ * release stores and read with acquire loads.
+ */
+struct ringbuf_mt_header
+{
+    enum { CACHELINE = 64 };
+
+    volatile uint64_t write_loc;
+    char padding1[CACHELINE - sizeof(uint64_t)];
+    volatile uint64_t read_loc;
+    char padding2[CACHELINE - sizeof(uint64_t)];
+    uint64_t capacity;
+    char user_defined[];
+};
+
+struct ringbuf_mt_base
+{
+    ringbuf_mt_base() : header(NULL), mask(0) {}
+
+    int inittmp(size_t size);
+    int initfd(int fd, size_t size);
+    int free() { return rb.free(); }
+
+    // not thread safe
+    void reset();
+    void init_header();
+
+    size_t capacity() { return rb.capacity; }
+    size_t size() { return __atomic_load_n(&header->write_loc, __ATOMIC_ACQUIRE) - __atomic_load_n(&header->read_loc, __ATOMIC_ACQUIRE); }
+    char *data(uint64_t pos) { return rb.buf + (pos & mask); }
+
+    char *get_persistent_user_data() { return header->user_defined; }
+
+    ringbuf rb;
+    struct ringbuf_mt_header *header;
+    uint64_t mask;
+};
+
+/*
+ * single producer, single consumer. the producer can reserve several
+ * variable length records and publish them with one commit.
+ */
+struct ringbuf_spsc : ringbuf_mt_base
+{
+    ringbuf_spsc() : pending(0), cached_read_loc(0) {}
+
+    // producer
+    inline char *reserve(size_t n);
+    void commit() { __atomic_store_n(&header->write_loc, header->write_loc + pending, __ATOMIC_RELEASE); pending = 0; }
+
+    template<typename T>
+    int write(const T &val)
+    {
+        T *t = (T *)reserve(sizeof(T));
+        if (NULL == t)
+            return -1;
+        *t = val;
+        commit();
+        return 0;
+    }
+
+    // consumer
+    size_t ravail() { return __atomic_load_n(&header->write_loc, __ATOMIC_ACQUIRE) - header->read_loc; }
+    char *rloc() { return data(header->read_loc); }
+    void rseek(size_t by) { __atomic_store_n(&header->read_loc, header->read_loc + by, __ATOMIC_RELEASE); }
+
+    template<typename T>
+    int read(T *val)
+    {
+        if (ravail() < sizeof(T))
+            return -1;
+        *val = *(T *)rloc();
+        rseek(sizeof(T));
+        return 0;
+    }
+
+    // producer side
+    uint64_t pending;
+    uint64_t cached_read_loc;
+};
+
+/*
+ * multiple producers, single consumer. producers claim space with a CAS on
+ * write_loc and commit each record on its own, the consumer stops at the
+ * first record which isn't committed yet. the consumer zeroes what it
+ * releases, so a newly claimed record always starts as not committed.
+ */
+struct ringbuf_mpsc : ringbuf_mt_base
+{
+    struct record
+    {
+        uint32_t size;
+        volatile uint32_t committed;
+        char data[];
+    };
+
+    ringbuf_mpsc() : read_pos(0) {}
+
+    int inittmp(size_t size) { return init_read_pos(ringbuf_mt_base::inittmp(size)); }
+    int initfd(int fd, size_t size) { return init_read_pos(ringbuf_mt_base::initfd(fd, size)); }
+    void reset() { ringbuf_mt_base::reset(); read_pos = 0; }
+    int init_read_pos(int res) { if (0 == res) read_pos = header->read_loc; return res; }
+
+    static size_t record_size(uint32_t n) { return (sizeof(record) + n + 7) & ~7; }
+    static struct record *get_record(char *data) { return (struct record *)(data - sizeof(record)); }
+
+    // producers
+    char *reserve(uint32_t n) { char *rec; return 0 > reserve_batch(&n, 1, &rec) ? NULL : rec; }
+    inline int reserve_batch(const uint32_t *sizes, size_t num, char **recs);
+    static void commit(char *rec) { __atomic_store_n(&get_record(rec)->committed, 1, __ATOMIC_RELEASE); }
+
+    template<typename T>
+    int write(const T &val)
+    {
+        T *t = (T *)reserve(sizeof(T));
+        if (NULL == t)
+            return -1;
+        *t = val;
+        commit((char *)t);
+        return 0;
+    }
+
+    // consumer, records returned by read_next() stay valid until release()
+    inline char *read_next(uint32_t *size);
+    inline bool has_next();
+    inline void release();
+
+    uint64_t read_pos;
+};
+
+inline char *ringbuf_spsc::reserve(size_t n)
+{
+    uint64_t loc = header->write_loc + pending;
+    if (loc + n - cached_read_loc > rb.capacity)
+    {
+        cached_read_loc = __atomic_load_n(&header->read_loc, __ATOMIC_ACQUIRE);
+        if (loc + n - cached_read_loc > rb.capacity)
+            return NULL; // full
+    }
+    pending += n;
+    return data(loc);
+}
+
+inline int ringbuf_mpsc::reserve_batch(const uint32_t *sizes, size_t num, char **recs)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < num; ++i)
+        total += record_size(sizes[i]);
+    uint64_t loc;
+    do
+    {
+        loc = __atomic_load_n(&header->write_loc, __ATOMIC_RELAXED);
+        if (loc + total - __atomic_load_n(&header->read_loc, __ATOMIC_ACQUIRE) > rb.capacity)
+            return -1; // full
+    } while (!__sync_bool_compare_and_swap(&header->write_loc, loc, loc + total));
+    for (size_t i = 0; i < num; ++i)
+    {
+        struct record *r = (struct record *)data(loc);
+        r->size = sizes[i];
+        recs[i] = r->data;
+        loc += record_size(sizes[i]);
+    }
+    return 0;
+}
+
+inline bool ringbuf_mpsc::has_next()
+{
+    return read_pos != __atomic_load_n(&header->write_loc, __ATOMIC_ACQUIRE) &&
+        0 != __atomic_load_n(&((struct record *)data(read_pos))->committed, __ATOMIC_ACQUIRE);
+}
+
+inline char *ringbuf_mpsc::read_next(uint32_t *size)
+{
+    if (!has_next())
+        return NULL;
+    struct record *r = (struct record *)data(read_pos);
+    *size = r->size;
+    read_pos += record_size(r->size);
+    return r->data;
+}
+
+inline void ringbuf_mpsc::release()
+{
+    uint64_t loc = header->read_loc;
+    memset(data(loc), 0, read_pos - loc); // contiguous, the buffer is mirrored
+    __atomic_store_n(&header->read_loc, read_pos, __ATOMIC_RELEASE);
+}
+
 #endif // _RING_BUF__H_
@@ -0,0 +1,98 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _RINGBUF_CHANNEL__H_
+#define _RINGBUF_CHANNEL__H_
+
+#include <stdio.h>
+#include <errno.h>
+#include "ringbuf.h"
+#include "basic_epoll_event.h"
+
+struct ringbuf_channel;
+
+struct ringbuf_channel_listener : basic_epoll_event
+{
+    ringbuf_channel_listener() : channel(NULL) {}
+
+    struct basic_epoll_event *on_accept();
+
+    struct ringbuf_channel *channel;
+};
+
+/*
+ * shared memory channel between processes, on top of ringbuf_mpsc. the
+ * consumer creates the channel and hands the shm fd and two eventfds to
+ * producers which connect to its unix socket. producers wake the consumer
+ * through one eventfd when it waits for data, the consumer wakes producers
+ * through the other when they wait for space (backpressure). on the
+ * consumer side the channel is an epoll event, the callback is invoked with
+ * the channel and drains it with read_next().
+ */
+struct ringbuf_channel : basic_epoll_event
+{
+    struct control
+    {
+        volatile uint32_t consumer_waiting;
+        volatile uint32_t producers_waiting;
+    };
+
+    enum
+    {
+        SPACE_WAIT_TIMEOUT = 100 // milli-seconds, recheck even without wakeup
+    };
+
+    ringbuf_channel() : space_fd(-1), shm_fd(-1), ctl(NULL) {}
+
+    // consumer
+    int init(const char *path, size_t size);
+    int init_epoll(); // call from the epoll thread which consumes
+    char *read_next(uint32_t *size) { return rb.read_next(size); }
+    struct basic_epoll_event *on_data();
+
+    // producer
+    int connect(const char *path);
+    char *reserve(uint32_t n) { return rb.reserve(n); }
+    char *reserve_wait(uint32_t n); // waits while the channel is full
+    inline void commit(char *rec);
+    int write(const void *data, uint32_t n);
+
+    void close();
+
+    ringbuf_mpsc rb;
+    int space_fd;
+    int shm_fd;
+    struct control *ctl;
+    struct ringbuf_channel_listener listener;
+    basic_epoll_event_callback_method_1arg<struct ringbuf_channel *> callback;
+};
+
+inline void ringbuf_channel::commit(char *rec)
+{
+    ringbuf_mpsc::commit(rec);
+    __sync_synchronize(); // commit before checking the flag (the consumer sets the flag, then checks for records)
+    if (ctl->consumer_waiting)
+    {
+        uint64_t v = 1;
+        if (sizeof(v) != ::write(fd, &v, sizeof(v)) && EAGAIN != errno)
+            perror("write, ringbuf_channel::commit");
+    }
+}
+
+#endif // _RINGBUF_CHANNEL__H_
@@ -31,6 +31,7 @@
 #include "vmbuf.h"
 #include "epoll.h"
 #include "compact_hashtable.h"
+#include "fd_table.h"
 
 template <typename T>
 struct tcp_client : basic_epoll_event
@@ -47,7 +48,7 @@ struct tcp_client : basic_epoll_event
     } client_key_t;
     
     typedef compact_hashtable<client_key_t, struct tcp_client<T> *> persistent_clients_ht_t;
-    static struct tcp_client<T> *&clients() { static struct tcp_client<T> *c = NULL; return c; };
+    static fd_table<struct tcp_client<T> > &clients() { static fd_table<struct tcp_client<T> > c; return c; };
     static persistent_clients_ht_t *&ht_clients() { static __thread persistent_clients_ht_t *h = NULL; return h; }
     
     static void init();
@@ -101,10 +102,7 @@ void tcp_client<T>::init()
         abort();
     }
             
-    clients() = new tcp_client<T>[rl.rlim_cur];
-    tcp_client<T> *end = clients() + rl.rlim_cur;
-    int n = 0;
-    for (struct tcp_client<T> *c = clients(); c != end; c->fd = n, ++c, ++n);
+    clients().init(rl.rlim_cur);
 }
 
 template <typename T>
@@ -179,7 +177,7 @@ inline struct tcp_client<T> *tcp_client<T>::new_connection(struct in_addr addr,
     
     //printf("*** new connection (%d) ***\n", cfd);
     
-    struct tcp_client<T> *client = clients() + cfd;
+    struct tcp_client<T> *client = clients().get(cfd);
     client->init_connection(addr, port);
     return client;
 }
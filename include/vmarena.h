@@ -0,0 +1,169 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _VMARENA__H_
+#define _VMARENA__H_
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "vmbuf.h"
+#include "likely.h"
+
+/*
+ * bump pointer allocator for short lived scratch memory. nothing is freed
+ * individually, the arena is rewound as a whole (reset) or back to a mark
+ * (scope). built on vmbuf_reserved, memory is committed as the arena grows
+ * and pointers stay valid, allocations beyond reserve_size fail (NULL).
+ * typed allocations return uninitialized memory and destructors are never
+ * called, use for POD only.
+ */
+struct vmarena
+{
+    enum
+    {
+        DEFAULT_INITIAL_SIZE = vmpage::PAGESIZE << 4,
+        DEFAULT_RESERVE = 16 * 1024 * 1024
+    };
+
+    /*
+     * restores the arena to where it was when the scope was created
+     */
+    struct scope
+    {
+        scope(vmarena &a) : arena(a), mark(a.mark()) {}
+        ~scope() { arena.rewind(mark); }
+
+        vmarena &arena;
+        size_t mark;
+    };
+
+    vmarena() : reserve_size(DEFAULT_RESERVE) {}
+
+    // optional, the arena initializes itself on first use
+    int init(size_t initial_size = DEFAULT_INITIAL_SIZE, size_t reserve_size = DEFAULT_RESERVE);
+
+    void *alloc(size_t n, size_t align = sizeof(void *));
+    void *alloczero(size_t n, size_t align = sizeof(void *));
+
+    template<typename T>
+    T *alloc(size_t num = 1) { return (T *)alloc(sizeof(T) * num, __alignof__(T)); }
+
+    char *strdup(const char *s);
+    char *strndup(const char *s, size_t n);
+    char *sprintf(const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+    char *vsprintf(const char *format, va_list ap);
+
+    size_t mark() { return buf.wlocpos(); }
+    void rewind(size_t m) { buf.wlocset(m); }
+    void reset() { buf.reset(); }
+    size_t shrink() { return buf.shrink(); }
+
+    size_t used() { return buf.wlocpos(); }
+    size_t capacity() { return buf.capacity(); }
+
+    int grow(size_t n);
+
+    vmbuf_reserved buf;
+    size_t reserve_size;
+};
+
+inline int vmarena::init(size_t initial_size, size_t reserve_size)
+{
+    this->reserve_size = reserve_size;
+    return buf.init(initial_size, reserve_size);
+}
+
+inline int vmarena::grow(size_t n)
+{
+    if (NULL == buf.data())
+        return init(n > (size_t)DEFAULT_INITIAL_SIZE ? n : (size_t)DEFAULT_INITIAL_SIZE, reserve_size);
+    if (n > buf.storage.reserved)
+        return -1; // growing past the reservation would move the arena
+    size_t new_capacity = buf.capacity() << 1;
+    if (new_capacity < n)
+        new_capacity = n;
+    if (new_capacity > buf.storage.reserved)
+        new_capacity = buf.storage.reserved;
+    return buf.resize_to(new_capacity);
+}
+
+inline void *vmarena::alloc(size_t n, size_t align)
+{
+    size_t loc = (buf.wlocpos() + align - 1) & ~(align - 1);
+    if (unlikely(loc + n > buf.capacity()) && 0 > grow(loc + n))
+        return NULL;
+    buf.wlocset(loc + n);
+    return buf.data(loc);
+}
+
+inline void *vmarena::alloczero(size_t n, size_t align)
+{
+    void *p = alloc(n, align);
+    if (NULL != p)
+        memset(p, 0, n);
+    return p;
+}
+
+inline char *vmarena::strndup(const char *s, size_t n)
+{
+    char *p = (char *)alloc(n + 1, 1);
+    if (NULL == p)
+        return NULL;
+    memcpy(p, s, n);
+    p[n] = 0;
+    return p;
+}
+
+inline char *vmarena::strdup(const char *s)
+{
+    return strndup(s, strlen(s));
+}
+
+inline char *vmarena::sprintf(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    char *p = vsprintf(format, ap);
+    va_end(ap);
+    return p;
+}
+
+inline char *vmarena::vsprintf(const char *format, va_list ap)
+{
+    size_t loc = buf.wlocpos();
+    size_t avail = buf.capacity() - loc;
+    va_list apc;
+    va_copy(apc, ap);
+    int n = vsnprintf(buf.data(loc), avail, format, apc);
+    va_end(apc);
+    if (0 > n)
+        return NULL;
+    if ((size_t)n >= avail)
+    {
+        // didn't fit (or not initialized yet), grow and print again
+        if (0 > grow(loc + n + 1))
+            return NULL;
+        vsnprintf(buf.data(loc), n + 1, format, ap);
+    }
+    buf.wlocset(loc + n + 1);
+    return buf.data(loc);
+}
+
+#endif // _VMARENA__H_
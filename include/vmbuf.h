@@ -34,14 +34,19 @@ struct vmbuf_common
 {
     S storage;
 
-    vmbuf_common() : storage(), read_loc(0), write_loc(0) { unsigned int *cnt = allocated(); __sync_add_and_fetch(cnt, 1); }
-    ~vmbuf_common() { free(); unsigned int *cnt = allocated(); __sync_sub_and_fetch(cnt, 1); }
+    vmbuf_common() : storage(), read_loc(0), write_loc(0), high_water(0), resident(0), stats_tag(S::STATS_TAG), stats_committed(0), stats_reserved(0) { ++vmbuf_stats::local(stats_tag)->num_instances; }
+    ~vmbuf_common() { free(); --vmbuf_stats::local(stats_tag)->num_instances; }
 
-    void detach() { storage.detach(); }
+    void detach() { storage.detach(); sync_stats(); }
+    void swap(vmbuf_common &other);
+
+    void set_tag(uint32_t tag);
+    void sync_stats();
 
     void reset();
     int free();
     int free_most();
+    size_t shrink(size_t min_keep = 0);
 
     int resize_by(size_t by);
     int resize_to(size_t new_capacity);
@@ -78,6 +83,7 @@ struct vmbuf_common
 
     void rrewind(size_t by) { read_loc -= by; }
     void wrewind(size_t by) { write_loc -= by; }
+    void wtruncate(size_t ofs) { if (write_loc > resident) resident = write_loc; write_loc = ofs; } // shrink() can release what was above
 
     size_t capacity() { return storage.capacity; }
 
@@ -105,8 +111,13 @@ struct vmbuf_common
 
     size_t read_loc;
     size_t write_loc;
+    size_t high_water; // largest write_loc seen by reset() since the last shrink
+    size_t resident; // pages up to here may be resident
 
-    static unsigned int *allocated() { static unsigned int cnt = 0; return &cnt; }
+    // what this buffer added to vmbuf_stats
+    uint32_t stats_tag;
+    size_t stats_committed;
+    size_t stats_reserved;
 };
 
 
@@ -116,6 +127,38 @@ struct vmbuf : vmbuf_common<vmstorage_mem>
     {
         if (0 > storage.init(initial_size))
             return -1;
+        sync_stats();
+        reset();
+        return 0;
+    }
+};
+
+/*
+ * vmbuf which doesn't move when it grows (within reserve_size), pointers
+ * into it stay valid
+ */
+struct vmbuf_reserved : vmbuf_common<vmstorage_reserved>
+{
+    int init(size_t initial_size = vmpage::PAGESIZE << 6, size_t reserve_size = vmstorage_reserved::DEFAULT_RESERVE)
+    {
+        if (0 > storage.init(initial_size, reserve_size))
+            return -1;
+        sync_stats();
+        reset();
+        return 0;
+    }
+};
+
+/*
+ * vmbuf on 2MB pages, for large tables
+ */
+struct vmbuf_huge : vmbuf_common<vmstorage_huge>
+{
+    int init(size_t initial_size = vmstorage_huge::HUGEPAGESIZE)
+    {
+        if (0 > storage.init(initial_size))
+            return -1;
+        sync_stats();
         reset();
         return 0;
     }
@@ -128,6 +171,7 @@ struct vmfile : vmbuf_common<vmstorage_file>
         reset();
         if (0 > storage.init(filename, initial_size, &write_loc))
             return -1;
+        sync_stats();
         return 0;
     }
 
@@ -135,6 +179,7 @@ struct vmfile : vmbuf_common<vmstorage_file>
     {
         if (0 > storage.create(filename, initial_size))
             return -1;
+        sync_stats();
         reset();
         return 0;
     }
@@ -143,6 +188,7 @@ struct vmfile : vmbuf_common<vmstorage_file>
     {
         if (0 > storage.create(fd, initial_size))
             return -1;
+        sync_stats();
         reset();
         return 0;
     }
@@ -151,6 +197,7 @@ struct vmfile : vmbuf_common<vmstorage_file>
     {
         if (0 > storage.create_tmp(initial_size))
             return -1;
+        sync_stats();
         reset();
         return 0;
     }
@@ -159,6 +206,7 @@ struct vmfile : vmbuf_common<vmstorage_file>
     {
         if (0 > storage.load(filename, &write_loc))
             return -1;
+        sync_stats();
 
         read_loc = 0;
        	storage.close(); // can close the file after mmap
@@ -167,7 +215,9 @@ struct vmfile : vmbuf_common<vmstorage_file>
 
     int finalize()
     {
-        return storage.truncate(write_loc);
+        int res = storage.truncate(write_loc);
+        sync_stats();
+        return res;
     }
 };
 
@@ -176,9 +226,68 @@ struct vmfile : vmbuf_common<vmstorage_file>
 /// inline
 /////////////////////
 
+template<typename S>
+inline void vmbuf_common<S>::swap(vmbuf_common<S> &other)
+{
+    S s = storage;
+    storage = other.storage;
+    other.storage = s;
+    size_t loc = read_loc;
+    read_loc = other.read_loc;
+    other.read_loc = loc;
+    loc = write_loc;
+    write_loc = other.write_loc;
+    other.write_loc = loc;
+    loc = high_water;
+    high_water = other.high_water;
+    other.high_water = loc;
+    loc = resident;
+    resident = other.resident;
+    other.resident = loc;
+    sync_stats();
+    other.sync_stats();
+}
+
+/*
+ * accounts this buffer (and its current memory) under another tag
+ */
+template<typename S>
+inline void vmbuf_common<S>::set_tag(uint32_t tag)
+{
+    vmbuf_stats::counters *c = vmbuf_stats::local(stats_tag);
+    --c->num_instances;
+    c->committed -= stats_committed;
+    c->reserved -= stats_reserved;
+    stats_committed = stats_reserved = 0;
+    stats_tag = tag;
+    ++vmbuf_stats::local(stats_tag)->num_instances;
+    sync_stats();
+}
+
+template<typename S>
+inline void vmbuf_common<S>::sync_stats()
+{
+    size_t committed = storage.capacity, reserved = storage.reserved_size();
+    if (committed == stats_committed && reserved == stats_reserved)
+        return;
+    vmbuf_stats::counters *c = vmbuf_stats::local(stats_tag);
+    c->committed += (int64_t)committed - (int64_t)stats_committed;
+    c->reserved += (int64_t)reserved - (int64_t)stats_reserved;
+    if (c->committed > c->peak_committed)
+        c->peak_committed = c->committed;
+    stats_committed = committed;
+    stats_reserved = reserved;
+}
+
 template<typename S>
 inline void vmbuf_common<S>::reset()
 {
+    if (write_loc > high_water)
+    {
+        high_water = write_loc;
+        if (write_loc > resident)
+            resident = write_loc;
+    }
     read_loc = write_loc = 0;
 }
 
@@ -186,14 +295,44 @@ template<typename S>
 inline int vmbuf_common<S>::free()
 {
     reset();
-    return storage.free();
+    high_water = resident = 0;
+    int res = storage.free();
+    sync_stats();
+    return res;
 }
 
 template<typename S>
 inline int vmbuf_common<S>::free_most()
 {
     reset();
-    return storage.free_most();
+    high_water = resident = 0;
+    int res = storage.free_most();
+    sync_stats();
+    return res;
+}
+
+/*
+ * give back the pages which weren't needed since the previous shrink (the
+ * window), keeping at least min_keep bytes. the mapping and the capacity
+ * don't change, released pages read as zeros when touched again. meant to
+ * be called periodically while idle, see epoll::set_idle_callback.
+ */
+template<typename S>
+inline size_t vmbuf_common<S>::shrink(size_t min_keep /* = 0 */)
+{
+    size_t keep = high_water > write_loc ? high_water : write_loc;
+    if (keep < min_keep)
+        keep = min_keep;
+    high_water = write_loc; // start a new window
+    if (write_loc > resident)
+        resident = write_loc;
+    if (resident <= keep)
+        return 0;
+    size_t upto = resident;
+    if (0 > storage.release(keep, upto))
+        return 0;
+    resident = keep;
+    return upto - keep;
 }
 
 template<typename S>
@@ -205,7 +344,17 @@ inline int vmbuf_common<S>::resize_by(size_t by)
 template<typename S>
 inline int vmbuf_common<S>::resize_to(size_t new_capacity)
 {
-    return storage.resize_to(new_capacity);
+    char *old_buf = storage.buf;
+    int res = storage.resize_to(new_capacity);
+    if (0 == res)
+    {
+        vmbuf_stats::counters *c = vmbuf_stats::local(stats_tag);
+        ++c->num_resizes;
+        if (old_buf != storage.buf)
+            ++c->num_moves;
+    }
+    sync_stats();
+    return res;
 }
 
 template<typename S>
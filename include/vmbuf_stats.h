@@ -0,0 +1,157 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _VMBUF_STATS__H_
+#define _VMBUF_STATS__H_
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * memory accounting for vmbufs, by tag. every storage type has its own
+ * tag, more can be added (add_tag) and assigned to buffers (set_tag) to
+ * tell tables and connections apart. counters are kept per thread without
+ * atomics and summed by snapshot(). a buffer may grow on one thread and be
+ * freed on another, so a single thread's counters can go negative, the sum
+ * is what counts. the peak is the sum of the per thread peaks, an upper
+ * bound of the actual peak.
+ */
+struct vmbuf_stats
+{
+    enum
+    {
+        TAG_MEM,
+        TAG_RESERVED,
+        TAG_HUGE,
+        TAG_FILE,
+        NUM_BUILTIN_TAGS,
+        MAX_TAGS = 32
+    };
+
+    struct counters
+    {
+        int64_t num_instances;
+        int64_t committed; // bytes
+        int64_t reserved; // bytes of address space
+        int64_t peak_committed;
+        uint64_t num_resizes;
+        uint64_t num_moves; // resizes which moved the buffer
+    };
+
+    struct per_thread
+    {
+        counters tags[MAX_TAGS];
+        per_thread *next;
+    };
+
+    static inline counters *local(uint32_t tag);
+    static per_thread *new_per_thread();
+
+    static inline int add_tag(const char *name);
+    static const char *tag_name(uint32_t tag) { return tag < *num_tags() ? tag_names()[tag] : NULL; }
+    static uint32_t get_num_tags() { return *num_tags(); }
+
+    // sums all the threads into out[get_num_tags()]
+    static inline void snapshot(counters *out);
+
+    // one line per tag, into any vmbuf
+    template<typename B>
+    static void dump(B *buf);
+
+    static per_thread **threads() { static per_thread *head = NULL; return &head; }
+    static uint32_t *num_tags() { static uint32_t n = NUM_BUILTIN_TAGS; return &n; }
+    static const char **tag_names()
+    {
+        static const char *names[MAX_TAGS] = { "vmbuf", "vmbuf_reserved", "vmbuf_huge", "vmfile" };
+        return names;
+    }
+};
+
+/* static */
+inline vmbuf_stats::counters *vmbuf_stats::local(uint32_t tag)
+{
+    static __thread per_thread *p = NULL;
+    if (NULL == p)
+        p = new_per_thread();
+    return p->tags + tag;
+}
+
+/* static */
+inline vmbuf_stats::per_thread *vmbuf_stats::new_per_thread()
+{
+    per_thread *p = new per_thread;
+    memset(p->tags, 0, sizeof(p->tags));
+    // never removed, the counters outlive the thread
+    do
+    {
+        p->next = *threads();
+    } while (!__sync_bool_compare_and_swap(threads(), p->next, p));
+    return p;
+}
+
+/* static */
+inline int vmbuf_stats::add_tag(const char *name)
+{
+    uint32_t tag = __sync_fetch_and_add(num_tags(), 1);
+    if (tag >= MAX_TAGS)
+    {
+        __sync_fetch_and_sub(num_tags(), 1);
+        return -1;
+    }
+    tag_names()[tag] = name;
+    return tag;
+}
+
+/* static */
+inline void vmbuf_stats::snapshot(counters *out)
+{
+    uint32_t n = get_num_tags();
+    memset(out, 0, sizeof(counters) * n);
+    for (per_thread *p = *threads(); NULL != p; p = p->next)
+    {
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            const counters &c = p->tags[i];
+            out[i].num_instances += c.num_instances;
+            out[i].committed += c.committed;
+            out[i].reserved += c.reserved;
+            out[i].peak_committed += c.peak_committed;
+            out[i].num_resizes += c.num_resizes;
+            out[i].num_moves += c.num_moves;
+        }
+    }
+}
+
+/* static */
+template<typename B>
+inline void vmbuf_stats::dump(B *buf)
+{
+    counters c[MAX_TAGS];
+    snapshot(c);
+    buf->sprintf("%-20s %10s %14s %14s %14s %10s %10s\n", "tag", "instances", "committed", "reserved", "peak", "resizes", "moves");
+    for (uint32_t i = 0, n = get_num_tags(); i < n; ++i)
+    {
+        const char *name = tag_name(i);
+        buf->sprintf("%-20s %10lld %14lld %14lld %14lld %10llu %10llu\n", NULL == name ? "-" : name,
+                     (long long)c[i].num_instances, (long long)c[i].committed, (long long)c[i].reserved,
+                     (long long)c[i].peak_committed, (unsigned long long)c[i].num_resizes, (unsigned long long)c[i].num_moves);
+    }
+}
+
+#endif // _VMBUF_STATS__H_
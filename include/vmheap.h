@@ -47,7 +47,7 @@ public:
 };
 
 
-template <typename T, typename Pred = HeapDefaultPred<T> >
+template <typename T, typename Pred = HeapDefaultPred<T>, typename B = vmbuf>
 class vmheap
 {
 public:
@@ -93,8 +93,8 @@ private:
         T data;
     } TData;
 
-    mutable vmbuf bufData;
-    mutable vmbuf bufOfs;
+    mutable B bufData; // vmbuf_huge for very large heaps
+    mutable B bufOfs;
 
     size_t maxSize;
     size_t numItems;
@@ -105,13 +105,13 @@ private:
     void build();
 };
 
-template <typename T, typename Pred>
-inline vmheap<T, Pred>::vmheap()
+template <typename T, typename Pred, typename B>
+inline vmheap<T, Pred, B>::vmheap()
 {
 }
 
-template <typename T, typename Pred>
-inline void vmheap<T, Pred>::init(size_t nBaseSize /* = HEAP_DEFAULT_SIZE */)
+template <typename T, typename Pred, typename B>
+inline void vmheap<T, Pred, B>::init(size_t nBaseSize /* = HEAP_DEFAULT_SIZE */)
 {
     numItems = 0;
     maxSize = nBaseSize;
@@ -129,23 +129,23 @@ inline void vmheap<T, Pred>::init(size_t nBaseSize /* = HEAP_DEFAULT_SIZE */)
     }
 }
 
-template <typename T, typename Pred>
-inline const T &vmheap<T, Pred>::top() const
+template <typename T, typename Pred, typename B>
+inline const T &vmheap<T, Pred, B>::top() const
 {
     TData *data = (TData *)bufData.data();
     uint32_t *ofs = (uint32_t *)bufOfs.data();
     return data[ofs[0]].data;
 }
 
-template <typename T, typename Pred>
-inline void vmheap<T, Pred>::remove(HEAP_HANDLE handle)
+template <typename T, typename Pred, typename B>
+inline void vmheap<T, Pred, B>::remove(HEAP_HANDLE handle)
 {
     TData *data = (TData *)bufData.data();
     removeItem(data[handle].key);
 }
 
-template <typename T, typename Pred> 
-inline void vmheap<T, Pred>::removeItem(size_t index)
+template <typename T, typename Pred, typename B>
+inline void vmheap<T, Pred, B>::removeItem(size_t index)
 {
     if (index < numItems) 
     {
@@ -162,36 +162,36 @@ inline void vmheap<T, Pred>::removeItem(size_t index)
     }
 }
 
-template <typename T, typename Pred>
-inline bool vmheap<T, Pred>::validHandle(HEAP_HANDLE handle) const
+template <typename T, typename Pred, typename B>
+inline bool vmheap<T, Pred, B>::validHandle(HEAP_HANDLE handle) const
 {
     TData *data = (TData *)bufData.data();
     return ((~data[handle].key) != 0);
 }
 
-template <typename T, typename Pred>
-inline const T &vmheap<T, Pred>::getItem(HEAP_HANDLE handle) const
+template <typename T, typename Pred, typename B>
+inline const T &vmheap<T, Pred, B>::getItem(HEAP_HANDLE handle) const
 {
     TData *data = (TData *)bufData.data();
     return data[handle].data;
 }
 
-template <typename T, typename Pred>
-inline const T &vmheap<T, Pred>::getItemAt(size_t index) const
+template <typename T, typename Pred, typename B>
+inline const T &vmheap<T, Pred, B>::getItemAt(size_t index) const
 {
     TData *data = (TData *)bufData.data();
     uint32_t *ofs = (uint32_t *)bufOfs.data();
     return data[ofs[index]];
 }
 
-template <typename T, typename Pred>
-inline const T &vmheap<T, Pred>::operator[](size_t index) const
+template <typename T, typename Pred, typename B>
+inline const T &vmheap<T, Pred, B>::operator[](size_t index) const
 {
     return getItem(index);
 }
 
-template <typename T, typename Pred>
-inline void vmheap<T, Pred>::removeTop()
+template <typename T, typename Pred, typename B>
+inline void vmheap<T, Pred, B>::removeTop()
 {
     if (numItems > 0)
     {
@@ -208,8 +208,8 @@ inline void vmheap<T, Pred>::removeTop()
     }
 }
 
-template <typename T, typename Pred> 
-inline HEAP_HANDLE vmheap<T, Pred>::insert(const T &v)
+template <typename T, typename Pred, typename B>
+inline HEAP_HANDLE vmheap<T, Pred, B>::insert(const T &v)
 {
     if (full())
     {
@@ -249,32 +249,32 @@ inline HEAP_HANDLE vmheap<T, Pred>::insert(const T &v)
     return ofs[pos];
 }
 
-template <typename T, typename Pred>
-inline bool vmheap<T, Pred>::empty() const
+template <typename T, typename Pred, typename B>
+inline bool vmheap<T, Pred, B>::empty() const
 {
     return (numItems == 0);
 }
 
-template <typename T, typename Pred>
-inline size_t vmheap<T, Pred>::size() const
+template <typename T, typename Pred, typename B>
+inline size_t vmheap<T, Pred, B>::size() const
 {
     return numItems;
 }
 
-template <typename T, typename Pred>
-inline size_t vmheap<T, Pred>::capacity() const
+template <typename T, typename Pred, typename B>
+inline size_t vmheap<T, Pred, B>::capacity() const
 {
     return maxSize;
 }
 
-template <typename T, typename Pred>
-inline bool vmheap<T, Pred>::full() const
+template <typename T, typename Pred, typename B>
+inline bool vmheap<T, Pred, B>::full() const
 {
     return numItems >= maxSize;
 }
 
-template <typename T, typename Pred>
-inline void vmheap<T, Pred>::fixDown(size_t i)
+template <typename T, typename Pred, typename B>
+inline void vmheap<T, Pred, B>::fixDown(size_t i)
 {
     TData *data = (TData *)bufData.data();
     uint32_t *ofs = (uint32_t *)bufOfs.data();
@@ -299,8 +299,8 @@ inline void vmheap<T, Pred>::fixDown(size_t i)
     }
 }
 
-template <typename T, typename Pred>
-inline void vmheap<T, Pred>::build()
+template <typename T, typename Pred, typename B>
+inline void vmheap<T, Pred, B>::build()
 {
     size_t lastParent = numItems >> 1;
     for (size_t i = lastParent; i != -1; --i)
@@ -21,6 +21,9 @@
 #define _VMPOOL__H_
 
 #include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include "vmbuf.h"
 
 template<typename U>
@@ -37,14 +40,55 @@ struct vmpool_op
     void *arg;
 };
 
+/*
+ * object pool which can be used from any thread (objects can be put by a
+ * different thread than the one which got them). each thread works on its
+ * own magazine of elements, full and empty magazines are exchanged through
+ * lock free stacks. elements are allocated on demand, a magazine at a time,
+ * up to max_num_elements. get() returns NULL beyond that. elements are
+ * never freed.
+ */
 template<typename T>
 struct vmpool
 {
+    enum
+    {
+        MAGAZINE_SIZE = 64,
+        MAX_POOLS_PER_THREAD = 8 // of the same type
+    };
+
+    struct magazine
+    {
+        magazine *next;
+        uint32_t num;
+        T *elements[MAGAZINE_SIZE];
+    };
+
+    // lock free stack, the head is tagged with a version in its upper 16 bits (ABA)
+    struct depot
+    {
+        depot() : head(0) {}
+        inline void push(magazine *m);
+        inline magazine *pop();
+
+        static magazine *ptr(uint64_t h) { return (magazine *)(uintptr_t)(h & ((1ULL << 48) - 1)); }
+        static uint64_t tag(uint64_t h) { return (h >> 48) + 1; }
+
+        volatile uint64_t head;
+    };
+
+    vmpool() : max_num_elements(0), num_elements(0) {}
+
     int init(uint32_t max_num_elements);
 
     T *get();
     void put(T *e);
 
+    uint32_t get_num_elements() const { return num_elements; }
+
+    // visits the free elements held by this thread
+    void for_each_local(void (*f)(T *));
+
     static int static_init(void *arg, uint32_t n) { return ((vmpool<T> *)arg)->init(n); }
     template<typename U>
     static U *static_get(void *arg) { return ((vmpool<T> *)arg)->get(); }
@@ -53,31 +97,118 @@ struct vmpool
 
     template<typename U>
     vmpool_op<U> get_op() { return (vmpool_op<U>){ static_init, static_get<U>, static_put<U>, this }; }
-    
-    vmbuf elements;
-    vmbuf pool;
+
+    magazine *&local_magazine();
+    magazine *new_magazine();
+    magazine *grow();
+
+    depot full;
+    depot empty;
+    uint32_t max_num_elements;
+    volatile uint32_t num_elements;
 };
 
+template<typename T>
+inline void vmpool<T>::depot::push(magazine *m)
+{
+    uint64_t h;
+    do
+    {
+        h = head;
+        m->next = ptr(h);
+    } while (!__sync_bool_compare_and_swap(&head, h, (uint64_t)(uintptr_t)m | (tag(h) << 48)));
+}
+
+template<typename T>
+inline typename vmpool<T>::magazine *vmpool<T>::depot::pop()
+{
+    uint64_t h;
+    magazine *m;
+    do
+    {
+        h = head;
+        m = ptr(h);
+        if (NULL == m)
+            return NULL;
+        // m may have been popped (not freed) by now, the tag fails the CAS then
+    } while (!__sync_bool_compare_and_swap(&head, h, (uint64_t)(uintptr_t)m->next | (tag(h) << 48)));
+    return m;
+}
+
 template<typename T>
 inline int vmpool<T>::init(uint32_t max_num_elements)
 {
-    if (0 > elements.init(max_num_elements * sizeof(T)) ||
-        0 > pool.init(max_num_elements * sizeof(T *)))
-        return -1;
-    // hot pages are last, page faults will occurs from end to start
-    // for (T *p = (T *)elements.data(), *end = p + max_num_elements; p != end; ++p)
-    
-    // hot pages are first, page faults will occurs from start to end
-    for (T *p = (T *)elements.data() + max_num_elements - 1, *end = (T *)elements.data() - 1; p != end; --p)
-        put(p);
+    this->max_num_elements = max_num_elements;
     return 0;
 }
 
+template<typename T>
+inline typename vmpool<T>::magazine *&vmpool<T>::local_magazine()
+{
+    struct slot
+    {
+        vmpool<T> *pool;
+        magazine *m;
+    };
+    static __thread slot slots[MAX_POOLS_PER_THREAD];
+    slot *s = slots, *s_end = slots + MAX_POOLS_PER_THREAD;
+    for (; s != s_end && NULL != s->pool; ++s)
+        if (this == s->pool)
+            return s->m;
+    if (s == s_end)
+    {
+        fprintf(stderr, "vmpool: too many pools of the same type\n");
+        abort();
+    }
+    s->pool = this;
+    s->m = NULL;
+    return s->m;
+}
+
+template<typename T>
+inline typename vmpool<T>::magazine *vmpool<T>::new_magazine()
+{
+    magazine *m = empty.pop();
+    if (NULL == m)
+        m = new magazine;
+    m->num = 0;
+    return m;
+}
+
+template<typename T>
+inline typename vmpool<T>::magazine *vmpool<T>::grow()
+{
+    uint32_t n, cur;
+    do
+    {
+        cur = num_elements;
+        if (cur >= max_num_elements)
+            return NULL;
+        n = max_num_elements - cur;
+        if (n > MAGAZINE_SIZE)
+            n = MAGAZINE_SIZE;
+    } while (!__sync_bool_compare_and_swap(&num_elements, cur, cur + n));
+    magazine *m = new_magazine();
+    T *elements = new T[n];
+    for (m->num = 0; m->num < n; ++m->num)
+        m->elements[m->num] = elements + m->num;
+    return m;
+}
+
 template<typename T>
 inline T *vmpool<T>::get()
 {
-    pool.wrewind(sizeof(T *));
-    T *t = *(T **)pool.wloc();
+    magazine *&m = local_magazine();
+    if (NULL == m || 0 == m->num)
+    {
+        magazine *f = full.pop();
+        if (NULL == f && NULL == (f = grow()))
+            return NULL; // reached max_num_elements
+        if (NULL != m)
+            empty.push(m);
+        m = f;
+    }
+    T *t = m->elements[--m->num];
     T::init(t);
     // printf("get %p %p\n", this, t);
     return t;
@@ -87,8 +218,25 @@ template<typename T>
 inline void vmpool<T>::put(T *e)
 {
     // printf("put %p %p\n", this, e);
-    *(T **)pool.wloc() = e;
-    pool.unsafe_wseek(sizeof(T *));
+    magazine *&m = local_magazine();
+    if (NULL == m)
+        m = new_magazine();
+    else if (MAGAZINE_SIZE == m->num)
+    {
+        full.push(m);
+        m = new_magazine();
+    }
+    m->elements[m->num++] = e;
+}
+
+template<typename T>
+inline void vmpool<T>::for_each_local(void (*f)(T *))
+{
+    magazine *m = local_magazine();
+    if (NULL == m)
+        return;
+    for (uint32_t i = 0; i < m->num; ++i)
+        f(m->elements[i]);
 }
 
 #endif // _VMPOOL__H_
@@ -24,7 +24,14 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
 #include "tempfd.h"
+#include "ilog2.h"
+#include "vmbuf_stats.h"
 
 #define VMSTORAGE_RO 01
 #define VMSTORAGE_RW 02
@@ -45,17 +52,150 @@ struct vmpage
     }
 };
 
+/*
+ * per thread cache of released anonymous mappings, by size class (power of
+ * 2 number of pages). the pages are dropped with MADV_DONTNEED so a reused
+ * mapping reads as zeros like a new one, without mmap/munmap (and the
+ * mmap_sem write lock they take).
+ */
+struct vmstorage_cache
+{
+    enum
+    {
+        NUM_CLASSES = 13, // 4K to 16M
+        MAPPINGS_PER_CLASS = 4
+    };
+
+    struct size_class
+    {
+        char *mappings[MAPPINGS_PER_CLASS];
+        int num;
+    };
+
+    struct stats
+    {
+        uint64_t num_mmap;
+        uint64_t num_munmap;
+        uint64_t num_mremap;
+        uint64_t num_reused;
+        uint64_t num_cached;
+        uint64_t num_released;
+        uint64_t bytes_released;
+    };
+
+    // per thread like vmbuf_stats, no atomics on the map/unmap path
+    struct per_thread
+    {
+        stats s;
+        per_thread *next;
+    };
+
+    static size_class *classes() { static __thread size_class c[NUM_CLASSES]; return c; }
+    static per_thread **threads() { static per_thread *head = NULL; return &head; }
+
+    static stats *local()
+    {
+        static __thread per_thread *p = NULL;
+        if (NULL == p)
+        {
+            p = new per_thread;
+            memset(&p->s, 0, sizeof(p->s));
+            // never removed, the counters outlive the thread
+            do
+            {
+                p->next = *threads();
+            } while (!__sync_bool_compare_and_swap(threads(), p->next, p));
+        }
+        return &p->s;
+    }
+
+    // sums all the threads
+    static void snapshot(stats *out)
+    {
+        memset(out, 0, sizeof(stats));
+        for (per_thread *p = *threads(); NULL != p; p = p->next)
+        {
+            out->num_mmap += p->s.num_mmap;
+            out->num_munmap += p->s.num_munmap;
+            out->num_mremap += p->s.num_mremap;
+            out->num_reused += p->s.num_reused;
+            out->num_cached += p->s.num_cached;
+            out->num_released += p->s.num_released;
+            out->bytes_released += p->s.bytes_released;
+        }
+    }
+
+    // one line, into any vmbuf
+    template<typename B>
+    static void dump(B *buf)
+    {
+        stats st;
+        snapshot(&st);
+        buf->sprintf("mmap: %llu munmap: %llu mremap: %llu reused: %llu cached: %llu released: %llu (%llu bytes)\n",
+                     (unsigned long long)st.num_mmap, (unsigned long long)st.num_munmap, (unsigned long long)st.num_mremap,
+                     (unsigned long long)st.num_reused, (unsigned long long)st.num_cached,
+                     (unsigned long long)st.num_released, (unsigned long long)st.bytes_released);
+    }
+
+    static int class_of(size_t size)
+    {
+        size_t pages = size / vmpage::PAGESIZE;
+        if (0 == pages || 0 != (pages & (pages - 1)) || pages >= (1 << NUM_CLASSES))
+            return -1;
+        return ilog2(pages);
+    }
+
+    static char *map(size_t size)
+    {
+        int c = class_of(size);
+        if (0 <= c && 0 < classes()[c].num)
+        {
+            ++local()->num_reused;
+            return classes()[c].mappings[--classes()[c].num];
+        }
+        ++local()->num_mmap;
+        char *buf = (char *)mmap(NULL, size, PROT_WRITE | PROT_READ, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        return MAP_FAILED == buf ? NULL : buf;
+    }
+
+    static int release(char *from, char *to)
+    {
+        if (0 > madvise(from, to - from, MADV_DONTNEED))
+            return -1;
+        stats *s = local();
+        ++s->num_released;
+        s->bytes_released += to - from;
+        return 0;
+    }
+
+    static int unmap(char *buf, size_t size)
+    {
+        int c = class_of(size);
+        if (0 <= c && MAPPINGS_PER_CLASS > classes()[c].num && 0 == madvise(buf, size, MADV_DONTNEED))
+        {
+            ++local()->num_cached;
+            classes()[c].mappings[classes()[c].num++] = buf;
+            return 0;
+        }
+        ++local()->num_munmap;
+        return munmap(buf, size);
+    }
+};
+
 struct vmstorage_mem
 {
+    enum { STATS_TAG = vmbuf_stats::TAG_MEM };
+
     vmstorage_mem() : buf(NULL), capacity(0) {}
     void detach() { buf = NULL; capacity = 0; }
+    size_t reserved_size() const { return capacity; }
     int init(size_t initial_size)
     {
         if (NULL == buf)
         {
             initial_size = vmpage::align(initial_size);
-            buf = (char *)mmap(NULL, initial_size, PROT_WRITE | PROT_READ, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-            if (MAP_FAILED == buf)
+            buf = vmstorage_cache::map(initial_size);
+            if (NULL == buf)
             {
                 perror("mmap, vmstorage_mem::init");
                 buf = NULL;
@@ -71,7 +211,7 @@ struct vmstorage_mem
 
     int free()
     {
-        if (NULL != buf && 0 > munmap(buf, capacity))
+        if (NULL != buf && 0 > vmstorage_cache::unmap(buf, capacity))
         {
             perror("munmap vmstorage_mem::free");
             return -1;
@@ -85,6 +225,7 @@ struct vmstorage_mem
     {
         if (NULL != buf && capacity > vmpage::PAGESIZE)
         {
+            ++vmstorage_cache::local()->num_munmap;
             if (0 > munmap(buf + vmpage::PAGESIZE, capacity - vmpage::PAGESIZE))
             {
                 perror("munmap vmbuf_common<S>::free_most");
@@ -95,9 +236,25 @@ struct vmstorage_mem
         return 0;
     }
 
+    // drop the pages in [keep, upto), the mapping stays as is
+    int release(size_t keep, size_t upto)
+    {
+        keep = vmpage::align(keep);
+        upto = upto < capacity ? vmpage::align(upto) : capacity;
+        if (NULL == buf || keep >= upto)
+            return 0;
+        if (0 > vmstorage_cache::release(buf + keep, buf + upto))
+        {
+            perror("madvise vmstorage_mem::release");
+            return -1;
+        }
+        return 0;
+    }
+
     int resize_to(size_t new_capacity)
     {
         new_capacity = vmpage::align(new_capacity);
+        ++vmstorage_cache::local()->num_mremap;
         char *newaddr = (char *)mremap(buf, capacity, new_capacity, MREMAP_MAYMOVE);
         if ((void *)-1 == newaddr)
         {
@@ -114,11 +271,293 @@ struct vmstorage_mem
     size_t capacity;
 };
 
+/*
+ * 2MB pages for large buffers (fewer TLB misses). uses the hugetlbfs pool
+ * (MAP_HUGETLB) when available, otherwise 2MB aligned memory advised for
+ * transparent huge pages, which falls back to small pages by itself.
+ * capacity is always a multiple of 2MB.
+ */
+struct vmstorage_huge
+{
+    enum
+    {
+        HUGEPAGESIZE = 2 * 1024 * 1024,
+        HUGEPAGEMASK = HUGEPAGESIZE - 1,
+        STATS_TAG = vmbuf_stats::TAG_HUGE
+    };
+
+    inline static size_t align(size_t size)
+    {
+        return (size + HUGEPAGEMASK) & ~(size_t)HUGEPAGEMASK;
+    }
+
+    vmstorage_huge() : buf(NULL), capacity(0), hugetlb(0) {}
+    void detach() { buf = NULL; capacity = 0; hugetlb = 0; }
+    size_t reserved_size() const { return capacity; }
+    int init(size_t initial_size)
+    {
+        if (NULL == buf)
+        {
+            initial_size = align(initial_size);
+            buf = map(initial_size, &hugetlb);
+            if (NULL == buf)
+                return -1;
+            capacity = initial_size;
+        } else if (capacity < initial_size)
+        {
+            return resize_to(initial_size);
+        }
+        return 0;
+    }
+
+    int free()
+    {
+        if (NULL != buf && 0 > munmap(buf, capacity))
+        {
+            perror("munmap vmstorage_huge::free");
+            return -1;
+        }
+        buf = NULL;
+        capacity = 0;
+        return 0;
+    }
+
+    int free_most()
+    {
+        if (NULL != buf && capacity > HUGEPAGESIZE)
+        {
+            if (0 > munmap(buf + HUGEPAGESIZE, capacity - HUGEPAGESIZE))
+            {
+                perror("munmap vmstorage_huge::free_most");
+                return -1;
+            }
+            capacity = HUGEPAGESIZE;
+        }
+        return 0;
+    }
+
+    // drop whole huge pages in [keep, upto), the mapping stays as is
+    int release(size_t keep, size_t upto)
+    {
+        keep = align(keep);
+        upto = upto < capacity ? align(upto) : capacity;
+        if (NULL == buf || keep >= upto)
+            return 0;
+        if (0 > vmstorage_cache::release(buf + keep, buf + upto))
+        {
+            perror("madvise vmstorage_huge::release");
+            return -1;
+        }
+        return 0;
+    }
+
+    int resize_to(size_t new_capacity)
+    {
+        new_capacity = align(new_capacity);
+        if (new_capacity <= capacity)
+            return 0;
+        int new_hugetlb;
+        char *newaddr = map(new_capacity, &new_hugetlb);
+        if (NULL == newaddr)
+            return -1;
+        if (hugetlb || new_hugetlb)
+        {
+            // hugetlb mappings can't be remapped
+            memcpy(newaddr, buf, capacity);
+            munmap(buf, capacity);
+        } else
+        {
+            // move the pages (not the data) into the aligned range
+            if ((void *)-1 == mremap(buf, capacity, new_capacity, MREMAP_MAYMOVE | MREMAP_FIXED, newaddr))
+            {
+                perror("mremap vmstorage_huge::resize_to");
+                munmap(newaddr, new_capacity);
+                return -1;
+            }
+            madvise(newaddr, new_capacity, MADV_HUGEPAGE);
+        }
+        buf = newaddr;
+        capacity = new_capacity;
+        hugetlb = new_hugetlb;
+        return 0;
+    }
+
+    static char *map(size_t size, int *is_hugetlb)
+    {
+        char *addr = (char *)mmap(NULL, size, PROT_WRITE | PROT_READ, MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+        if (MAP_FAILED != addr)
+        {
+            *is_hugetlb = 1;
+            return addr;
+        }
+        *is_hugetlb = 0;
+        // no huge pages reserved, map with room to align and trim the ends
+        addr = (char *)mmap(NULL, size + HUGEPAGESIZE, PROT_WRITE | PROT_READ, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (MAP_FAILED == addr)
+        {
+            perror("mmap, vmstorage_huge::map");
+            return NULL;
+        }
+        char *aligned = (char *)align((size_t)addr);
+        if (aligned != addr)
+            munmap(addr, aligned - addr);
+        munmap(aligned + size, addr + HUGEPAGESIZE - aligned);
+        madvise(aligned, size, MADV_HUGEPAGE); // best effort, small pages otherwise
+        return aligned;
+    }
+
+    char *buf;
+    size_t capacity;
+    int hugetlb;
+};
+
+/*
+ * reserves the address range up front (PROT_NONE, no swap reserved) and
+ * commits pages in place as it grows, the buffer doesn't move as long as
+ * it stays within the reservation
+ */
+struct vmstorage_reserved
+{
+    enum
+    {
+        DEFAULT_RESERVE = 64 * 1024 * 1024,
+        STATS_TAG = vmbuf_stats::TAG_RESERVED
+    };
+
+    vmstorage_reserved() : buf(NULL), capacity(0), reserved(0) {}
+    void detach() { buf = NULL; capacity = 0; reserved = 0; }
+    size_t reserved_size() const { return reserved; }
+    int init(size_t initial_size, size_t reserve_size = DEFAULT_RESERVE)
+    {
+        if (NULL == buf)
+        {
+            initial_size = vmpage::align(initial_size);
+            reserve_size = vmpage::align(reserve_size);
+            if (reserve_size < initial_size)
+                reserve_size = initial_size;
+            buf = (char *)mmap(NULL, reserve_size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+            if (MAP_FAILED == buf)
+            {
+                perror("mmap, vmstorage_reserved::init");
+                buf = NULL;
+                return -1;
+            }
+            reserved = reserve_size;
+            return resize_to(initial_size);
+        } else if (capacity < initial_size)
+        {
+            return resize_to(initial_size);
+        }
+        return 0;
+    }
+
+    int free()
+    {
+        if (NULL != buf && 0 > munmap(buf, reserved))
+        {
+            perror("munmap vmstorage_reserved::free");
+            return -1;
+        }
+        buf = NULL;
+        capacity = 0;
+        reserved = 0;
+        return 0;
+    }
+
+    int free_most()
+    {
+        if (NULL != buf && capacity > vmpage::PAGESIZE)
+        {
+            // give the pages back but keep the range
+            if (0 > madvise(buf + vmpage::PAGESIZE, capacity - vmpage::PAGESIZE, MADV_DONTNEED) ||
+                0 > mprotect(buf + vmpage::PAGESIZE, capacity - vmpage::PAGESIZE, PROT_NONE))
+            {
+                perror("vmstorage_reserved::free_most");
+                return -1;
+            }
+            capacity = vmpage::PAGESIZE;
+        }
+        return 0;
+    }
+
+    // drop the pages in [keep, upto), they stay committed
+    int release(size_t keep, size_t upto)
+    {
+        keep = vmpage::align(keep);
+        upto = upto < capacity ? vmpage::align(upto) : capacity;
+        if (NULL == buf || keep >= upto)
+            return 0;
+        if (0 > vmstorage_cache::release(buf + keep, buf + upto))
+        {
+            perror("madvise vmstorage_reserved::release");
+            return -1;
+        }
+        return 0;
+    }
+
+    int resize_to(size_t new_capacity)
+    {
+        new_capacity = vmpage::align(new_capacity);
+        if (new_capacity > reserved && 0 > grow_reservation(new_capacity))
+            return -1;
+        if (new_capacity > capacity && 0 > mprotect(buf + capacity, new_capacity - capacity, PROT_READ | PROT_WRITE))
+        {
+            perror("mprotect vmstorage_reserved::resize_to");
+            return -1;
+        }
+        capacity = new_capacity;
+        return 0;
+    }
+
+    /*
+     * out of reserved space, move to a larger reservation. the range is
+     * split into RW and PROT_NONE mappings, which mremap can't move as
+     * one, so only the committed part is moved into the new reservation
+     * (copied where mremap refuses) and the old one is unmapped
+     */
+    int grow_reservation(size_t new_capacity)
+    {
+        size_t new_reserved = reserved;
+        do
+        {
+            new_reserved <<= 1;
+        } while (new_reserved < new_capacity);
+        char *newaddr = (char *)mmap(NULL, new_reserved, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+        if (MAP_FAILED == newaddr)
+        {
+            perror("mmap vmstorage_reserved::grow_reservation");
+            return -1;
+        }
+        if (0 < capacity && MAP_FAILED == mremap(buf, capacity, capacity, MREMAP_MAYMOVE | MREMAP_FIXED, newaddr))
+        {
+            if (0 > mprotect(newaddr, capacity, PROT_READ | PROT_WRITE))
+            {
+                perror("mprotect vmstorage_reserved::grow_reservation");
+                munmap(newaddr, new_reserved);
+                return -1;
+            }
+            memcpy(newaddr, buf, capacity);
+        }
+        if (0 > munmap(buf, reserved))
+            perror("munmap vmstorage_reserved::grow_reservation");
+        buf = newaddr;
+        reserved = new_reserved;
+        return 0;
+    }
+
+    char *buf;
+    size_t capacity;
+    size_t reserved;
+};
+
 
 struct vmstorage_file
 {
+    enum { STATS_TAG = vmbuf_stats::TAG_FILE };
+
     vmstorage_file() : buf(NULL), capacity(0), fd(-1) {}
     void detach() { buf = NULL; capacity = 0; fd = -1; }
+    size_t reserved_size() const { return capacity; }
 
     int init(const char *filename, size_t initial_size, size_t *loc)
     {
@@ -131,6 +570,8 @@ struct vmstorage_file
             return perror(filename), -1;
 
         *loc = st.st_size;
+        if (initial_size < (size_t)st.st_size)
+            initial_size = st.st_size; // keep what's in the file
 
         return create(fd, initial_size);
     }
@@ -261,6 +702,15 @@ struct vmstorage_file
         return 0;
     }
 
+    // the pages are the file's content, nothing to release
+    int release(size_t, size_t) { return 0; }
+
+    // writes the dirty pages to the file and waits for them
+    int sync() { return NULL == buf ? 0 : msync(buf, capacity, MS_SYNC); }
+
+    // drops [ofs, ofs + n) from the file, it reads as zeros after. -1 where the file system can't
+    int punch_hole(off_t ofs, off_t n) { return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, ofs, n); }
+
     int resize_to(size_t new_capacity)
     {
         new_capacity = vmpage::align(new_capacity);
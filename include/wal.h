@@ -0,0 +1,431 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _WAL__H_
+#define _WAL__H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+#include "vmbuf.h"
+#include "hash_policy.h"
+#include "logger.h"
+#include "epoll.h"
+
+/*
+ * append only write ahead log. the file starts with a checkpoint, an
+ * image of the state the records apply to, followed by the records, each
+ * with its crc32c. a new checkpoint is written to <file>.tmp and renamed
+ * over the log, which truncates it. on load the records are read up to
+ * the first torn one (a crash mid write), the next append goes there.
+ * durability:
+ *   ASYNC - each record is written at once and synced only by checkpoints,
+ *           survives the process crashing but not the machine
+ *   GROUP - records are buffered, commit() writes and syncs them with one
+ *           fdatasync. an append commits too when group_bytes are buffered
+ *           or the oldest buffered record is group_delay ms old, so when
+ *           the appends stop the caller commits, or an epoll timer does it
+ *           group_delay after the first record (set_timer). an update is
+ *           durable once the commit after it returns
+ *   SYNC  - each record is written and synced before the update returns
+ */
+struct wal;
+
+/*
+ * scheduled on the timer chain by the first record of a group, commits
+ * it when the chain's delay has passed
+ */
+struct wal_commit_timer : basic_epoll_event
+{
+    wal_commit_timer() : log(NULL) { timerclear(&last_event_ts); }
+    inline struct basic_epoll_event *on_timer();
+
+    struct wal *log;
+};
+
+struct wal
+{
+    enum
+    {
+        OFF,
+        ASYNC,
+        GROUP,
+        SYNC
+    };
+
+    enum
+    {
+        MAGIC = 0x314C4157, // WAL1
+        CLEAN = 1, // header flag: what the log is for was synced at close, nothing to replay
+        DEFAULT_GROUP_BYTES = 1 << 20,
+        DEFAULT_GROUP_DELAY = 10 // milli-seconds
+    };
+
+    struct header_t
+    {
+        uint32_t magic;
+        uint32_t flags;
+        uint64_t checkpoint_size;
+        uint32_t checkpoint_crc;
+        uint32_t reserved;
+    };
+
+    struct rec_header_t
+    {
+        uint32_t size;
+        uint32_t crc;
+    };
+
+    wal() : mode(OFF), group_bytes(DEFAULT_GROUP_BYTES), group_delay(DEFAULT_GROUP_DELAY),
+            fd(-1), size(0), checkpoint_end(0), last_rec(0), group_start(0), unsynced(false), timer_chain(NULL) {}
+
+    inline int init(const char *filename, int mode);
+    inline int checkpoint(const struct iovec *iov, int iovcnt);
+    inline int load();
+    inline const char *next(uint32_t *n);
+    inline int open();
+    inline int mark_clean();
+    inline int close();
+
+    inline char *begin(size_t n);
+    inline int end();
+    inline int commit();
+    inline int write_group();
+    // GROUP mode, on an epoll thread: the chain's delay should be group_delay
+    inline void set_timer(epoll_timer_chain *chain);
+
+    static size_t rec_size(size_t n) { return sizeof(rec_header_t) + ((n + 7) & ~7); }
+    static inline uint32_t crc(const struct iovec *iov, int iovcnt);
+    static inline uint64_t now_ms();
+    static inline int write_all(int fd, const void *buf, size_t n, off_t ofs);
+    static inline int sync_dir(const char *filename);
+
+    bool is_open() const { return 0 <= fd; }
+    bool is_clean() const { return 0 != (((header_t *)in.data())->flags & CLEAN); }
+    const char *get_checkpoint() const { return in.data(sizeof(header_t)); }
+    size_t get_checkpoint_size() const { return ((header_t *)in.data())->checkpoint_size; }
+    size_t log_size() const { return size - checkpoint_end; } // records since the checkpoint
+
+    int mode;
+    size_t group_bytes;
+    uint32_t group_delay;
+
+    vmbuf filename;
+    vmbuf group; // records not written yet
+    vmfile in; // while loading
+    int fd;
+    size_t size; // of the file
+    size_t checkpoint_end;
+    size_t last_rec;
+    uint64_t group_start;
+    bool unsynced;
+    epoll_timer_chain *timer_chain;
+    wal_commit_timer commit_timer;
+};
+
+/*
+ * inline
+ */
+inline struct basic_epoll_event *wal_commit_timer::on_timer()
+{
+    log->commit(); // logs what failed, the next commit writes the group again from where it started
+    return NULL;
+}
+
+inline int wal::init(const char *fn, int m)
+{
+    mode = m;
+    filename.init();
+    filename.strcpy(fn);
+    filename.copy<char>('\0');
+    return group.init();
+}
+
+/* static */
+inline uint32_t wal::crc(const struct iovec *iov, int iovcnt)
+{
+    uint32_t c = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        c = hash_crc32c::crc32c(c, iov[i].iov_base, iov[i].iov_len);
+    return c;
+}
+
+/* static */
+inline uint64_t wal::now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* static */
+inline int wal::write_all(int fd, const void *buf, size_t n, off_t ofs)
+{
+    const char *p = (const char *)buf;
+    while (n > 0)
+    {
+        ssize_t res = ::pwrite(fd, p, n, ofs);
+        if (0 > res)
+        {
+            if (EINTR == errno)
+                continue;
+            return -1;
+        }
+        p += res;
+        ofs += res;
+        n -= res;
+    }
+    return 0;
+}
+
+/* static */
+inline int wal::sync_dir(const char *filename)
+{
+    const char *slash = strrchr(filename, '/');
+    char dir[slash ? slash - filename + 2 : 2];
+    if (slash)
+    {
+        memcpy(dir, filename, slash - filename + 1);
+        dir[slash - filename + 1] = 0;
+    } else
+        strcpy(dir, ".");
+    int dfd = ::open(dir, O_RDONLY | O_CLOEXEC);
+    if (0 > dfd)
+        return -1;
+    int res = fsync(dfd);
+    ::close(dfd);
+    return res;
+}
+
+/*
+ * replaces the log with a new one which starts with the image (iov), the
+ * rename makes it atomic. buffered records are dropped, the image has
+ * them applied.
+ */
+inline int wal::checkpoint(const struct iovec *iov, int iovcnt)
+{
+    char tmp_filename[filename.wlocpos() + 5];
+    sprintf(tmp_filename, "%s.tmp", filename.data());
+    int tfd = ::open(tmp_filename, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    if (0 > tfd)
+        return LOGGER_PERROR_STR(tmp_filename), -1;
+    header_t header;
+    header.magic = MAGIC;
+    header.flags = 0;
+    header.checkpoint_size = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        header.checkpoint_size += iov[i].iov_len;
+    header.checkpoint_crc = crc(iov, iovcnt);
+    header.reserved = 0;
+    off_t ofs = sizeof(header);
+    int res = write_all(tfd, &header, sizeof(header), 0);
+    for (int i = 0; i < iovcnt && 0 == res; ofs += iov[i].iov_len, ++i)
+        res = write_all(tfd, iov[i].iov_base, iov[i].iov_len, ofs);
+    if (0 > res || 0 > fdatasync(tfd) || 0 > rename(tmp_filename, filename.data()))
+    {
+        LOGGER_PERROR("%s: checkpoint", filename.data()); // the old log is still there
+        ::close(tfd);
+        return -1;
+    }
+    if (0 <= fd)
+        ::close(fd);
+    fd = tfd; // at its end, the records follow
+    size = checkpoint_end = sizeof(header) + header.checkpoint_size;
+    group.reset();
+    unsynced = false;
+    epoll::cancel_timeout(&commit_timer);
+    if (0 > sync_dir(filename.data()))
+        return LOGGER_PERROR("%s: checkpoint", filename.data()), -1;
+    return 0;
+}
+
+/*
+ * maps the log to read the checkpoint (get_checkpoint) and the records
+ * (next) before open() appends to it
+ */
+inline int wal::load()
+{
+    if (0 > in.load(filename.data()))
+        return -1;
+    header_t *header = (header_t *)in.data();
+    struct iovec iov;
+    if (in.wlocpos() < sizeof(header_t) || MAGIC != header->magic ||
+        in.wlocpos() - sizeof(header_t) < header->checkpoint_size ||
+        (iov.iov_base = in.data(sizeof(header_t)), iov.iov_len = header->checkpoint_size, header->checkpoint_crc != crc(&iov, 1)))
+    {
+        LOGGER_ERROR("%s: invalid log", filename.data());
+        in.free();
+        return -1;
+    }
+    checkpoint_end = sizeof(header_t) + header->checkpoint_size;
+    in.rlocset(checkpoint_end);
+    return 0;
+}
+
+/*
+ * next record, NULL at the end of the log or at a torn record
+ */
+inline const char *wal::next(uint32_t *n)
+{
+    if (in.ravail() < sizeof(rec_header_t))
+        return NULL;
+    rec_header_t *rec = (rec_header_t *)in.rloc();
+    struct iovec iov;
+    iov.iov_base = rec + 1;
+    iov.iov_len = rec->size;
+    if (0 == rec->size || in.ravail() < rec_size(rec->size) || rec->crc != crc(&iov, 1))
+        return NULL;
+    in.rseek(rec_size(rec->size));
+    *n = rec->size;
+    return (const char *)(rec + 1);
+}
+
+/*
+ * after load() and reading the records: drops what's after the last good
+ * one and appends from there
+ */
+inline int wal::open()
+{
+    size = in.rlocpos();
+    in.free();
+    uint32_t flags = 0;
+    fd = ::open(filename.data(), O_WRONLY | O_CLOEXEC);
+    if (0 > fd || 0 > ftruncate(fd, size) ||
+        sizeof(flags) != pwrite(fd, &flags, sizeof(flags), offsetof(header_t, flags)) || 0 > fdatasync(fd))
+    {
+        LOGGER_PERROR_STR(filename.data());
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * the state the log is for was synced, the next load doesn't replay
+ */
+inline int wal::mark_clean()
+{
+    uint32_t flags = CLEAN;
+    if (0 > commit() || sizeof(flags) != pwrite(fd, &flags, sizeof(flags), offsetof(header_t, flags)) || 0 > fdatasync(fd))
+        return LOGGER_PERROR_STR(filename.data()), -1;
+    return 0;
+}
+
+inline int wal::close()
+{
+    int res = 0;
+    if (0 <= fd)
+    {
+        res = commit();
+        if (0 > ::close(fd))
+            res = -1;
+        fd = -1;
+    }
+    in.free();
+    return res;
+}
+
+/*
+ * room for a record of n bytes, valid until end()
+ */
+inline char *wal::begin(size_t n)
+{
+    if (0 == group.wlocpos())
+    {
+        group_start = now_ms();
+        if (NULL != timer_chain && GROUP == mode)
+            timer_chain->schedule(&commit_timer);
+    }
+    last_rec = group.alloc(rec_size(n));
+    rec_header_t *rec = (rec_header_t *)group.data(last_rec);
+    rec->size = n;
+    return (char *)(rec + 1);
+}
+
+inline int wal::end()
+{
+    rec_header_t *rec = (rec_header_t *)group.data(last_rec);
+    struct iovec iov;
+    iov.iov_base = rec + 1;
+    iov.iov_len = rec->size;
+    rec->crc = crc(&iov, 1);
+    memset((char *)(rec + 1) + rec->size, 0, rec_size(rec->size) - sizeof(rec_header_t) - rec->size);
+    switch (mode)
+    {
+    case ASYNC:
+        return write_group();
+    case GROUP:
+        if (group.wlocpos() < group_bytes && now_ms() - group_start < group_delay)
+            return 0;
+        // fall through
+    default:
+        return commit();
+    }
+}
+
+inline int wal::write_group()
+{
+    size_t n = group.wlocpos();
+    if (0 == n)
+        return 0;
+    // at the end of the last good write, a retry after a short one overwrites it
+    if (0 > write_all(fd, group.data(), n, size))
+        return LOGGER_PERROR_STR(filename.data()), -1;
+    size += n;
+    group.reset();
+    unsynced = true;
+    return 0;
+}
+
+inline void wal::set_timer(epoll_timer_chain *chain)
+{
+    epoll::cancel_timeout(&commit_timer);
+    timer_chain = chain;
+    commit_timer.log = this;
+    commit_timer.method.set(&wal_commit_timer::on_timer);
+}
+
+/*
+ * group commit: writes the buffered records and syncs them all at once.
+ * a failed fdatasync is fatal, the kernel may have dropped the pages it
+ * couldn't write and a second one would report them synced
+ */
+inline int wal::commit()
+{
+    epoll::cancel_timeout(&commit_timer);
+    if (0 > write_group())
+        return -1;
+    if (unsynced)
+    {
+        if (0 > fdatasync(fd))
+        {
+            LOGGER_PERROR_STR(filename.data());
+            abort();
+        }
+        unsynced = false;
+    }
+    return 0;
+}
+
+#endif // _WAL__H_
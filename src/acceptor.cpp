@@ -20,7 +20,11 @@
 #include "acceptor.h"
 #include "logger.h"
 
-/* static */ __thread struct vmpool_op<struct server_epoll_event> acceptor::pool;
+int acceptor::init(int fd, int port, int listen_backlog, vmpool_op<struct server_epoll_event> pool)
+{
+    this->pool = pool;
+    return init(fd, port, listen_backlog, (struct epoll_server_event_array *)NULL);
+}
 
 int acceptor::init(int fd, int port, int listen_backlog, struct epoll_server_event_array *events)
 {
@@ -99,15 +103,29 @@ struct basic_epoll_event *acceptor::on_accept()
     if (0 > acceptfd)
         return NULL;
     
-    /*
-    struct server_epoll_event *event = pool.get();
-    event->fd = acceptfd;
-    */
-    struct server_epoll_event *event = events->get(acceptfd);
+    struct server_epoll_event *event;
+    if (NULL != events)
+        event = events->get(acceptfd);
+    else
+    {
+        event = pool.get();
+        if (NULL == event)
+        {
+            LOGGER_ERROR_STR("server event pool exhausted, dropping connection");
+            ::close(acceptfd);
+            return NULL;
+        }
+        event->fd = acceptfd;
+        event->pool = &pool;
+    }
     
-    epoll::add(event, EPOLLET | EPOLLIN | EPOLLOUT);
+    if (0 > epoll::add(event, EPOLLET | EPOLLIN | EPOLLOUT))
+    {
+        if (NULL != event->pool)
+            event->pool->put(event);
+        return NULL;
+    }
     event->callback = callback;
-    //event->pool = &pool;
     this->accept_callback.invoke(event);
     return event; 
 }
@@ -116,16 +134,3 @@ void acceptor::init_per_thread()
 {
     epoll::add_multi(this, EPOLLIN);
 }
-
-/*
-void acceptor::init_per_thread(vmpool_op<struct server_epoll_event> p)
-{
-    pool = p;
-    epoll::add_multi(this, EPOLLIN);
-    struct rlimit rlim;
-    if (0 > ::getrlimit(RLIMIT_NOFILE, &rlim))
-        abort();
-    if (0 > pool.init(rlim.rlim_cur))
-        abort();
-}
-*/
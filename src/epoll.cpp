@@ -18,6 +18,7 @@
     along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "epoll.h"
+#include "rcu.h"
 #include <pthread.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -27,11 +28,15 @@
 __thread int epoll::epollfd = -1;
 /* static */
 epoll::callback_t epoll::per_thread_callback = NULL;
+epoll::callback_t epoll::idle_callback = NULL;
+int epoll::idle_delay = -1;
 
 /* static */
 __thread struct basic_epoll_event *epoll::server_timeout_chain;
 /* static */
 __thread struct basic_epoll_event *epoll::client_timeout_chain;
+/* static */
+__thread struct basic_epoll_event *epoll::connect_timeout_chain;
 
 /* static */
 __thread void *epoll::label_run;
@@ -44,6 +49,8 @@ __thread void *epoll::label_done;
 struct timeval epoll::server_timeout = { epoll::DEFAULT_SERVER_TIMEOUT, 0 };
 /* static */
 struct timeval epoll::client_timeout = { epoll::DEFAULT_CLIENT_TIMEOUT, 0 };
+/* static */
+struct timeval epoll::connect_timeout = { epoll::DEFAULT_CLIENT_TIMEOUT, 0 };
 
 struct epoll_timeout_handler : basic_epoll_event
 {
@@ -97,10 +104,13 @@ struct epoll_signal_handler : basic_epoll_event
 };
 
 /* static */
-int epoll::init(time_t to_server, time_t to_client)
+int epoll::init(time_t to_server, time_t to_client, time_t to_connect /* = 0 */)
 {
     server_timeout = (struct timeval) { to_server, 0 };
     client_timeout = (struct timeval) { to_client / 1000,  (to_client % 1000) * 1000 };
+    if (0 == to_connect)
+        to_connect = to_client;
+    connect_timeout = (struct timeval) { to_connect / 1000,  (to_connect % 1000) * 1000 };
     return 0;
 }
 
@@ -111,6 +121,7 @@ void *epoll::thread_main(void *arg)
     epollfd = epoll_create1(EPOLL_CLOEXEC);
     if (0 > epollfd)
         return LOGGER_PERROR_STR("epoll_create"), (void *)NULL;
+    rcu::thread_online();
 
     struct basic_epoll_event server_to_chain;
     timerclear(&server_to_chain.last_event_ts);
@@ -124,9 +135,18 @@ void *epoll::thread_main(void *arg)
     client_timeout_chain->timeout_chain_next = client_timeout_chain;
     client_timeout_chain->timeout_chain_prev = client_timeout_chain;
 
+    struct basic_epoll_event connect_to_chain;
+    timerclear(&connect_to_chain.last_event_ts);
+    connect_timeout_chain = &connect_to_chain;
+    connect_timeout_chain->timeout_chain_next = connect_timeout_chain;
+    connect_timeout_chain->timeout_chain_prev = connect_timeout_chain;
+
     if (NULL != per_thread_callback)
         if (0 > per_thread_callback())
+        {
+            rcu::thread_offline(); // online, it would hold back every reclaim
             return NULL;
+        }
     
     epoll_signal_handler::instance()->init_per_thread();
     
@@ -139,20 +159,64 @@ void *epoll::thread_main(void *arg)
     client_to_handler.init(epoll::client_timeout_chain);
     client_timeout_chain->fd = client_to_handler.fd;
     client_timeout_chain->last_event_ts = epoll::client_timeout;
+
+    epoll_timeout_handler connect_to_handler;
+    connect_to_handler.init(epoll::connect_timeout_chain);
+    connect_timeout_chain->fd = connect_to_handler.fd;
+    connect_timeout_chain->last_event_ts = epoll::connect_timeout;
     
     struct epoll_event epollev;
     label_run = &&epoll_loop;
     label_done = &&epoll_done;
+    int res;
     
  epoll_loop:
-    if (0 >= epoll_wait(epollfd, &epollev, 1, -1))
+    rcu::thread_offline(); // quiescent point, nothing from the last event is in use
+    res = epoll_wait(epollfd, &epollev, 1, idle_delay);
+    rcu::thread_online();
+    if (0 >= res)
+    {
+        if (0 == res && NULL != idle_callback)
+            idle_callback();
         goto *label_run;
+    }
     struct basic_epoll_event *e = (basic_epoll_event *)epollev.data.ptr;
     epoll::cancel_timeout(e);
     while (NULL != (e = e->invoke()));
     goto *label_run;
  epoll_done:
+    rcu::thread_offline();
+    return NULL;
+}
+
+int epoll_timer_chain::init(time_t msec)
+{
+    method.set(&epoll_timer_chain::on_timer);
+    this->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (0 > this->fd)
+    {
+        LOGGER_PERROR_STR("timerfd_create");
+        return -1;
+    }
+    chain.fd = this->fd;
+    chain.timeout_chain_next = &chain;
+    chain.timeout_chain_prev = &chain;
+    set_delay(msec);
+    return epoll::add_multi(this);
+}
+
+void epoll_timer_chain::set_delay(time_t msec)
+{
+    if (0 >= msec)
+        msec = 1; // zero will disarm the timer
+    chain.last_event_ts = (struct timeval) { msec / 1000, (msec % 1000) * 1000 };
+}
 
+struct basic_epoll_event *epoll_timer_chain::on_timer()
+{
+    uint64_t num_exp;
+    if (sizeof(num_exp) == ::read(this->fd, &num_exp, sizeof(num_exp)))
+        epoll::handle_timers(&chain);
     return NULL;
 }
 
@@ -192,6 +256,13 @@ void epoll::set_per_thread_callback(callback_t cb)
     per_thread_callback = cb;
 }
 
+/* static */
+void epoll::set_idle_callback(callback_t cb, int msec /* = DEFAULT_IDLE_DELAY */)
+{
+    idle_callback = cb;
+    idle_delay = NULL == cb ? -1 : msec;
+}
+
 /* static */
 int epoll::mask_signals()
 {
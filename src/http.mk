@@ -1,5 +1,5 @@
 TARGET=http.a
 
-SRC=epoll.cpp acceptor.cpp http_server.cpp http_client.cpp http_client_file.cpp mime_types.cpp ringbuf.cpp http_header.cpp
+SRC=epoll.cpp acceptor.cpp http_server.cpp http_client.cpp http_client_file.cpp mime_types.cpp ringbuf.cpp http_header.cpp ringbuf_channel.cpp
 
 include ../make/ribscpp.mk
@@ -28,6 +28,7 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <arpa/inet.h>
 #include "sstr.h"
 #include "logger.h"
 
@@ -42,11 +43,68 @@ SSTRL(CONNECTION_CLOSE, "close");
 #define MAX_CHUNK_SIZE (1024*1024)
 
 /* static */
-struct http_client *http_client::s_clients = NULL;
+fd_table<struct http_client> http_client::s_clients;
 
 /* static */
 __thread http_client::persistent_clients_ht_t *http_client::ht_clients = NULL;
 
+/* static */
+__thread http_client::upstream_stats_ht_t *http_client::ht_upstream_stats = NULL;
+
+/* static */
+__thread epoll_timer_chain *http_client::hedge_chain = NULL;
+
+/* static */
+time_t http_client::hedge_delay = http_client::DEFAULT_HEDGE_DELAY;
+
+static int create_socket()
+{
+    int cfd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (0 > cfd)
+    {
+        LOGGER_PERROR_STR("socket");
+        return -1;
+    }
+    const int option = 1;
+    if (0 > ::setsockopt(cfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)))
+    {
+        LOGGER_PERROR_STR("setsockopt SO_REUSEADDR");
+    }
+
+    if (0 > setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option)))
+    {
+        LOGGER_PERROR_STR("setsockopt TCP_NODELAY");
+    }
+        
+    if (::fcntl(cfd, F_SETFL, O_NONBLOCK) == -1)
+    {
+        LOGGER_PERROR_STR("fcntl O_NONBLOCK");
+    }
+    return cfd;
+}
+
+// 0 if the non-blocking connect succeeded, -1 if it failed or was shutdown by the connect timeout
+static int check_connect(int fd)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (0 > getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len))
+        return -1;
+    if (0 != err)
+        return errno = err, -1;
+    struct sockaddr_in peer;
+    len = sizeof(peer);
+    if (0 > getpeername(fd, (sockaddr *)&peer, &len))
+        return -1;
+    return 0;
+}
+
+// hedge delay derived from the upstream's response time distribution
+static time_t response_p95_msec(const latency_histogram &h)
+{
+    return (h.percentile(95) + 999) / 1000;
+}
+
 /* static */
 void http_client::init()
 {
@@ -57,14 +115,35 @@ void http_client::init()
         abort();
     }
             
-    s_clients = new http_client[rl.rlim_cur];
-    struct http_client *end = s_clients + rl.rlim_cur;
-    int n = 0;
-    for (struct http_client *c = s_clients; c != end; c->fd = n, ++c, ++n);
+    s_clients.init(rl.rlim_cur);
+}
+
+/* static */
+epoll_timer_chain *http_client::get_hedge_chain()
+{
+    if (NULL == hedge_chain)
+    {
+        hedge_chain = new epoll_timer_chain;
+        if (0 > hedge_chain->init(hedge_delay))
+            abort();
+    }
+    return hedge_chain;
 }
 
 /* static */
-struct http_client *http_client::create(struct in_addr *addr, uint16_t port)
+epoll_timer_chain *http_client::get_request_hedge_chain(upstream_stats *stats)
+{
+    if (NULL == stats->request_hedge_chain)
+    {
+        stats->request_hedge_chain = new epoll_timer_chain;
+        if (0 > stats->request_hedge_chain->init(response_p95_msec(stats->response)))
+            abort();
+    }
+    return stats->request_hedge_chain;
+}
+
+/* static */
+struct http_client *http_client::create(struct in_addr *addr, uint16_t port, struct in_addr *alt_addr /* = NULL */)
 {
     init_ht_clients();
     struct client_key k = { *addr, port, 0 };
@@ -86,39 +165,22 @@ struct http_client *http_client::create(struct in_addr *addr, uint16_t port)
         }
     }
     //printf("*** create (%hu / %u / %hu) ***\n", k.port, k.addr.s_addr, k.padding);
-    return new_connection(addr, port);
+    return new_connection(addr, port, alt_addr);
 }
 
 /* static */
-struct http_client *http_client::new_connection(struct in_addr *addr, uint16_t port)
+struct http_client *http_client::new_connection(struct in_addr *addr, uint16_t port, struct in_addr *alt_addr /* = NULL */)
 {
-    //
-    int cfd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    int cfd = create_socket();
     if (0 > cfd)
-    {
-        LOGGER_PERROR_STR("socket");
         return NULL;
-    }
-    const int option = 1;
-    if (0 > ::setsockopt(cfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)))
-    {
-        LOGGER_PERROR_STR("setsockopt SO_REUSEADDR");
-    }
-
-    if (0 > setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option)))
-    {
-        LOGGER_PERROR_STR("setsockopt TCP_NODELAY");
-    }
-        
-    if (::fcntl(cfd, F_SETFL, O_NONBLOCK) == -1)
-    {
-        LOGGER_PERROR_STR("fcntl O_NONBLOCK");
-    }
     
     //printf("*** new connection (%d) ***\n", cfd);
     
-    struct http_client *client = s_clients + cfd;
+    struct http_client *client = s_clients.get(cfd);
     client->init_connection(addr, port);
+    if (NULL != alt_addr && alt_addr->s_addr != addr->s_addr)
+        client->hedge.schedule(client, alt_addr);
     return client;
 }
 
@@ -137,6 +199,64 @@ int http_client::resolve_host_name(const char*host, struct in_addr &addr)
 
 }
 
+/* static */
+int http_client::resolve_host_names(const char*host, struct in_addr *addrs, int max_addrs)
+{
+    hostent hent;
+    int herror;
+    char buf[16384];
+    hostent *h;
+    int res = gethostbyname_r(host, &hent, buf, sizeof(buf), &h, &herror);
+    if (0 != res || NULL == h || NULL == (in_addr *)h->h_addr_list)
+        return -1;
+    int n = 0;
+    for (char **a = h->h_addr_list; NULL != *a && n < max_addrs; ++a, ++n)
+        addrs[n] = *(in_addr *)*a;
+    return n;
+}
+
+/* static */
+http_client::upstream_stats *http_client::get_upstream_stats(struct in_addr *addr, uint16_t port)
+{
+    if (NULL == ht_upstream_stats)
+    {
+        ht_upstream_stats = new upstream_stats_ht_t;
+        ht_upstream_stats->init(1024);
+    }
+    struct client_key k = { *addr, port, 0 };
+    upstream_stats_ht_t::entry_t *e = ht_upstream_stats->lookup(k);
+    if (NULL == e)
+        e = ht_upstream_stats->insert(k, upstream_stats());
+    return &e->v;
+}
+
+/* static */
+void http_client::dump_upstream_stats(vmbuf *buf)
+{
+    if (NULL == ht_upstream_stats)
+        return;
+    for (upstream_stats_ht_t::internal_entry_t *it = ht_upstream_stats->begin(), *itend = ht_upstream_stats->end(); it != itend; ++it)
+    {
+        char addr_str[INET_ADDRSTRLEN];
+        if (NULL == inet_ntop(AF_INET, &it->data.k.addr, addr_str, INET_ADDRSTRLEN))
+            continue;
+        buf->sprintf("%s:%hu connect: ", addr_str, it->data.k.port);
+        it->data.v.connect.dump(buf);
+        buf->sprintf(" response: ");
+        it->data.v.response.dump(buf);
+        buf->sprintf("\n");
+    }
+}
+
+/* static */
+void http_client::record_response(upstream_stats *stats, const struct timeval *start)
+{
+    stats->response.add(start);
+    // follow the p95 as it moves, without recomputing it on every response
+    if (NULL != stats->request_hedge_chain && 0 == (stats->response.count & 63))
+        stats->request_hedge_chain->set_delay(response_p95_msec(stats->response));
+}
+
 int http_client::prepare()
 {
     this->method.set(&http_client::write_request);
@@ -146,6 +266,7 @@ int http_client::prepare()
     persistent = 1; // assume HTTP/1.1
     chunked = -1;
     chunk_start = 0;
+    connect_state = CONNECTED;
     gettimeofday(&timer_connect, NULL);
     return 0;
 }
@@ -155,6 +276,9 @@ int http_client::init_connection(struct in_addr *addr, uint16_t port)
     key = (client_key_t) { *addr, port, 0 };
     prepare();
     chunked = -1;
+    this->method.set(&http_client::on_connect);
+    connect_state = CONNECTING;
+    hedge.state = http_client_hedge::IDLE;
     
     this->connect(addr, port);
     
@@ -163,6 +287,147 @@ int http_client::init_connection(struct in_addr *addr, uint16_t port)
     return 0;
 }
 
+int http_client::hedge_request(struct in_addr *addr, uint16_t port)
+{
+    upstream_stats *stats = get_upstream_stats(&key.addr, key.port);
+    if (MIN_HEDGE_SAMPLES > stats->response.count)
+        return -1; // p95 not known yet
+    request_hedge.client = this;
+    request_hedge.peer = NULL;
+    request_hedge.addr = *addr;
+    request_hedge.port = port;
+    request_hedge.state = http_client_request_hedge::PENDING;
+    request_hedge.method.set(&http_client_request_hedge::on_timer);
+    get_request_hedge_chain(stats)->schedule(&request_hedge);
+    return 0;
+}
+
+struct basic_epoll_event *http_client::on_connect()
+{
+    if (0 > check_connect(fd))
+    {
+        connect_state = CONNECT_FAILED;
+        switch (hedge.state)
+        {
+        case http_client_hedge::PENDING:
+            if (0 == hedge.start()) // don't wait for the hedge delay
+                return NULL;
+            break;
+        case http_client_hedge::CONNECTING:
+            return NULL; // the hedge may still win
+        }
+        return connect_error();
+    }
+    hedge.cancel();
+    get_upstream_stats(&key.addr, key.port)->connect.add(&timer_connect);
+    connect_state = CONNECTED;
+    this->method.set(&http_client::write_request);
+    return this;
+}
+
+struct basic_epoll_event *http_client::hedge_connected()
+{
+    get_upstream_stats(&hedge.addr, key.port)->connect.add(&hedge.timer_connect);
+    epoll::cancel_timeout(this); // still on the connect timeout chain
+    epoll::del(&hedge);
+    // take over the hedge's socket, this also closes the primary's socket
+    if (0 > dup2(hedge.fd, fd))
+    {
+        LOGGER_PERROR_STR("dup2");
+        hedge.cancel();
+        if (CONNECT_FAILED == connect_state)
+            return connect_error();
+        return epoll::yield(epoll::connect_timeout_chain, this);
+    }
+    ::close(hedge.fd);
+    hedge.fd = -1;
+    hedge.state = http_client_hedge::IDLE;
+    connect_state = CONNECTED;
+    this->method.set(&http_client::write_request);
+    if (0 > epoll::add(this, EPOLLET|EPOLLOUT))
+        return connect_error();
+    return this;
+}
+
+struct basic_epoll_event *http_client::connect_error()
+{
+    LOGGER_PERROR("connect [%d]", fd);
+    hedge.cancel();
+    eoh = 0; // we use eoh == 0 to detect problems
+    persistent = 0;
+    return response_done();
+}
+
+void http_client_hedge::schedule(struct http_client *c, struct in_addr *alt_addr)
+{
+    client = c;
+    addr = *alt_addr;
+    state = PENDING;
+    method.set(&http_client_hedge::on_timer);
+    http_client::get_hedge_chain()->schedule(this);
+}
+
+int http_client_hedge::start()
+{
+    epoll::cancel_timeout(this); // may still be waiting for the hedge delay
+    state = FAILED;
+    fd = create_socket();
+    if (0 > fd)
+        return -1;
+    gettimeofday(&timer_connect, NULL);
+    struct sockaddr_in server;
+    server.sin_port = htons(client->key.port);
+    server.sin_family = AF_INET;
+    server.sin_addr = addr;
+    if (0 > ::connect(fd, (sockaddr *)&server, sizeof(server)) && EINPROGRESS != errno)
+    {
+        LOGGER_PERROR_STR("connect hedge");
+        ::close(fd);
+        fd = -1;
+        return -1;
+    }
+    method.set(&http_client_hedge::on_connect);
+    if (0 > epoll::add(this, EPOLLET|EPOLLOUT)) // closes the fd on error
+    {
+        fd = -1;
+        return -1;
+    }
+    state = CONNECTING;
+    epoll::yield(epoll::connect_timeout_chain, this);
+    return 0;
+}
+
+void http_client_hedge::cancel()
+{
+    epoll::cancel_timeout(this);
+    if (0 <= fd)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+    state = IDLE;
+}
+
+struct basic_epoll_event *http_client_hedge::on_timer()
+{
+    start(); // on failure keep waiting for the primary
+    return NULL;
+}
+
+struct basic_epoll_event *http_client_hedge::on_connect()
+{
+    if (0 > check_connect(fd))
+    {
+        ::close(fd);
+        fd = -1;
+        state = FAILED;
+        if (http_client::CONNECT_FAILED == client->connect_state)
+            return client->connect_error();
+        return NULL; // the primary may still win
+    }
+    return client->hedge_connected();
+}
+
 struct basic_epoll_event *http_client::write_request()
 {
     int res = outbuf.write(fd);
@@ -172,7 +437,7 @@ struct basic_epoll_event *http_client::write_request()
     {
         LOGGER_PERROR_STR("writeRequest");
         persistent = 0;
-        return callback.invoke(this);
+        return response_done();
     }
     // finished writing request
     this->method.set(&http_client::read_response);
@@ -189,13 +454,108 @@ struct basic_epoll_event *http_client::read_response()
             eoh = 0; // error or partial response. we use eoh == 0 to detect problems
         
         persistent = 0;
-        return callback.invoke(this);
+        return response_done();
     }
     if (0 < read_content())
         return epoll::yield(epoll::client_timeout_chain, this);
+    return response_done();
+}
+
+struct basic_epoll_event *http_client::response_done()
+{
+    if (http_client_request_hedge::RUNNING == request_hedge.state && 0 == eoh)
+    {
+        // keep the socket (and with it our slot in s_clients) until the duplicate is done
+        request_hedge.state = http_client_request_hedge::PRIMARY_FAILED;
+        this->method.set(&http_client::request_hedge_wait);
+        return NULL;
+    }
+    request_hedge.cancel(); // pending timer or the losing duplicate
+    if (0 < eoh)
+        record_response(get_upstream_stats(&key.addr, key.port), &timer_connect);
     return callback.invoke(this);
 }
 
+struct basic_epoll_event *http_client::request_hedge_won(struct http_client *winner)
+{
+    // our own response is at least this late, record it so the p95 keeps its tail
+    if (http_client_request_hedge::PRIMARY_FAILED != request_hedge.state)
+        record_response(get_upstream_stats(&key.addr, key.port), &timer_connect);
+    request_hedge.peer = NULL;
+    request_hedge.state = http_client_request_hedge::IDLE;
+    epoll::cancel_timeout(this);
+    hedge.cancel();
+    epoll::del(winner);
+    // take over the winner's socket and response, this also closes our own socket
+    if (0 > dup2(winner->fd, fd))
+    {
+        LOGGER_PERROR_STR("dup2");
+        winner->persistent = 0;
+        winner->close();
+        eoh = 0;
+        persistent = 0;
+        return callback.invoke(this);
+    }
+    ::close(winner->fd);
+    inbuf.swap(winner->inbuf);
+    eoh = winner->eoh;
+    chunk_start = winner->chunk_start;
+    chunk_end = winner->chunk_end;
+    chunked = winner->chunked;
+    persistent = winner->persistent;
+    key = winner->key; // returned to the pool of the replica
+    connect_state = CONNECTED;
+    if (0 > epoll::add(this, EPOLLET|EPOLLIN))
+        persistent = 0;
+    return callback.invoke(this);
+}
+
+void http_client_request_hedge::cancel()
+{
+    epoll::cancel_timeout(this);
+    if (NULL != peer)
+    {
+        // the loser's response is still in flight, the connection can't be reused
+        epoll::cancel_timeout(peer);
+        peer->persistent = 0;
+        peer->close();
+        peer = NULL;
+    }
+    state = IDLE;
+}
+
+struct basic_epoll_event *http_client_request_hedge::on_timer()
+{
+    state = IDLE;
+    struct http_client *c = http_client::create(&addr, port);
+    if (NULL == c)
+        return NULL; // keep waiting for the primary
+    c->outbuf.memcpy(client->outbuf.data(), client->outbuf.wlocpos());
+    c->callback.set(this, &http_client_request_hedge::on_response);
+    c->yield();
+    peer = c;
+    state = RUNNING;
+    return NULL;
+}
+
+struct basic_epoll_event *http_client_request_hedge::on_response(struct http_client *c)
+{
+    peer = NULL;
+    if (0 == c->eoh) // the duplicate failed
+    {
+        c->persistent = 0;
+        c->close();
+        if (PRIMARY_FAILED == state)
+        {
+            state = IDLE;
+            return client->callback.invoke(client);
+        }
+        state = IDLE;
+        return NULL; // the primary may still succeed
+    }
+    return client->request_hedge_won(c);
+}
+
 int http_client::chunk_size()
 {
     if (0 != chunk_end)
@@ -258,6 +618,8 @@ struct basic_epoll_event *http_client::handle_disconnect()
 
 void http_client::close()
 {
+    hedge.cancel();
+    request_hedge.cancel();
     init_ht_clients();
     if (persistent > 0)
     {
@@ -42,11 +42,17 @@ SSTRL(CONNECTION_CLOSE, "close");
 #define MAX_CHUNK_SIZE (1024*1024)
 
 /* static */
-struct http_client_file *http_client_file::s_clients = NULL;
+fd_table<struct http_client_file> http_client_file::s_clients;
 
 /* static */
 __thread http_client_file::persistent_clients_ht_t *http_client_file::ht_clients = NULL;
 
+/* static */
+__thread int http_client_file::splice_pipe[2] = { -1, -1 };
+
+/* static */
+size_t http_client_file::streaming_threshold = http_client_file::DEFAULT_STREAMING_THRESHOLD;
+
 /* static */
 void http_client_file::init()
 {
@@ -57,10 +63,7 @@ void http_client_file::init()
         abort();
     }
             
-    s_clients = new http_client_file[rl.rlim_cur];
-    struct http_client_file *end = s_clients + rl.rlim_cur;
-    int n = 0;
-    for (struct http_client_file *c = s_clients; c != end; c->fd = n, ++c, ++n);
+    s_clients.init(rl.rlim_cur);
 }
 
 /* static */
@@ -121,7 +124,7 @@ struct http_client_file *http_client_file::new_connection(const char *filename,
     
     //printf("*** new connection (%d) ***\n", cfd);
     
-    struct http_client_file *client = s_clients + cfd;
+    struct http_client_file *client = s_clients.get(cfd);
     client->init_connection(addr, port);
     if (0 == client->infile.create(filename))
         return client;
@@ -129,6 +132,35 @@ struct http_client_file *http_client_file::new_connection(const char *filename,
     return NULL;
 }
 
+/* static */
+int http_client_file::init_splice_pipe()
+{
+    if (0 <= splice_pipe[0])
+        return 0;
+    if (0 > pipe2(splice_pipe, O_CLOEXEC))
+    {
+        LOGGER_PERROR_STR("pipe2");
+        splice_pipe[0] = splice_pipe[1] = -1;
+        return -1;
+    }
+    // fewer round trips per download, the default is 64K
+    if (0 > fcntl(splice_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE))
+        LOGGER_PERROR_STR("fcntl F_SETPIPE_SZ");
+    return 0;
+}
+
+/* static */
+void http_client_file::close_splice_pipe()
+{
+    // may hold data of a failed download
+    if (0 <= splice_pipe[0])
+    {
+        ::close(splice_pipe[0]);
+        ::close(splice_pipe[1]);
+        splice_pipe[0] = splice_pipe[1] = -1;
+    }
+}
+
 /* static */
 int http_client_file::resolve_host_name(const char*host, struct in_addr &addr)
 {
@@ -211,6 +243,11 @@ struct basic_epoll_event *http_client_file::read_header()
             persistent = (0 == SSTRNCMPI(CONNECTION_CLOSE, p) ? 0 : 1);
         }
         *eohp = CRLF[0]; // restore
+        if (content_length >= streaming_threshold && 0 == start_streaming())
+        {
+            this->method.set(&http_client_file::splice_content);
+            return this;
+        }
         this->method.set(&http_client_file::read_content);
         infile.memcpy(inbuf.data(eoh), inbuf.wlocpos() - eoh); // move partial content to file
         return this; // switch to content mode
@@ -234,6 +271,59 @@ struct basic_epoll_event *http_client_file::read_content()
     return epoll::yield(epoll::client_timeout_chain, this);
 }
 
+int http_client_file::start_streaming()
+{
+    if (0 > init_splice_pipe())
+        return -1;
+    // reserve the blocks up front, the file is filled by splice and mapped once at the end
+    if (0 > fallocate(infile.storage.fd, 0, 0, content_length))
+        return -1; // not supported by the file system, use the mapped file
+    size_t partial = inbuf.wlocpos() - eoh;
+    if (partial > content_length)
+        partial = content_length;
+    if ((ssize_t)partial != pwrite(infile.storage.fd, inbuf.data(eoh), partial, 0))
+        return -1;
+    file_offset = partial;
+    return 0;
+}
+
+struct basic_epoll_event *http_client_file::splice_content()
+{
+    for (;;)
+    {
+        size_t remaining = content_length - file_offset;
+        if (0 == remaining)
+        {
+            if (0 > infile.resize_to(content_length))
+                return report_error();
+            infile.wlocset(content_length);
+            infile.finalize();
+            return callback.invoke(this); // we are done
+        }
+        ssize_t res = splice(fd, NULL, splice_pipe[1], NULL, remaining, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (0 > res)
+        {
+            if (EAGAIN == errno)
+                return epoll::yield(epoll::client_timeout_chain, this);
+            LOGGER_PERROR_STR("splice from socket");
+            return report_error();
+        }
+        if (0 == res) // disconnected
+            return report_error();
+        while (0 < res)
+        {
+            ssize_t n = splice(splice_pipe[0], NULL, infile.storage.fd, &file_offset, res, SPLICE_F_MOVE);
+            if (0 >= n)
+            {
+                LOGGER_PERROR_STR("splice to file");
+                close_splice_pipe();
+                return report_error();
+            }
+            res -= n;
+        }
+    }
+}
+
 struct basic_epoll_event *http_client_file::handle_disconnect()
 {
     if (next == NULL && prev == next)
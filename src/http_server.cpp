@@ -29,6 +29,9 @@
 /* static*/
 uint32_t http_server::max_req_size = -1;
 
+/* static */
+__thread vmarena *http_server::thread_arena = NULL;
+
 #define MIN_HTTP_REQ_SIZE (5) // method(3) + space(1) + URI(1) + optional VER...
 
 // 1xx
@@ -89,6 +92,32 @@ SSTRL(CRLF, "\r\n");
 http_server::http_server()
 {
     method.set(&http_server::onInit);
+    static int tag = vmbuf_stats::add_tag("http_server");
+    if (0 <= tag)
+    {
+        inbuf.set_tag(tag);
+        header.set_tag(tag);
+        payload.set_tag(tag);
+    }
+}
+
+/* static */
+vmarena *http_server::new_arena()
+{
+    thread_arena = new vmarena;
+    static int tag = vmbuf_stats::add_tag("http_server arena");
+    if (0 <= tag)
+        thread_arena->buf.set_tag(tag);
+    return thread_arena;
+}
+
+/* static */
+size_t http_server::shrink_arena()
+{
+    if (NULL == thread_arena)
+        return 0;
+    thread_arena->reset();
+    return thread_arena->shrink();
 }
 
 struct basic_epoll_event *http_server::headerClose()
@@ -294,6 +323,16 @@ struct basic_epoll_event *http_server::onWriteNext()
     return onWriteDone();
 }
 
+struct basic_epoll_event *http_server::stats_response()
+{
+    header.reset();
+    payload.reset();
+    vmbuf_stats::dump(&payload);
+    payload.sprintf("\n");
+    vmstorage_cache::dump(&payload);
+    return response(HTTP_STATUS_200, HTTP_CONTENT_TYPE_TEXT_PLAIN);
+}
+
 int http_server::sendFile(http_server *server)
 {
     this->reset();
@@ -168,3 +168,9 @@ void logger::vlog_at(int fd, const char *filename, unsigned int linenum, const c
     end_log_line(fd, buf);
 }
 
+
+/* static */
+void logger::shrink()
+{
+    log_buf()->shrink();
+}
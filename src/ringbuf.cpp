@@ -20,6 +20,7 @@
 #include "ringbuf.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -117,3 +118,45 @@ int ringbuf::free()
     return 0;
 }
 
+
+static size_t ringbuf_mt_size(size_t size)
+{
+    // power of 2, positions are masked instead of wrapped
+    size_t n = ringbuf::PAGESIZE;
+    while (n < size)
+        n <<= 1;
+    return n;
+}
+
+int ringbuf_mt_base::inittmp(size_t size)
+{
+    if (0 > rb.inittmp(ringbuf_mt_size(size)))
+        return -1;
+    init_header();
+    reset();
+    return 0;
+}
+
+int ringbuf_mt_base::initfd(int fd, size_t size)
+{
+    if (0 > rb.initfd(fd, ringbuf_mt_size(size)))
+        return -1;
+    init_header();
+    if (header->capacity != rb.capacity)
+        reset(); // new or resized
+    return 0;
+}
+
+void ringbuf_mt_base::init_header()
+{
+    mask = rb.capacity - 1;
+    // own cache line, after ringbuf's header
+    header = (struct ringbuf_mt_header *)((char *)rb.header + ringbuf_mt_header::CACHELINE);
+}
+
+void ringbuf_mt_base::reset()
+{
+    header->write_loc = header->read_loc = 0;
+    header->capacity = rb.capacity;
+    memset(rb.buf, 0, rb.capacity);
+}
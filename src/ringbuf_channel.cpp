@@ -0,0 +1,252 @@
+/*
+    This file is part of RIBS (Robust Infrastructure for Backend Systems).
+    RIBS is an infrastructure for building great SaaS applications (but not
+    limited to).
+
+    Copyright (C) 2011 Adap.tv, Inc.
+
+    RIBS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, version 2.1 of the License.
+
+    RIBS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with RIBS.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "ringbuf_channel.h"
+#include "epoll.h"
+#include "logger.h"
+#include "tempfd.h"
+#include <string.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+enum { CHANNEL_NUM_FDS = 3 }; // shm, data eventfd, space eventfd
+
+static int unix_addr(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        LOGGER_ERROR("unix socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int ringbuf_channel::init(const char *path, size_t size)
+{
+    struct sockaddr_un addr;
+    if (0 > unix_addr(path, &addr))
+        return -1;
+    shm_fd = tempfd::create();
+    if (0 > shm_fd || 0 > rb.initfd(shm_fd, size))
+        return -1;
+    rb.reset();
+    ctl = (struct control *)rb.get_persistent_user_data();
+    ctl->consumer_waiting = 1; // until the consumer runs
+    ctl->producers_waiting = 0;
+
+    fd = eventfd(0, EFD_NONBLOCK);
+    space_fd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
+    if (0 > fd || 0 > space_fd)
+    {
+        LOGGER_PERROR_STR("eventfd");
+        return -1;
+    }
+
+    listener.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (0 > listener.fd)
+    {
+        LOGGER_PERROR_STR("socket");
+        return -1;
+    }
+    unlink(path);
+    if (0 > bind(listener.fd, (struct sockaddr *)&addr, sizeof(addr)) || 0 > listen(listener.fd, 64))
+    {
+        LOGGER_PERROR("bind/listen %s", path);
+        return -1;
+    }
+    listener.channel = this;
+    listener.method.set(&ringbuf_channel_listener::on_accept);
+    method.set(&ringbuf_channel::on_data);
+    return 0;
+}
+
+int ringbuf_channel::init_epoll()
+{
+    if (0 > epoll::add_multi(&listener, EPOLLIN))
+        return -1;
+    timerclear(&last_event_ts);
+    return epoll::add(this, EPOLLET | EPOLLIN);
+}
+
+struct basic_epoll_event *ringbuf_channel_listener::on_accept()
+{
+    int connfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (0 > connfd)
+        return NULL;
+    // hand out the fds and the size, the producer maps the same memory
+    uint64_t size = channel->rb.capacity();
+    struct iovec iov = { &size, sizeof(size) };
+    char cbuf[CMSG_SPACE(sizeof(int) * CHANNEL_NUM_FDS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * CHANNEL_NUM_FDS);
+    int fds[CHANNEL_NUM_FDS] = { channel->shm_fd, channel->fd, channel->space_fd };
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (0 > sendmsg(connfd, &msg, MSG_NOSIGNAL))
+        LOGGER_PERROR_STR("sendmsg, ringbuf_channel");
+    ::close(connfd);
+    return NULL;
+}
+
+struct basic_epoll_event *ringbuf_channel::on_data()
+{
+    uint64_t v;
+    if (0 > read(fd, &v, sizeof(v)) && EAGAIN != errno)
+        LOGGER_PERROR_STR("read, ringbuf_channel");
+    struct basic_epoll_event *e;
+    for (;;)
+    {
+        ctl->consumer_waiting = 0;
+        e = callback.invoke(this);
+        rb.release();
+        uint32_t n = __sync_lock_test_and_set(&ctl->producers_waiting, 0);
+        if (n)
+        {
+            v = n;
+            if (0 > ::write(space_fd, &v, sizeof(v)))
+                LOGGER_PERROR_STR("write, ringbuf_channel");
+        }
+        ctl->consumer_waiting = 1;
+        __sync_synchronize(); // set the flag before checking for records (producers commit, then check the flag)
+        // a claimed but uncommitted record wakes us when it's committed
+        if (!rb.has_next() || NULL != e)
+            break;
+    }
+    return e;
+}
+
+int ringbuf_channel::connect(const char *path)
+{
+    struct sockaddr_un addr;
+    if (0 > unix_addr(path, &addr))
+        return -1;
+    int connfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (0 > connfd)
+    {
+        LOGGER_PERROR_STR("socket");
+        return -1;
+    }
+    if (0 > ::connect(connfd, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        LOGGER_PERROR("connect %s", path);
+        ::close(connfd);
+        return -1;
+    }
+    uint64_t size;
+    struct iovec iov = { &size, sizeof(size) };
+    char cbuf[CMSG_SPACE(sizeof(int) * CHANNEL_NUM_FDS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    ssize_t res = recvmsg(connfd, &msg, MSG_CMSG_CLOEXEC);
+    ::close(connfd);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if ((ssize_t)sizeof(size) != res || NULL == cmsg || SCM_RIGHTS != cmsg->cmsg_type ||
+        CMSG_LEN(sizeof(int) * CHANNEL_NUM_FDS) != cmsg->cmsg_len)
+    {
+        LOGGER_ERROR("ringbuf_channel: bad handshake from %s", path);
+        return -1;
+    }
+    int fds[CHANNEL_NUM_FDS];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    shm_fd = fds[0];
+    fd = fds[1];
+    space_fd = fds[2];
+    if (0 > rb.initfd(shm_fd, size))
+        return -1;
+    ctl = (struct control *)rb.get_persistent_user_data();
+    return 0;
+}
+
+char *ringbuf_channel::reserve_wait(uint32_t n)
+{
+    if (ringbuf_mpsc::record_size(n) > rb.capacity())
+        return NULL; // never fits
+    char *rec;
+    while (NULL == (rec = reserve(n)))
+    {
+        __sync_add_and_fetch(&ctl->producers_waiting, 1);
+        // the consumer may have released before it saw us waiting
+        if (NULL != (rec = reserve(n)))
+            break;
+        struct pollfd pfd = { space_fd, POLLIN, 0 };
+        if (0 > poll(&pfd, 1, SPACE_WAIT_TIMEOUT) && EINTR != errno)
+        {
+            LOGGER_PERROR_STR("poll, ringbuf_channel");
+            return NULL;
+        }
+        uint64_t v;
+        if (0 > read(space_fd, &v, sizeof(v)) && EAGAIN != errno)
+        {
+            LOGGER_PERROR_STR("read, ringbuf_channel");
+            return NULL;
+        }
+    }
+    return rec;
+}
+
+int ringbuf_channel::write(const void *data, uint32_t n)
+{
+    char *rec = reserve_wait(n);
+    if (NULL == rec)
+        return -1;
+    memcpy(rec, data, n);
+    commit(rec);
+    return 0;
+}
+
+void ringbuf_channel::close()
+{
+    if (0 <= listener.fd)
+    {
+        ::close(listener.fd);
+        listener.fd = -1;
+    }
+    if (0 <= fd)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+    if (0 <= space_fd)
+    {
+        ::close(space_fd);
+        space_fd = -1;
+    }
+    if (0 <= shm_fd)
+    {
+        ::close(shm_fd);
+        shm_fd = -1;
+    }
+}